@@ -1,15 +1,20 @@
 
 #include "assets.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
 #include <iostream>
-#include <thread>
 
 #include "bitmap/bitmap.h"
 #include "jmath/intersect.h"
 #include "jmath/normal.h"
 #include "jmath/plane.h"
+#include "jmath/random.h"
 #include "jmath/scalar.h"
 #include "jmath/trace.h"
+#include "task_graph.h"
 #include "window/base_graphics.h"
 
 #define ENABLE_MULTITHREADING (1)
@@ -17,6 +22,45 @@
 #define MAX_LIGHTMAP_SIZE (256)
 #define SAMPLE_COUNT (250)
 #define RANDOM_NORMAL_COUNT (1000)
+#define ENABLE_ADAPTIVE_DIRECT (0)
+#define ADAPTIVE_BLOCK_SIZE (16)
+#define ADAPTIVE_IRRADIANCE_THRESHOLD (2.0f / 255.0f)
+#define LIGHT_INFLUENCE_THRESHOLD (1.0f / 255.0f)
+#define LIGHT_SELECTION_ALL (0)
+#define LIGHT_SELECTION_TREE (1)
+#define LIGHT_SELECTION_SAMPLED (2)
+#define DIRECT_LIGHT_SELECTION (LIGHT_SELECTION_ALL)
+#define LIGHT_TREE_ERROR_RATIO (0.02f)
+#define LIGHT_TREE_MAX_CUT (64)
+#define DIRECT_LIGHT_SAMPLE_COUNT (16)
+#define ENABLE_SHADOW_CUBE_MAPS (0)
+#define SHADOW_CUBE_RESOLUTION (512)
+#define SHADOW_CUBE_MAX_LIGHTS (64)
+#define ENABLE_BVH (1)
+#define ENABLE_BVH_CACHE (1)
+#define UNIFORM_GRID_DENSITY (2.0f)
+#define UNIFORM_GRID_MIN_TRIANGLES (65536)
+#define UNIFORM_GRID_MIN_OCCUPANCY (0.5f)
+#define INSTANCE_BOUNDS_PADDING_RATIO (1.0e-5f)
+#define ENABLE_BSP_PVS (1)
+#define BSP_MAX_TRIANGLES (65536)
+#define ENABLE_SHADOW_PACKETS (1)
+#define SHADOW_PACKET_SIZE (8)
+#define SHADOW_PACKET_MIN_RAYS (2)
+#define SHADOW_PACKET_MIN_COSINE (0.9f)
+#define GATHER_BATCH_LUMELS (16)
+#define GATHER_RAY_LENGTH (1000.0f)
+#define LIGHTMAP_TILE_SIZE (8)  // A power of two, at most 256.
+#define RANDOM_STREAM_DIRECT (1)
+#define RANDOM_STREAM_GATHER (2)
+#define RANDOM_STREAM_ESTIMATE (3)
+#define RANDOM_BATCH_SIZE (8)
+#define GATHER_GROUP_SIZE (64)  // At most 64, the width of a group mask.
+#define GATHER_ORIGIN_CELLS (4)
+#define ESTIMATE_SAMPLE_LUMELS (64)
+#define ENABLE_COST_ORDERING (1)
+#define COST_ORDERING_SAMPLE_LUMELS (4)
+#define PROGRESS_INTERVAL_MS (5000)
 
 using ::base::int32;
 using ::base::uint32;
@@ -42,10 +86,160 @@ inline void FindLightmapPlane(const vector4& plane, uint32* u_coeff,
   }
 }
 
+// Lightmaps accumulate one light at a time at 8 bits per channel, so each
+// light's contribution is truncated to the lightmap's precision as it lands.
+inline vector3 QuantizeTexel(const vector3& texel) {
+  return vector3((uint8)(texel.x * 255.0), (uint8)(texel.y * 255.0),
+                 (uint8)(texel.z * 255.0)) /
+         255.0;
+}
+
+// Spreads the low 8 bits of value out to the even bits of the result.
+inline uint32 SpreadTileBits(uint32 value) {
+  value &= 0xFF;
+  value = (value | (value << 4)) & 0x0F0F;
+  value = (value | (value << 2)) & 0x3333;
+  value = (value | (value << 1)) & 0x5555;
+  return value;
+}
+
+// Gathers the even bits of value into the low 8 bits of the result.
+inline uint32 GatherTileBits(uint32 value) {
+  value &= 0x5555;
+  value = (value | (value >> 1)) & 0x3333;
+  value = (value | (value >> 2)) & 0x0F0F;
+  value = (value | (value >> 4)) & 0x00FF;
+  return value;
+}
+
+// Returns the position in memory order of texel x, y. In the tiled layout the
+// lightmap is cut into LIGHTMAP_TILE_SIZE squares that are stored one after
+// another, row by row, with the texels of each full tile in Z-order. The tiles
+// along the right and bottom edges may be cut short, and their texels are
+// stored row by row so that the layout needs no padding.
+inline uint32 ComputeTexelIndex(uint32 width, uint32 height, bool tiled,
+                                uint32 x, uint32 y) {
+  if (!tiled) {
+    return y * width + x;
+  }
+
+  uint32 tile_x = x / LIGHTMAP_TILE_SIZE;
+  uint32 tile_y = y / LIGHTMAP_TILE_SIZE;
+  uint32 local_x = x - tile_x * LIGHTMAP_TILE_SIZE;
+  uint32 local_y = y - tile_y * LIGHTMAP_TILE_SIZE;
+  uint32 tile_width =
+      min(LIGHTMAP_TILE_SIZE, width - tile_x * LIGHTMAP_TILE_SIZE);
+  uint32 tile_height =
+      min(LIGHTMAP_TILE_SIZE, height - tile_y * LIGHTMAP_TILE_SIZE);
+  uint32 tile_start = tile_y * LIGHTMAP_TILE_SIZE * width +
+                      tile_x * LIGHTMAP_TILE_SIZE * tile_height;
+
+  if (tile_width == LIGHTMAP_TILE_SIZE && tile_height == LIGHTMAP_TILE_SIZE) {
+    return tile_start +
+           (SpreadTileBits(local_x) | (SpreadTileBits(local_y) << 1));
+  }
+
+  return tile_start + local_y * tile_width + local_x;
+}
+
+inline float32 MaxChannel(const vector3& value) {
+  return max(max(value.x, value.y), value.z);
+}
+
+// Returns true if a sphere lies entirely outside the cone of segments that
+// start at apex, spread at most cone_angle from axis, and are at most
+// max_length long.
+inline bool PacketConeExcludesSphere(const vector3& apex, const vector3& axis,
+                                     float32 cone_angle, float32 max_length,
+                                     const vector3& center, float32 radius) {
+  vector3 offset = center - apex;
+  float32 distance = sqrt((double)offset.dot(offset));
+  if (distance <= radius) {
+    return false;
+  }
+
+  float32 center_angle =
+      acos(::base::clip_range(offset.dot(axis) / distance, -1.0f, 1.0f));
+  return center_angle - asin(radius / distance) > cone_angle ||
+         distance - radius > max_length;
+}
+
+// Returns the reciprocal of each direction component, substituting a large
+// finite value for zero components so that slab tests never produce NaNs.
+inline vector3 InverseDirection(const vector3& dir) {
+  return vector3(dir.x != 0.0f ? 1.0f / dir.x : 1.0e30f,
+                 dir.y != 0.0f ? 1.0f / dir.y : 1.0e30f,
+                 dir.z != 0.0f ? 1.0f / dir.z : 1.0e30f);
+}
+
+// Returns true if the segment start + t * dir, for t in [0, t_max], overlaps
+// the box. The far distance is padded slightly so that segments grazing the
+// flat bounds of axis aligned triangles are not rejected by rounding.
+inline bool SegmentOverlapsBounds(const vector3& start,
+                                  const vector3& inverse_dir, float32 t_max,
+                                  const float32* bounds_min,
+                                  const float32* bounds_max) {
+  float32 t_near = 0.0f;
+  float32 t_far = t_max;
+
+  for (int32 axis = 0; axis < 3; axis++) {
+    float32 t0 = (bounds_min[axis] - start[axis]) * inverse_dir[axis];
+    float32 t1 = (bounds_max[axis] - start[axis]) * inverse_dir[axis];
+    t_near = max(t_near, min(t0, t1));
+    t_far = min(t_far, max(t0, t1));
+  }
+
+  return t_near <= t_far * 1.0001f + BASE_EPSILON;
+}
+
+inline vector3 QueryBoxCenter(const float32* bounds_min,
+                              const float32* bounds_max) {
+  return vector3(0.5f * (bounds_min[0] + bounds_max[0]),
+                 0.5f * (bounds_min[1] + bounds_max[1]),
+                 0.5f * (bounds_min[2] + bounds_max[2]));
+}
+
+// Maps a box in an instance's space to a box in world space that contains it,
+// in place. The box is padded so that it also contains the world space
+// triangles, whose vertices were rounded when they were transformed.
+inline void TransformBoxBounds(const ::base::matrix4& transform,
+                               float32* bounds_min, float32* bounds_max) {
+  float32 center[3], half_extent[3];
+  for (uint32 axis = 0; axis < 3; axis++) {
+    center[axis] = 0.5f * (bounds_min[axis] + bounds_max[axis]);
+    half_extent[axis] = 0.5f * (bounds_max[axis] - bounds_min[axis]);
+  }
+
+  for (uint32 row = 0; row < 3; row++) {
+    float32 world_center = transform[row + 12];
+    float32 world_half_extent = 0.0f;
+    for (uint32 column = 0; column < 3; column++) {
+      world_center += transform[row + 4 * column] * center[column];
+      world_half_extent +=
+          fabs(transform[row + 4 * column]) * half_extent[column];
+    }
+
+    world_half_extent += INSTANCE_BOUNDS_PADDING_RATIO *
+                         (fabs(world_center) + world_half_extent);
+    bounds_min[row] = world_center - world_half_extent;
+    bounds_max[row] = world_center + world_half_extent;
+  }
+}
+
+inline vector3 QueryBoxExtent(const float32* bounds_min,
+                              const float32* bounds_max) {
+  return vector3(bounds_max[0] - bounds_min[0], bounds_max[1] - bounds_min[1],
+                 bounds_max[2] - bounds_min[2]);
+}
+
 /* Simple method to read one line from a file. */
 void ReadOneLine(FILE* f, char* string) {
   do {
-    fgets(string, 75, f);
+    // The end of the file reads as an empty line.
+    if (!fgets(string, 75, f)) {
+      string[0] = 0;
+      return;
+    }
   } while ((string[0] == '/') || (string[0] == '\n') || (string[0] == '#'));
 }
 
@@ -54,28 +248,36 @@ Light::Light(const vector3& position, const vector4& color, float32 intensity) {
   color_ = color;
   intensity_ = intensity;
   enabled_ = false;
+
+  // Lighting is gamma corrected (1/2.6) before it is quantized, so a light
+  // only reaches LIGHT_INFLUENCE_THRESHOLD once its linear contribution
+  // (500 * I * color / (1 + d^2)) exceeds the threshold raised to 2.6.
+  float32 max_channel = max(max(color.x, color.y), color.z);
+  float32 linear_threshold = pow(LIGHT_INFLUENCE_THRESHOLD, 2.6f);
+  float32 reach = (500.0f * intensity * max_channel) / linear_threshold - 1.0f;
+  influence_radius_ = reach > 0.0f ? sqrt(reach) : 0.0f;
 }
 
 Texture::Texture(const ::std::string& filename) {
   texture_width_ = 0;
   texture_height_ = 0;
+  texture_data_ = NULL;
+  texture_tiled_ = false;
   gl_texture_index_ = 0;
 
   if (!::base::LoadBitmapImage(filename, &texture_map_, &texture_width_,
                                &texture_height_)) {
-    cout << "Failed to load bitmap image " << filename << endl;
     return;
   }
 
-  UploadTexture();
-
-  cout << "Successfully loaded texture " << filename << "." << endl;
+  texture_data_ = texture_map_.data();
 }
 
-Texture::Texture(uint32 width, uint32 height) {
-  texture_map_.resize(width * height * 3);
+Texture::Texture(uint32 width, uint32 height, uint8* pixels) {
+  texture_data_ = pixels;
   texture_width_ = width;
   texture_height_ = height;
+  texture_tiled_ = false;
   gl_texture_index_ = 0;
 }
 
@@ -90,16 +292,16 @@ void Texture::BlurTexture(int32 radius, int32 step) {
         if (i + k < 0 || i + k >= texture_width_) {
           continue;
         }
-        temp_val += vector3(texture_map_[texel_offset + k * 3],
-                            texture_map_[texel_offset + k * 3 + 1],
-                            texture_map_[texel_offset + k * 3 + 2]);
+        temp_val += vector3(texture_data_[texel_offset + k * 3],
+                            texture_data_[texel_offset + k * 3 + 1],
+                            texture_data_[texel_offset + k * 3 + 2]);
         accum_count++;
       }
       if (accum_count) {
         temp_val /= accum_count;
-        texture_map_[texel_offset + 0] = temp_val.x;
-        texture_map_[texel_offset + 1] = temp_val.y;
-        texture_map_[texel_offset + 2] = temp_val.z;
+        texture_data_[texel_offset + 0] = temp_val.x;
+        texture_data_[texel_offset + 1] = temp_val.y;
+        texture_data_[texel_offset + 2] = temp_val.z;
       }
     }
   }
@@ -115,16 +317,16 @@ void Texture::BlurTexture(int32 radius, int32 step) {
           continue;
         }
         temp_val +=
-            vector3(texture_map_[texel_offset + k * texture_width_ * 3],
-                    texture_map_[texel_offset + k * texture_width_ * 3 + 1],
-                    texture_map_[texel_offset + k * texture_width_ * 3 + 2]);
+            vector3(texture_data_[texel_offset + k * texture_width_ * 3],
+                    texture_data_[texel_offset + k * texture_width_ * 3 + 1],
+                    texture_data_[texel_offset + k * texture_width_ * 3 + 2]);
         accum_count++;
       }
       if (accum_count) {
         temp_val /= accum_count;
-        texture_map_[texel_offset + 0] = temp_val.x;
-        texture_map_[texel_offset + 1] = temp_val.y;
-        texture_map_[texel_offset + 2] = temp_val.z;
+        texture_data_[texel_offset + 0] = temp_val.x;
+        texture_data_[texel_offset + 1] = temp_val.y;
+        texture_data_[texel_offset + 2] = temp_val.z;
       }
     }
   }
@@ -139,7 +341,70 @@ void Texture::UploadTexture() {
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, texture_width_, texture_height_, 0,
-               GL_RGB, GL_UNSIGNED_BYTE, texture_map_.data());
+               GL_RGB, GL_UNSIGNED_BYTE, texture_data_);
+}
+
+void Texture::SetTiledLayout(bool tiled) {
+  if (tiled == texture_tiled_) {
+    return;
+  }
+
+  ::std::vector<uint8> source(texture_data_,
+                              texture_data_ +
+                                  texture_width_ * texture_height_ * 3);
+  for (uint32 y = 0; y < texture_height_; y++) {
+    for (uint32 x = 0; x < texture_width_; x++) {
+      uint32 from = ComputeTexelIndex(texture_width_, texture_height_,
+                                      texture_tiled_, x, y) *
+                    3;
+      uint32 to =
+          ComputeTexelIndex(texture_width_, texture_height_, tiled, x, y) * 3;
+      memcpy(texture_data_ + to, &source[from], 3);
+    }
+  }
+
+  texture_tiled_ = tiled;
+}
+
+void Texture::CopyLinearPixels(uint8* pixels) const {
+  for (uint32 y = 0; y < texture_height_; y++) {
+    for (uint32 x = 0; x < texture_width_; x++) {
+      memcpy(pixels + (y * texture_width_ + x) * 3,
+             texture_data_ + QueryTexelIndex(x, y) * 3, 3);
+    }
+  }
+}
+
+uint32 Texture::QueryTexelIndex(uint32 x, uint32 y) const {
+  return ComputeTexelIndex(texture_width_, texture_height_, texture_tiled_, x,
+                           y);
+}
+
+void Texture::QueryTexelCoords(uint32 index, uint32* x, uint32* y) const {
+  if (!texture_tiled_) {
+    *x = index % texture_width_;
+    *y = index / texture_width_;
+    return;
+  }
+
+  // Invert ComputeTexelIndex: find the row of tiles, then the tile within
+  // it, then the texel within the tile.
+  uint32 tile_y = index / (LIGHTMAP_TILE_SIZE * texture_width_);
+  uint32 tile_height =
+      min(LIGHTMAP_TILE_SIZE, texture_height_ - tile_y * LIGHTMAP_TILE_SIZE);
+  index -= tile_y * LIGHTMAP_TILE_SIZE * texture_width_;
+  uint32 tile_x = index / (LIGHTMAP_TILE_SIZE * tile_height);
+  uint32 tile_width =
+      min(LIGHTMAP_TILE_SIZE, texture_width_ - tile_x * LIGHTMAP_TILE_SIZE);
+  index -= tile_x * LIGHTMAP_TILE_SIZE * tile_height;
+
+  if (tile_width == LIGHTMAP_TILE_SIZE && tile_height == LIGHTMAP_TILE_SIZE) {
+    *x = tile_x * LIGHTMAP_TILE_SIZE + GatherTileBits(index);
+    *y = tile_y * LIGHTMAP_TILE_SIZE + GatherTileBits(index >> 1);
+  } else {
+    *x = tile_x * LIGHTMAP_TILE_SIZE + index % tile_width;
+    *y = tile_y * LIGHTMAP_TILE_SIZE + index / tile_width;
+  }
 }
 
 vector3 Texture::ReadTexel(const vector2& coord) const {
@@ -147,9 +412,9 @@ vector3 Texture::ReadTexel(const vector2& coord) const {
       ::base::clip_range(coord.x * texture_width_, 0.0, texture_width_ - 1);
   uint32 y =
       ::base::clip_range(coord.y * texture_height_, 0.0, texture_height_ - 1);
-  uint32 offset = texture_width_ * 3 * y + x * 3;
-  vector3 texel = vector3(texture_map_[offset + 0], texture_map_[offset + 1],
-                          texture_map_[offset + 2]);
+  uint32 offset = QueryTexelIndex(x, y) * 3;
+  vector3 texel = vector3(texture_data_[offset + 0], texture_data_[offset + 1],
+                          texture_data_[offset + 2]);
   return texel / 255.0;
 }
 
@@ -158,10 +423,10 @@ void Texture::WriteTexel(const vector2& coord, const vector3& texel) {
       ::base::clip_range(coord.x * texture_width_, 0.0, texture_width_ - 1);
   uint32 y =
       ::base::clip_range(coord.y * texture_height_, 0.0, texture_height_ - 1);
-  uint32 offset = texture_width_ * 3 * y + x * 3;
-  texture_map_[offset + 0] = texel.x * 255.0;
-  texture_map_[offset + 1] = texel.y * 255.0;
-  texture_map_[offset + 2] = texel.z * 255.0;
+  uint32 offset = QueryTexelIndex(x, y) * 3;
+  texture_data_[offset + 0] = texel.x * 255.0;
+  texture_data_[offset + 1] = texel.y * 255.0;
+  texture_data_[offset + 2] = texel.z * 255.0;
 }
 
 Texture::~Texture() { glDeleteTextures(1, &gl_texture_index_); }
@@ -172,36 +437,37 @@ void Texture::Bind(int unit_index) {
   glBindTexture(GL_TEXTURE_2D, gl_texture_index_);
 }
 
-Triangle::Triangle(const vector3& v0, const vector2& t0, const vector4& c0,
-                   const vector3& v1, const vector2& t1, const vector4& c1,
-                   const vector3& v2, const vector2& t2, const vector4& c2,
-                   const ::std::shared_ptr<Texture>& diffuse) {
-  vertices_[0].vert = v0;
+TriangleGeometry MakeTriangleGeometry(const vector3& v0, const vector3& v1,
+                                      const vector3& v2, bool requires_alpha) {
+  TriangleGeometry geometry;
+  geometry.vertices[0] = v0;
+  geometry.vertices[1] = v1;
+  geometry.vertices[2] = v2;
+  geometry.plane =
+      ::base::calculate_plane(::base::calculate_normal(v0, v1, v2), v0);
+  geometry.requires_alpha = requires_alpha;
+  return geometry;
+}
+
+Triangle::Triangle(const TriangleGeometry& geometry, const vector2& t0,
+                   const vector4& c0, const vector2& t1, const vector4& c1,
+                   const vector2& t2, const vector4& c2, uint32 diffuse) {
   vertices_[0].tc = t0;
   vertices_[0].color = c0;
-  vertices_[1].vert = v1;
   vertices_[1].tc = t1;
   vertices_[1].color = c1;
-  vertices_[2].vert = v2;
   vertices_[2].tc = t2;
   vertices_[2].color = c2;
 
   diffuse_ = diffuse;
-  requires_alpha_ = false;
-  normal_ = ::base::calculate_normal(v0, v1, v2);
-  plane_ = ::base::calculate_plane(normal_, v0);
-
-  if (c0.a < 1.0 || c1.a < 1.0 || c2.a < 1.0) {
-    requires_alpha_ = true;
-  }
+  lightmap_ = 0;
+  gi_lightmap_ = 0;
+  normal_ = vector3(geometry.plane.x, geometry.plane.y, geometry.plane.z);
 }
 
-void Triangle::AttachLightmap(const ::std::shared_ptr<Texture>& lightmap) {
-  lightmap_ = lightmap;
-}
+void Triangle::AttachLightmap(uint32 lightmap) { lightmap_ = lightmap; }
 
-void Triangle::AttachGlobalLightmap(
-    const ::std::shared_ptr<Texture>& lightmap) {
+void Triangle::AttachGlobalLightmap(uint32 lightmap) {
   gi_lightmap_ = lightmap;
 }
 
@@ -213,25 +479,27 @@ vector3 Triangle::ReadLight(const vector3& point) const {
   return vector3(0, 0, 1);
 }
 
-void Triangle::Draw(bool textures_enabled, bool lights_enabled,
+void Triangle::Draw(const TriangleGeometry& geometry,
+                    const ::std::vector<::std::shared_ptr<Texture>>& textures,
+                    bool textures_enabled, bool lights_enabled,
                     bool global_illum_enabled) const {
   if (textures_enabled) {
-    diffuse_->Bind(GL_TEXTURE0_ARB);
+    textures[diffuse_]->Bind(GL_TEXTURE0_ARB);
 
     if (global_illum_enabled) {
-      gi_lightmap_->Bind(GL_TEXTURE1_ARB);
+      textures[gi_lightmap_]->Bind(GL_TEXTURE1_ARB);
     } else if (lights_enabled) {
-      lightmap_->Bind(GL_TEXTURE1_ARB);
+      textures[lightmap_]->Bind(GL_TEXTURE1_ARB);
     }
   } else {
     if (global_illum_enabled) {
-      gi_lightmap_->Bind(GL_TEXTURE0_ARB);
+      textures[gi_lightmap_]->Bind(GL_TEXTURE0_ARB);
     } else if (lights_enabled) {
-      lightmap_->Bind(GL_TEXTURE0_ARB);
+      textures[lightmap_]->Bind(GL_TEXTURE0_ARB);
     }
   }
 
-  if (requires_alpha_) {
+  if (geometry.requires_alpha) {
     glEnable(GL_BLEND);
     glDisable(GL_TEXTURE_2D);
     glDepthMask(GL_FALSE);
@@ -260,12 +528,12 @@ void Triangle::Draw(bool textures_enabled, bool lights_enabled,
     if (textures_enabled) {
       glTexCoord2fv(vertices_[i].tc.v);
     }
-    glVertex3fv(vertices_[i].vert.v);
+    glVertex3fv(geometry.vertices[i].v);
   }
 
   glEnd();
 
-  if (requires_alpha_) {
+  if (geometry.requires_alpha) {
     glDisable(GL_BLEND);
     glDepthMask(GL_TRUE);
     glEnable(GL_TEXTURE_2D);
@@ -273,28 +541,78 @@ void Triangle::Draw(bool textures_enabled, bool lights_enabled,
   }
 }
 
-World::World(const string& filename) {
+World::World(const string& filename, const WorldOptions& options)
+    : options_(options),
+      thread_pool_(ENABLE_MULTITHREADING ? options.thread_count : 1),
+      static_triangle_count_(0),
+      direct_traced_lumels_(0),
+      direct_light_pairs_(0),
+      direct_occluder_cache_hits_(0),
+      direct_occluder_cache_lookups_(0),
+      direct_shadow_cube_lookups_(0),
+      direct_shadow_cube_fallbacks_(0),
+      direct_shadow_packets_(0),
+      direct_shadow_packet_rays_(0),
+      direct_shadow_packet_fallbacks_(0),
+      direct_pvs_culled_lights_(0) {
   if (!LoadWorldFromFile(filename)) {
     return;
   }
 
-  PrepareTrianglesForLightmapping();
+  if (!PrepareTrianglesForLightmapping()) {
+    return;
+  }
+
+#if ENABLE_BSP_PVS
+  CompileBsp();
+#endif
+
+  // Merging the shards of a bake takes the place of loading or baking.
+  if (options_.merge_shard_count) {
+    MergeLightmapShards(filename + ".lmp.bmp");
+    return;
+  }
 
   // If we can load a lightmap bitmap from filename.lmp then we use it.
-  // Otherwise we'll generate lightmaps.
-  if (!LoadLightmapsFromFile(filename + ".lmp.bmp")) {
+  // Otherwise we'll generate lightmaps. A dry run only estimates them, and a
+  // shard always bakes its part of them.
+  if (options_.estimate_only || options_.shard_count ||
+      !LoadLightmapsFromFile(filename + ".lmp.bmp")) {
+    PrepareAccelerationStructure(filename + ".bvh");
     normal_generator.initialize(RANDOM_NORMAL_COUNT);
-    GenerateLightmaps();
-    SaveLightmapsToFile(filename + ".lmp.bmp");
+    if (options_.estimate_only) {
+      EstimateLightmaps();
+    } else {
+      GenerateLightmaps(filename + ".lmp.bmp");
+    }
   }
 }
 
 bool World::IsValid() const { return true; }
 
-void World::Draw(bool textures_enabled, bool lights_enabled,
-                 bool global_illum_enabled) const {
+void World::Draw(const vector3& eye, bool textures_enabled,
+                 bool lights_enabled, bool global_illum_enabled) const {
+  // Gather the leaves visible from wherever the eye is, unless the eye is
+  // still in the leaves of the last frame. Triangles are still drawn in order
+  // so that blended triangles composite as before.
+  draw_scratch_leaves_.clear();
+  if (world_bsp_.HasVisibility() && world_bsp_.IsPointCovered(eye)) {
+    world_bsp_.FindLeaves(&eye, 1, 0.0f, &draw_scratch_leaves_);
+  }
+
+  if (draw_scratch_leaves_ != draw_eye_leaves_) {
+    draw_eye_leaves_.swap(draw_scratch_leaves_);
+    draw_visible_leaves_.clear();
+    for (uint32 leaf : draw_eye_leaves_) {
+      world_bsp_.AccumulateVisibleLeaves(leaf, &draw_visible_leaves_);
+    }
+  }
+
   for (int i = 0; i < triangles_.size(); i++) {
-    triangles_[i].Draw(textures_enabled, lights_enabled, global_illum_enabled);
+    if (IsTriangleInPvs(draw_visible_leaves_, i)) {
+      triangles_[i].Draw(triangle_geometry_[i], textures_, textures_enabled,
+                         lights_enabled, global_illum_enabled);
+    }
   }
 }
 
@@ -336,19 +654,41 @@ bool World::LoadWorldFromFile(const ::std::string& filename) {
   sscanf_s(one_line, "lights %i", &light_count);
   cout << "Light count: " << light_count << "." << endl;
 
-  /* Read and initialize our textures. */
+  /* Read our texture filenames. */
+  ::std::vector<::std::string> texture_filenames;
   for (uint32 j = 0; j < texture_count; j++) {
     ReadOneLine(file_ptr, one_line);
 
     if (one_line[0] == 't') {
       char temp_string[80] = {0};
       sscanf_s(one_line, "t %s", temp_string, 80);
-      ::std::shared_ptr<Texture> temp_texture_object =
-          ::std::make_shared<Texture>(temp_string);
-      textures_.emplace_back(temp_texture_object);
+      texture_filenames.push_back(temp_string);
     }
   }
 
+  /* Decode the textures in parallel, then upload them from this thread, which
+     owns the graphics context. */
+  uint32 first_texture = textures_.size();
+  textures_.resize(first_texture + texture_filenames.size());
+  thread_pool_.ParallelFor(texture_filenames.size(), [&](uint32 j, uint32) {
+    textures_[first_texture + j] =
+        ::std::make_shared<Texture>(texture_filenames[j]);
+  });
+
+  for (uint32 j = 0; j < texture_filenames.size(); j++) {
+    Texture* texture = textures_[first_texture + j].get();
+    if (!texture->texture_data_) {
+      cout << "Failed to load bitmap image " << texture_filenames[j] << endl;
+      continue;
+    }
+
+    if (IsInteractive(options_)) {
+      texture->UploadTexture();
+    }
+    cout << "Successfully loaded texture " << texture_filenames[j] << "."
+         << endl;
+  }
+
   /* Read and initialize our lights. */
   for (uint32 j = 0; j < light_count; j++) {
     ReadOneLine(file_ptr, one_line);
@@ -368,65 +708,146 @@ bool World::LoadWorldFromFile(const ::std::string& filename) {
     ReadOneLine(file_ptr, one_line);
 
     if (one_line[0] == 'f') {
-      vector3 vertices[3];
-      vector4 colors[3];
-      vector2 texcoords[3];
-      uint32 texture_index;
-      uint32 vertex_index = 0;
-      uint32 line_count = 0;
-
-      sscanf_s(one_line, "f %i", &line_count);
-
-      for (uint32 j = 0; j < line_count; j++) {
-        ReadOneLine(file_ptr, one_line);
-
-        if (one_line[0] == 'v') {
-          sscanf_s(one_line, "v %f, %f, %f, %f, %f, %f, %f, %f, %f",
-                   &vertices[vertex_index].x, &vertices[vertex_index].y,
-                   &vertices[vertex_index].z, &texcoords[vertex_index].x,
-                   &texcoords[vertex_index].y, &colors[vertex_index].r,
-                   &colors[vertex_index].g, &colors[vertex_index].b,
-                   &colors[vertex_index].a);
-          vertex_index++;
-        } else if (one_line[0] == 't') {
-          sscanf_s(one_line, "t %i", &texture_index);
-        }
-      }
+      ReadFace(file_ptr, one_line, &triangle_geometry_, &triangles_);
+    }
+  }
+
+  static_triangle_count_ = triangles_.size();
+
+  bool loaded = LoadPrefabsFromFile(file_ptr);
+  fclose(file_ptr);
+  return loaded;
+}
+
+void World::ReadFace(FILE* file_ptr, const char* face_line,
+                     ::std::vector<TriangleGeometry>* geometry,
+                     ::std::vector<Triangle>* triangles) const {
+  char one_line[MAX_PATH] = {0};
+  vector3 vertices[3];
+  vector4 colors[3];
+  vector2 texcoords[3];
+  uint32 texture_index;
+  uint32 vertex_index = 0;
+  uint32 line_count = 0;
 
-      triangles_.emplace_back(vertices[0], texcoords[0], colors[0], vertices[1],
-                              texcoords[1], colors[1], vertices[2],
-                              texcoords[2], colors[2],
-                              textures_[texture_index]);
+  sscanf_s(face_line, "f %i", &line_count);
+
+  for (uint32 j = 0; j < line_count; j++) {
+    ReadOneLine(file_ptr, one_line);
+
+    if (one_line[0] == 'v') {
+      sscanf_s(one_line, "v %f, %f, %f, %f, %f, %f, %f, %f, %f",
+               &vertices[vertex_index].x, &vertices[vertex_index].y,
+               &vertices[vertex_index].z, &texcoords[vertex_index].x,
+               &texcoords[vertex_index].y, &colors[vertex_index].r,
+               &colors[vertex_index].g, &colors[vertex_index].b,
+               &colors[vertex_index].a);
+      vertex_index++;
+    } else if (one_line[0] == 't') {
+      sscanf_s(one_line, "t %i", &texture_index);
     }
   }
 
-  return true;
+  bool requires_alpha = colors[0].a < 1.0 || colors[1].a < 1.0 ||
+                        colors[2].a < 1.0;
+  geometry->push_back(MakeTriangleGeometry(vertices[0], vertices[1],
+                                           vertices[2], requires_alpha));
+  triangles->emplace_back(geometry->back(), texcoords[0], colors[0],
+                          texcoords[1], colors[1], texcoords[2], colors[2],
+                          texture_index);
 }
 
-void World::SaveLightmapsToFile(const ::std::string& filename) {
-  if (!triangles_.size()) {
-    return;
+bool World::LoadPrefabsFromFile(FILE* file_ptr) {
+  uint32 prefab_count = 0;
+  uint32 instance_count = 0;
+
+  char one_line[MAX_PATH] = {0};
+  ReadOneLine(file_ptr, one_line);
+
+  // Worlds without prefabs end with their polygons.
+  if (1 != sscanf_s(one_line, "prefabs %i", &prefab_count)) {
+    return true;
   }
 
-  cout << "Saving lightmaps to file " << filename << "." << endl;
+  cout << "Prefab count: " << prefab_count << "." << endl;
 
-  uint32 first_lightmap_dim = triangles_[0].lightmap_->texture_width_;
-  uint32 lightmap_size = first_lightmap_dim * first_lightmap_dim * 3;
-  uint32 write_offset = 0;
+  /* Read each prefab's polygons, in the prefab's own space. */
+  for (uint32 i = 0; i < prefab_count; i++) {
+    uint32 face_count = 0;
+    ReadOneLine(file_ptr, one_line);
+    sscanf_s(one_line, "p %i", &face_count);
 
-  ::std::vector<uint8> lightmap_buffer(lightmap_size * triangles_.size() * 2);
+    Prefab prefab;
+    for (uint32 j = 0; j < face_count; j++) {
+      ReadOneLine(file_ptr, one_line);
 
-  for (uint32 i = 0; i < triangles_.size(); i++) {
-    memcpy(&lightmap_buffer.at(0) + write_offset,
-           &triangles_[i].lightmap_->texture_map_.at(0), lightmap_size);
-    write_offset += lightmap_size;
-    memcpy(&lightmap_buffer.at(0) + write_offset,
-           &triangles_[i].gi_lightmap_->texture_map_.at(0), lightmap_size);
-    write_offset += lightmap_size;
+      if (one_line[0] == 'f') {
+        ReadFace(file_ptr, one_line, &prefab.geometry, &prefab.triangles);
+      }
+    }
+
+    for (const TriangleGeometry& geometry : prefab.geometry) {
+      for (uint32 j = 0; j < 3; j++) {
+        prefab.local_bounds += geometry.vertices[j];
+      }
+    }
+
+    prefabs_.push_back(prefab);
+  }
+
+  /* Read each instance's prefab and the rows of its affine transform. */
+  ReadOneLine(file_ptr, one_line);
+  sscanf_s(one_line, "instances %i", &instance_count);
+  cout << "Instance count: " << instance_count << "." << endl;
+
+  for (uint32 i = 0; i < instance_count; i++) {
+    PrefabInstance instance;
+    instance.prefab = 0;
+    instance.transform.identity();
+
+    ReadOneLine(file_ptr, one_line);
+    sscanf_s(one_line, "i %i", &instance.prefab);
+
+    for (uint32 row = 0; row < 3; row++) {
+      ReadOneLine(file_ptr, one_line);
+      sscanf_s(one_line, "m %f, %f, %f, %f", &instance.transform[row],
+               &instance.transform[row + 4], &instance.transform[row + 8],
+               &instance.transform[row + 12]);
+    }
+
+    if (instance.prefab >= prefabs_.size()) {
+      cout << "Instance " << i << " places missing prefab " << instance.prefab
+           << "." << endl;
+      return false;
+    }
+
+    // Every instance is lit separately, so it receives its own world space
+    // triangles and lightmaps. Only the hierarchy is shared.
+    instance.first_triangle = triangles_.size();
+    const Prefab& prefab = prefabs_[instance.prefab];
+    for (uint32 j = 0; j < prefab.triangles.size(); j++) {
+      const TriangleGeometry& local = prefab.geometry[j];
+      vector3 vertices[3];
+      for (uint32 k = 0; k < 3; k++) {
+        vector4 world = instance.transform * vector4(local.vertices[k].x,
+                                                     local.vertices[k].y,
+                                                     local.vertices[k].z, 1.0f);
+        vertices[k] = vector3(world.x, world.y, world.z);
+      }
+
+      const Triangle& tri = prefab.triangles[j];
+      triangle_geometry_.push_back(MakeTriangleGeometry(
+          vertices[0], vertices[1], vertices[2], local.requires_alpha));
+      triangles_.emplace_back(
+          triangle_geometry_.back(), tri.vertices_[0].tc,
+          tri.vertices_[0].color, tri.vertices_[1].tc, tri.vertices_[1].color,
+          tri.vertices_[2].tc, tri.vertices_[2].color, tri.diffuse_);
+    }
+
+    instances_.push_back(instance);
   }
 
-  ::base::SaveBitmapImage(filename, &lightmap_buffer, first_lightmap_dim,
-                          first_lightmap_dim * triangles_.size() * 2);
+  return true;
 }
 
 bool World::LoadLightmapsFromFile(const ::std::string& filename) {
@@ -434,68 +855,106 @@ bool World::LoadLightmapsFromFile(const ::std::string& filename) {
     return false;
   }
 
-  uint32 width, height;
-  ::std::vector<uint8> lightmap_buffer;
-  if (!::base::LoadBitmapImage(filename, &lightmap_buffer, &width, &height)) {
+  // The file is read straight into the arena, which only succeeds if the file
+  // holds exactly the lightmaps of the current geometry.
+  uint32 width = 0, height = 0;
+  if (!::base::LoadBitmapImage(filename, lightmap_arena_.QueryData(),
+                               lightmap_arena_.QuerySize(), &width,
+                               &height)) {
+    if (width) {
+      // The lightmap count does not match the triangle count, so this
+      // lightmap was not generated for the current geometry. Regenerate it.
+      cout << "Lightmap was not generated for the current map. "
+           << "Regenerating..." << endl;
+      memset(lightmap_arena_.QueryData(), 0, lightmap_arena_.QuerySize());
+    }
     return false;
   }
 
   cout << "Loading lightmaps from file " << filename << "." << endl;
-
-  uint32 first_lightmap_dim = width;
-  uint32 lightmap_size = first_lightmap_dim * first_lightmap_dim * 3;
-  uint32 read_offset = 0;
-
-  cout << "Lightmap size: " << lightmap_buffer.size() / lightmap_size << endl;
+  cout << "Lightmap size: " << height / width << endl;
   cout << "Triangle count: " << triangles_.size() << endl;
 
-  if ((lightmap_buffer.size() / lightmap_size) != 2 * triangles_.size()) {
-    // Lightmap count is less than triangle count, so this lightmap
-    // was not generated for the current geometry. Regenerate it.
-    cout << "Lightmap was not generated for the current map. Regenerating..."
-         << endl;
-    return false;
+  UploadLightmaps();
+  return true;
+}
+
+void World::UploadLightmaps() {
+  if (!IsInteractive(options_)) {
+    return;
   }
 
   for (uint32 i = 0; i < triangles_.size(); i++) {
-    memcpy(&triangles_[i].lightmap_->texture_map_.at(0),
-           &lightmap_buffer.at(0) + read_offset, lightmap_size);
-    read_offset += lightmap_size;
-    memcpy(&triangles_[i].gi_lightmap_->texture_map_.at(0),
-           &lightmap_buffer.at(0) + read_offset, lightmap_size);
-    read_offset += lightmap_size;
-
-    triangles_[i].lightmap_->UploadTexture();
-    triangles_[i].gi_lightmap_->UploadTexture();
+    textures_[triangles_[i].lightmap_]->UploadTexture();
+    textures_[triangles_[i].gi_lightmap_]->UploadTexture();
   }
-
-  return true;
 }
 
-void World::PrepareTrianglesForLightmapping() {
-  for (uint32 i = 0; i < triangles_.size(); ++i) {
-    Triangle* tri = &triangles_[i];
-    vector3 v0 = tri->vertices_[0].vert;
-    vector3 v1 = tri->vertices_[1].vert;
-    vector3 v2 = tri->vertices_[2].vert;
+bool World::PrepareTrianglesForLightmapping() {
+  // Size every lightmap first, so that all of their pixels can be carved out
+  // of a single arena allocation.
+  ::std::vector<uint32> lightmap_widths(triangles_.size());
+  thread_pool_.ParallelFor(triangles_.size(), [&](uint32 i, uint32) {
+    const TriangleGeometry* geometry = &triangle_geometry_[i];
+    vector3 v0 = geometry->vertices[0];
+    vector3 v1 = geometry->vertices[1];
+    vector3 v2 = geometry->vertices[2];
 
     // Compute the lightmap size based on the triangle dimensions.
     float32 max_length =
         max(max((v1 - v0).length(), (v2 - v0).length()), (v2 - v1).length());
     uint32 lightmap_width = lightmap_scale_factor * max_length;
-    lightmap_width = ::base::clip_range(lightmap_width, MIN_LIGHTMAP_SIZE,
-                                        MAX_LIGHTMAP_SIZE);
+    lightmap_widths[i] = ::base::clip_range(lightmap_width, MIN_LIGHTMAP_SIZE,
+                                            MAX_LIGHTMAP_SIZE);
+  });
+
+  ::std::vector<uint64> arena_offsets(triangles_.size());
+  uint64 arena_size = 0;
+  for (uint32 i = 0; i < triangles_.size(); ++i) {
+    arena_offsets[i] = arena_size;
+    arena_size += 2ull * lightmap_widths[i] * lightmap_widths[i] * 3;
+  }
+
+  // A dry run never reads or writes a lumel, so its lightmaps get no pixels.
+  if (!options_.estimate_only) {
+    if (!lightmap_arena_.Allocate(arena_size)) {
+      cout << "Failed to allocate " << arena_size / 1024
+           << " KB of lightmap memory." << endl;
+      return false;
+    }
+
+    cout << "Allocated " << arena_size / 1024 << " KB of lightmap memory"
+         << (lightmap_arena_.IsUsingHugePages() ? " in huge pages." : ".")
+         << endl;
+  }
+
+  // Each triangle's lightmap and global illumination lightmap take the next
+  // two texture slots, so the slots can be filled in any order.
+  uint32 first_lightmap = textures_.size();
+  textures_.resize(first_lightmap + 2 * triangles_.size());
+
+  thread_pool_.ParallelFor(triangles_.size(), [&](uint32 i, uint32) {
+    Triangle* tri = &triangles_[i];
+    const TriangleGeometry* geometry = &triangle_geometry_[i];
+    uint32 lightmap_width = lightmap_widths[i];
+    uint64 lightmap_size = (uint64)lightmap_width * lightmap_width * 3;
+    uint8* lightmap_data = NULL;
+    uint8* gi_lightmap_data = NULL;
+    if (lightmap_arena_.QueryData()) {
+      lightmap_data = lightmap_arena_.QueryData() + arena_offsets[i];
+      gi_lightmap_data = lightmap_data + lightmap_size;
+    }
 
     // Generate a lightmap texture for this triangle and attach it.
-    ::std::shared_ptr<Texture> lightmap =
-        ::std::make_shared<Texture>(lightmap_width, lightmap_width);
-    tri->AttachLightmap(lightmap);
+    tri->AttachLightmap(first_lightmap + 2 * i);
+    textures_[first_lightmap + 2 * i] = ::std::make_shared<Texture>(
+        lightmap_width, lightmap_width, lightmap_data);
 
     // Generate a global illumination lightmap texture for this triangle and
     // attach it.
-    ::std::shared_ptr<Texture> gi_lightmap =
-        ::std::make_shared<Texture>(lightmap_width, lightmap_width);
-    tri->AttachGlobalLightmap(gi_lightmap);
+    tri->AttachGlobalLightmap(first_lightmap + 2 * i + 1);
+    textures_[first_lightmap + 2 * i + 1] = ::std::make_shared<Texture>(
+        lightmap_width, lightmap_width, gi_lightmap_data);
 
     // Generate the UVs for the triangle and attach them.
     float32 max_u = -100000;
@@ -507,21 +966,21 @@ void World::PrepareTrianglesForLightmapping() {
 
     uint32 u_coeff = 0, v_coeff = 0;
 
-    FindLightmapPlane(tri->plane_, &u_coeff, &v_coeff);
+    FindLightmapPlane(geometry->plane, &u_coeff, &v_coeff);
 
     // Compute the minimum and maximum values on our planar map.
     for (int j = 0; j < 3; j++) {
-      if (min_u > tri->vertices_[j].vert.v[u_coeff])
-        min_u = tri->vertices_[j].vert.v[u_coeff];
+      if (min_u > geometry->vertices[j].v[u_coeff])
+        min_u = geometry->vertices[j].v[u_coeff];
 
-      if (min_v > tri->vertices_[j].vert.v[v_coeff])
-        min_v = tri->vertices_[j].vert.v[v_coeff];
+      if (min_v > geometry->vertices[j].v[v_coeff])
+        min_v = geometry->vertices[j].v[v_coeff];
 
-      if (max_u < tri->vertices_[j].vert.v[u_coeff])
-        max_u = tri->vertices_[j].vert.v[u_coeff];
+      if (max_u < geometry->vertices[j].v[u_coeff])
+        max_u = geometry->vertices[j].v[u_coeff];
 
-      if (max_v < tri->vertices_[j].vert.v[v_coeff])
-        max_v = tri->vertices_[j].vert.v[v_coeff];
+      if (max_v < geometry->vertices[j].v[v_coeff])
+        max_v = geometry->vertices[j].v[v_coeff];
     }
 
     delta_u = (max_u - min_u);
@@ -532,345 +991,2522 @@ void World::PrepareTrianglesForLightmapping() {
 
     for (int e = 0; e < 3; e++) {
       tri->vertices_[e].lc[0] =
-          (tri->vertices_[e].vert.v[u_coeff] - min_u) / delta_u;
+          (geometry->vertices[e].v[u_coeff] - min_u) / delta_u;
       tri->vertices_[e].lc[1] =
-          (tri->vertices_[e].vert.v[v_coeff] - min_v) / delta_v;
+          (geometry->vertices[e].v[v_coeff] - min_v) / delta_v;
     }
+  });
+
+  return true;
+}
+
+// Scratch state for the adaptive direct pass. Neighbouring blocks share their
+// edge lumels, so each lumel is traced at most once per triangle.
+struct AdaptiveLumelGrid {
+  enum LumelState { kEmpty = 0, kInterpolated = 1, kTraced = 2 };
+
+  AdaptiveLumelGrid(uint32 width, uint32 height)
+      : width(width),
+        height(height),
+        illumination(width * height),
+        visibility(width * height),
+        state(width * height, kEmpty) {}
+
+  uint32 width;
+  uint32 height;
+  ::std::vector<vector3> illumination;
+  ::std::vector<uint64> visibility;
+  ::std::vector<uint8> state;
+};
+
+vector3 World::ComputeLumelPosition(uint32 triangle_index, uint32 lx,
+                                    uint32 ly) const {
+  const Triangle* tri = &triangles_[triangle_index];
+  const TriangleGeometry* geometry = &triangle_geometry_[triangle_index];
+  const Texture* lightmap = textures_[tri->lightmap_].get();
+  float32 width = lightmap->texture_width_;
+  float32 height = lightmap->texture_height_;
+  vector2 v0 = tri->vertices_[1].lc - tri->vertices_[0].lc;
+  vector2 v1 = tri->vertices_[2].lc - tri->vertices_[0].lc;
+  vector2 lumel(::base::clip_range(lx / width, 0.0, 1.0),
+                ::base::clip_range(ly / height, 0.0, 1.0));
+  vector2 vp = lumel - tri->vertices_[0].lc;
+  float32 u = 0.0, v = 0.0;
+  ::base::triangle_find_barycentric_coeff(v0, v1, vp, &u, &v);
+
+  /*
+  float32 three_lumels_u = 3.0f / lightmap->texture_width_;
+  float32 three_lumels_v = 3.0f / lightmap->texture_height_;
+  // Only trace lumels that lie on our triangles, plus a 3px boundary
+  // around the edge of the triangle, to account for bilinear sampling
+  // (and avoid black seams at the edges of the triangles after blending).
+  if ((u < -three_lumels_u) || (v < -three_lumels_v) ||
+      (u + v > 1 + three_lumels_u + three_lumels_v)) {
+    continue;
   }
+  */
+
+  // We have a lumel that's inside the triangle. Map it to a point.
+  vector3 trace_origin;
+  ::base::triangle_interpolate_barycentric_coeff(
+      geometry->vertices[0], geometry->vertices[1], geometry->vertices[2],
+      u, v, &trace_origin);
+  return trace_origin;
 }
 
-void ComputeDirectIlluminationHelper(World* world, uint32 thread_index) {
-  ::std::vector<Triangle>& triangles_ = world->triangles_;
-  ::std::vector<Light>& lights_ = world->lights_;
-  uint32 triangle_bin_count = triangles_.size();
+void World::PrepareLumelSamples() {
+  lumel_samples_.first_sample.resize(triangles_.size() + 1);
+  uint64 sample_count = 0;
+  for (uint32 i = 0; i < triangles_.size(); i++) {
+    const Texture* lightmap = textures_[triangles_[i].lightmap_].get();
+    lumel_samples_.first_sample[i] = sample_count;
+    sample_count += lightmap->texture_width_ * lightmap->texture_height_;
+  }
+  lumel_samples_.first_sample[triangles_.size()] = sample_count;
+
+  lumel_samples_.position_x.resize(sample_count);
+  lumel_samples_.position_y.resize(sample_count);
+  lumel_samples_.position_z.resize(sample_count);
+
+  thread_pool_.ParallelFor(triangles_.size(), [this](uint32 i, uint32) {
+    const Texture* lightmap = textures_[triangles_[i].lightmap_].get();
+    uint64 first_sample = lumel_samples_.first_sample[i];
+    uint32 lumel_count = lightmap->texture_width_ * lightmap->texture_height_;
+    for (uint32 j = 0; j < lumel_count; j++) {
+      uint32 lx = 0, ly = 0;
+      lightmap->QueryTexelCoords(j, &lx, &ly);
+      vector3 position = ComputeLumelPosition(i, lx, ly);
+      lumel_samples_.position_x[first_sample + j] = position.x;
+      lumel_samples_.position_y[first_sample + j] = position.y;
+      lumel_samples_.position_z[first_sample + j] = position.z;
+    }
+  });
 
-#if ENABLE_MULTITHREADING
-  uint32 thread_count =
-      min(triangles_.size(), ::std::thread::hardware_concurrency());
-  triangle_bin_count = triangle_bin_count / thread_count;
-#endif
+  cout << "Prepared " << sample_count << " lumel samples ("
+       << sample_count * 3 * sizeof(float32) / 1024 << " KB)." << endl;
+}
+
+vector3 World::QueryLumelPosition(uint32 triangle_index,
+                                  uint32 texel_index) const {
+  uint64 sample = lumel_samples_.first_sample[triangle_index] + texel_index;
+  return vector3(lumel_samples_.position_x[sample],
+                 lumel_samples_.position_y[sample],
+                 lumel_samples_.position_z[sample]);
+}
 
-  uint32 triangle_start_index = triangle_bin_count * thread_index;
-  uint32 triangle_stop_index = triangle_bin_count * (thread_index + 1);
+bool World::TriangleOccludesRay(uint32 occluder_index,
+                                const ::base::ray& trace_ray) const {
+  const TriangleGeometry* test_tri = &triangle_geometry_[occluder_index];
+  if (test_tri->requires_alpha) {
+    // Ignore transparent or partially transparent triangles.
+    return false;
+  }
 
-#if ENABLE_MULTITHREADING
-  if (thread_index == thread_count - 1) {
-    triangle_stop_index = triangles_.size();
+  ::base::collision hit_info;
+  if (::base::ray_intersect_triangle(
+          test_tri->vertices[0], test_tri->vertices[1],
+          test_tri->vertices[2], test_tri->plane, trace_ray, &hit_info,
+          NULL)) {
+    return hit_info.param > BASE_EPSILON && hit_info.param < 1.0 - BASE_EPSILON;
   }
-#endif
 
-  // For each triangle
-  for (uint32 i = triangle_start_index; i < triangle_stop_index; ++i) {
-    Triangle* tri = &triangles_[i];
-    float32 width = tri->lightmap_->texture_width_;
-    float32 height = tri->lightmap_->texture_height_;
-    vector2 v0 = tri->vertices_[1].lc - tri->vertices_[0].lc;
-    vector2 v1 = tri->vertices_[2].lc - tri->vertices_[0].lc;
-    for (uint32 lx = 0; lx < tri->lightmap_->texture_width_; lx++) {
-      for (uint32 ly = 0; ly < tri->lightmap_->texture_height_; ly++) {
-        vector2 lumel(::base::clip_range(lx / width, 0.0, 1.0),
-                      ::base::clip_range(ly / height, 0.0, 1.0));
-        vector2 vp = lumel - tri->vertices_[0].lc;
-        float32 u = 0.0, v = 0.0;
-        ::base::triangle_find_barycentric_coeff(v0, v1, vp, &u, &v);
-
-        /*
-        float32 three_lumels_u = 3.0f / tri->lightmap_->texture_width_;
-        float32 three_lumels_v = 3.0f / tri->lightmap_->texture_height_;
-        // Only trace lumels that lie on our triangles, plus a 3px boundary
-        // around the edge of the triangle, to account for bilinear sampling
-        // (and avoid black seams at the edges of the triangles after blending).
-        if ((u < -three_lumels_u) || (v < -three_lumels_v) ||
-            (u + v > 1 + three_lumels_u + three_lumels_v)) {
-          continue;
+  return false;
+}
+
+bool World::IsTriangleInPvs(const ::std::vector<uint64>& visible_leaves,
+                            uint32 triangle_index) const {
+  return visible_leaves.empty() ||
+         world_bsp_.IsTriangleVisible(triangle_index, visible_leaves);
+}
+
+bool World::HasBvh() const {
+  return !triangle_bvh_.IsEmpty() || !instance_bvh_.IsEmpty();
+}
+
+template <typename BoundsTest, typename PrimitiveVisitor>
+bool World::WalkBvhLevel(const Bvh& bvh, const PrefabInstance* instance,
+                         uint32 first_primitive, const vector3* order_dir,
+                         const BoundsTest& overlaps,
+                         const PrimitiveVisitor& visit) const {
+  uint32 stack[BVH_STACK_SIZE];
+  uint32 stack_size = 0;
+  stack[stack_size++] = 0;
+
+  while (stack_size) {
+    const BvhWideNode& node = bvh.QueryNode(stack[--stack_size]);
+
+    float32 bounds_min[BVH_NODE_WIDTH][3], bounds_max[BVH_NODE_WIDTH][3];
+    float32 child_depths[BVH_NODE_WIDTH];
+    uint32 order[BVH_NODE_WIDTH];
+    for (uint32 i = 0; i < node.child_count; i++) {
+      DecodeBvhChildBounds(node, i, bounds_min[i], bounds_max[i]);
+      if (instance) {
+        TransformBoxBounds(instance->transform, bounds_min[i], bounds_max[i]);
+      }
+
+      uint32 slot = i;
+      if (order_dir) {
+        child_depths[i] =
+            QueryBoxCenter(bounds_min[i], bounds_max[i]).dot(*order_dir);
+        for (; slot > 0 && child_depths[order[slot - 1]] > child_depths[i];
+             slot--) {
+          order[slot] = order[slot - 1];
         }
-        */
-
-        // We have a lumel that's inside the triangle. Map it to a point.
-        vector3 trace_origin;
-        ::base::triangle_interpolate_barycentric_coeff(
-            tri->vertices_[0].vert, tri->vertices_[1].vert,
-            tri->vertices_[2].vert, u, v, &trace_origin);
-
-        for (uint32 light = 0; light < lights_.size(); light++) {
-          // Compute the trace vector and then check it against all other
-          // geometry.
-          ::base::ray trace_ray(trace_origin, lights_[light].position_);
-          ::base::collision hit_info;
-
-          for (uint32 j = 0; j < triangles_.size(); j++) {
-            if (i == j) {
-              continue;
-            }
+      }
+      order[slot] = i;
+    }
 
-            Triangle* test_tri = &triangles_[j];
-            if (test_tri->requires_alpha_) {
-              // Ignore transparent or partially transparent triangles.
-              continue;
-            }
+    // Leaves are visited right away, while inner children are pushed last
+    // first so that the first in order is visited next.
+    uint32 inner_children[BVH_NODE_WIDTH];
+    uint32 inner_count = 0;
+    for (uint32 n = 0; n < node.child_count; n++) {
+      uint32 i = order[n];
+      if (!overlaps(bounds_min[i], bounds_max[i])) {
+        continue;
+      }
 
-            // If we hit any triangle then we exit early.
-            if (::base::ray_intersect_triangle(
-                    test_tri->vertices_[0].vert, test_tri->vertices_[1].vert,
-                    test_tri->vertices_[2].vert, test_tri->plane_, trace_ray,
-                    &hit_info, NULL)) {
-              // Perform a second level of scrutiny.
-              if (hit_info.param > BASE_EPSILON &&
-                      hit_info.param < 1.0 - BASE_EPSILON ||
-                  fabs(hit_info.normal.dot(test_tri->normal_)) < BASE_EPSILON) {
-                break;
-              }
-            }
-          }
+      if (!node.leaf_counts[i]) {
+        inner_children[inner_count++] = node.children[i];
+        continue;
+      }
 
-          if (hit_info.param > 1 - BASE_EPSILON ||
-              hit_info.param < BASE_EPSILON) {
-            // We did not hit anything. Compute the light value and store it.
-            vector3 incident = (lights_[light].position_ - trace_origin);
-            float32 length = incident.length();
-            float32 dot = fabs(incident.normalize().dot(tri->normal_));
-            float32 attenuation =
-                (500.0f * lights_[light].intensity_) / (1.0 + pow(length, 2));
-            vector3 illum = lights_[light].color_ * dot * attenuation;
-            illum.x = pow(::base::saturate(illum.x), 1.0 / 2.6);
-            illum.y = pow(::base::saturate(illum.y), 1.0 / 2.6);
-            illum.z = pow(::base::saturate(illum.z), 1.0 / 2.6);
-            illum += tri->lightmap_->ReadTexel(lumel);
-            illum = illum.clamp(0.0, 1.0);
-            tri->lightmap_->WriteTexel(lumel, illum);
-          }
+      for (uint32 p = 0; p < node.leaf_counts[i]; p++) {
+        if (!visit(first_primitive +
+                   bvh.QueryPrimitive(node.children[i] + p))) {
+          return false;
         }
       }
     }
 
-    // tri->lightmap_->BlurTexture(3, 1);
-    // tri->lightmap_->BlurTexture(3, 1);
+    while (inner_count) {
+      stack[stack_size++] = inner_children[--inner_count];
+    }
+  }
+
+  return true;
+}
+
+template <typename BoundsTest, typename TriangleVisitor>
+bool World::WalkBvh(const vector3* order_dir, const BoundsTest& overlaps,
+                    const TriangleVisitor& visit) const {
+  if (!triangle_bvh_.IsEmpty() &&
+      !WalkBvhLevel(triangle_bvh_, NULL, 0, order_dir, overlaps, visit)) {
+    return false;
+  }
+
+  if (instance_bvh_.IsEmpty()) {
+    return true;
   }
+
+  // Each leaf of the instance hierarchy leads into its prefab's hierarchy,
+  // whose primitives are offset to the instance's own triangles.
+  return WalkBvhLevel(
+      instance_bvh_, NULL, 0, order_dir, overlaps,
+      [&](uint32 instance_index) {
+        const PrefabInstance& instance = instances_[instance_index];
+        const Bvh& hierarchy = *prefabs_[instance.prefab].hierarchy;
+        return hierarchy.IsEmpty() ||
+               WalkBvhLevel(hierarchy, &instance, instance.first_triangle,
+                            order_dir, overlaps, visit);
+      });
 }
 
-void World::ComputeDirectIllumination() {
-#if ENABLE_MULTITHREADING
-  ::std::vector<::std::thread> thread_list;
-  uint32 thread_count =
-      min(triangles_.size(), ::std::thread::hardware_concurrency());
+int32 World::FindSegmentOccluder(
+    uint32 triangle_index, const vector3& origin, const vector3& target,
+    const ::std::vector<uint64>& visible_leaves) const {
+  // Compute the trace vector and then check it against all other geometry.
+  ::base::ray trace_ray(origin, target);
+
+  if (!triangle_grid_.IsEmpty()) {
+    UniformGridWalk walk;
+    if (!triangle_grid_.BeginWalk(origin, trace_ray.dir, 1.0f, &walk)) {
+      return -1;
+    }
+
+    const uint32* cell_triangles = NULL;
+    uint32 cell_triangle_count = 0;
+    float32 t_cell_exit = 0.0f;
+    while (triangle_grid_.StepWalk(&walk, &cell_triangles,
+                                   &cell_triangle_count, &t_cell_exit)) {
+      for (uint32 p = 0; p < cell_triangle_count; p++) {
+        uint32 j = cell_triangles[p];
+        if (triangle_index != j && IsTriangleInPvs(visible_leaves, j) &&
+            TriangleOccludesRay(j, trace_ray)) {
+          return j;
+        }
+      }
+    }
 
-  for (uint32 thread_idx = 0; thread_idx < thread_count; thread_idx++) {
-    thread_list.emplace_back(&ComputeDirectIlluminationHelper, this,
-                             thread_idx);
+    return -1;
   }
 
-  for (auto& thread_ : thread_list) {
-    thread_.join();
+#if ENABLE_BVH
+  if (HasBvh()) {
+    vector3 inverse_dir = InverseDirection(trace_ray.dir);
+    int32 occluder = -1;
+    WalkBvh(
+        NULL,
+        [&](const float32* bounds_min, const float32* bounds_max) {
+          return SegmentOverlapsBounds(origin, inverse_dir, 1.0f, bounds_min,
+                                       bounds_max);
+        },
+        [&](uint32 j) {
+          if (triangle_index != j && IsTriangleInPvs(visible_leaves, j) &&
+              TriangleOccludesRay(j, trace_ray)) {
+            occluder = j;
+            return false;
+          }
+          return true;
+        });
+
+    return occluder;
   }
-#else
-  ComputeDirectIlluminationHelper(this, 0);
 #endif
 
-  // Upload all of our textures to the GPU.
-  for (uint32 i = 0; i < triangles_.size(); i++) {
-    Triangle* tri = &triangles_[i];
-    tri->lightmap_->UploadTexture();
+  for (uint32 j = 0; j < triangles_.size(); j++) {
+    if (triangle_index == j || !IsTriangleInPvs(visible_leaves, j)) {
+      continue;
+    }
+
+    // If we hit any triangle then we exit early.
+    if (TriangleOccludesRay(j, trace_ray)) {
+      return j;
+    }
   }
 
-  cout << "Completed direct illumination pass." << endl;
+  return -1;
 }
 
-void ComputeIndirectIlluminationHelper(World* world, uint32 thread_index) {
-  ::std::vector<Triangle>& triangles_ = world->triangles_;
-  ::std::vector<Light>& lights_ = world->lights_;
-  ::base::normal_sphere& normal_generator = world->normal_generator;
-  uint32 triangle_bin_count = triangles_.size();
-
-#if ENABLE_MULTITHREADING
-  uint32 thread_count =
-      min(triangles_.size(), ::std::thread::hardware_concurrency());
-  triangle_bin_count = triangle_bin_count / thread_count;
+bool World::IsLightOccluded(DirectLightingContext* context,
+                            const vector3& origin, uint32 light) const {
+#if ENABLE_SHADOW_CUBE_MAPS
+  // Resolve the light with its depth cube map when the filtered samples agree,
+  // and only trace an exact ray near shadow edges and silhouettes.
+  if (light < shadow_cube_maps_.size() && !shadow_cube_maps_[light].IsEmpty()) {
+    context->shadow_cube_lookups++;
+    ShadowCubeVisibility visibility = shadow_cube_maps_[light].QueryVisibility(
+        origin, triangles_[context->triangle_index].normal_);
+    if (kShadowCubeUncertain != visibility) {
+      return kShadowCubeOccluded == visibility;
+    }
+    context->shadow_cube_fallbacks++;
+  }
 #endif
 
-  uint32 triangle_start_index = triangle_bin_count * thread_index;
-  uint32 triangle_stop_index = triangle_bin_count * (thread_index + 1);
+  const vector3& target = lights_[light].position_;
+  int32& cached_occluder = context->occluder_cache[light];
+  context->occluder_cache_lookups++;
 
-#if ENABLE_MULTITHREADING
-  if (thread_index == thread_count - 1) {
-    triangle_stop_index = triangles_.size();
+  // Neighbouring lumels are usually shadowed by the same blocker, so we try
+  // the last one we found for this light before searching the scene.
+  if (cached_occluder >= 0 && cached_occluder != context->triangle_index &&
+      TriangleOccludesRay(cached_occluder, ::base::ray(origin, target))) {
+    context->occluder_cache_hits++;
+    return true;
   }
-#endif
 
-  // For each triangle
-  for (uint32 i = triangle_start_index; i < triangle_stop_index; ++i) {
-    Triangle* tri = &triangles_[i];
-    float32 width = tri->gi_lightmap_->texture_width_;
-    float32 height = tri->gi_lightmap_->texture_height_;
-    vector2 v0 = tri->vertices_[1].lc - tri->vertices_[0].lc;
-    vector2 v1 = tri->vertices_[2].lc - tri->vertices_[0].lc;
-
-    for (uint32 lx = 0; lx < tri->gi_lightmap_->texture_width_; lx++) {
-      for (uint32 ly = 0; ly < tri->gi_lightmap_->texture_height_; ly++) {
-        vector2 lumel(::base::clip_range(lx / width, 0.0, 1.0),
-                      ::base::clip_range(ly / height, 0.0, 1.0));
-        vector2 vp = lumel - tri->vertices_[0].lc;
-        float32 u = 0.0, v = 0.0;
-        ::base::triangle_find_barycentric_coeff(v0, v1, vp, &u, &v);
-
-        /*
-        float32 three_lumels_u = 3.0f / tri->gi_lightmap_->texture_width_;
-        float32 three_lumels_v = 3.0f / tri->gi_lightmap_->texture_height_;
-        // Only trace lumels that lie on our triangles, plus a 3px boundary
-        // around the edge of the triangle, to account for bilinear sampling
-        // (and avoid black seams at the edges of the triangles after blending).
-        if ((u < -three_lumels_u) || (v < -three_lumels_v) ||
-            (u + v > 1 + three_lumels_u + three_lumels_v)) {
-          continue;
-        }
-        */
-
-        // We have a lumel that's inside the triangle. Map it to a point.
-        vector3 trace_origin;
-        ::base::triangle_interpolate_barycentric_coeff(
-            tri->vertices_[0].vert, tri->vertices_[1].vert,
-            tri->vertices_[2].vert, u, v, &trace_origin);
-
-        // Copy over our direct illumination value.
-        vector3 illumination;  // = tri->lightmap_->ReadTexel(lumel);
-        float32 sample_count = 0.0f;
-
-        // Now we run SAMPLE_COUNT samples, pointing in random directions and
-        // pulling whatever light data we hit, and averaging the values in.
-
-        for (uint32 sample = 0; sample < SAMPLE_COUNT; sample++) {
-          vector3 ray_target =
-              trace_origin + normal_generator.random_reflection(
-                                 tri->normal_ * -1.0, tri->normal_, BASE_PI) *
-                                 1000.0;
-
-          ::base::ray trace_ray(trace_origin, ray_target);
-          ::base::collision hit_info;
-          vector2 best_bary_coords;
-          Triangle* best_hit_tri = NULL;
-
-          for (uint32 j = 0; j < triangles_.size(); j++) {
-            if (i == j) {
-              continue;
-            }
+  int32 occluder = FindSegmentOccluder(context->triangle_index, origin,
+                                       target, context->visible_leaves);
+  if (occluder >= 0) {
+    cached_occluder = occluder;
+  }
 
-            Triangle* test_tri = &triangles_[j];
+  return occluder >= 0;
+}
 
-            if (test_tri->requires_alpha_) {
-              // Ignore transparent or partially transparent triangles.
-              continue;
-            }
+uint32 World::TraceShadowPacket(DirectLightingContext* context,
+                                const vector3* origins, uint32 active_mask,
+                                uint32 light) const {
+  const vector3& target = lights_[light].position_;
+  uint32 occluded_mask = 0;
+  uint32 ray_count = 0;
+
+  // Every ray of the packet ends at the light, so the packet is bounded by a
+  // cone with its apex at the light, around the mean ray direction.
+  vector3 axis;
+  for (uint32 k = 0; k < SHADOW_PACKET_SIZE; k++) {
+    if (active_mask & (1 << k)) {
+      axis += origins[k] - target;
+      ray_count++;
+    }
+  }
 
-            ::base::collision test_hit;
-            vector2 test_bary_coords;
-            // Test for collision, keeping track of the closest one.
-            if (::base::ray_intersect_triangle(
-                    test_tri->vertices_[0].vert, test_tri->vertices_[1].vert,
-                    test_tri->vertices_[2].vert, test_tri->plane_, trace_ray,
-                    &test_hit, &test_bary_coords)) {
-              if (test_hit.param < hit_info.param &&
-                  test_hit.param > BASE_EPSILON &&
-                  test_hit.param < 1.0f - BASE_EPSILON) {
-                hit_info = test_hit;
-                best_hit_tri = test_tri;
-                best_bary_coords = test_bary_coords;
-              }
-            }
-          }
+  float32 axis_length = sqrt((double)axis.dot(axis));
+  float32 cone_cosine = 1.0f;
+  float32 max_length = 0.0f;
+  ::base::bounds packet_bounds;
+  packet_bounds += target;
+
+  if (axis_length > BASE_EPSILON) {
+    axis = axis / axis_length;
+    for (uint32 k = 0; k < SHADOW_PACKET_SIZE; k++) {
+      if (active_mask & (1 << k)) {
+        vector3 offset = origins[k] - target;
+        float32 length = sqrt((double)offset.dot(offset));
+        cone_cosine = min(cone_cosine, offset.dot(axis) / max(length, 1e-6f));
+        max_length = max(max_length, length);
+        packet_bounds += origins[k];
+      }
+    }
+  }
 
-          if (hit_info.param < 1.0 - BASE_EPSILON &&
-              hit_info.param > BASE_EPSILON) {
-            // We hit something -- sample it's lighting and add it to our total.
-            vector3 incident = (hit_info.point - trace_origin);
-            const vector3& t0 = best_hit_tri->vertices_[0].tc;
-            const vector3& t1 = best_hit_tri->vertices_[1].tc;
-            const vector3& t2 = best_hit_tri->vertices_[2].tc;
-
-            const vector3& l0 = best_hit_tri->vertices_[0].lc;
-            const vector3& l1 = best_hit_tri->vertices_[1].lc;
-            const vector3& l2 = best_hit_tri->vertices_[2].lc;
-
-            const vector3& c0 = best_hit_tri->vertices_[0].color;
-            const vector3& c1 = best_hit_tri->vertices_[1].color;
-            const vector3& c2 = best_hit_tri->vertices_[2].color;
-
-            vector3 output_texcoords, output_lightcoords, output_color;
-            ;
-
-            triangle_interpolate_barycentric_coeff(
-                t0, t1, t2, best_bary_coords.x, best_bary_coords.y,
-                &output_texcoords);
-
-            triangle_interpolate_barycentric_coeff(
-                l0, l1, l2, best_bary_coords.x, best_bary_coords.y,
-                &output_lightcoords);
-
-            triangle_interpolate_barycentric_coeff(
-                c0, c1, c2, best_bary_coords.x, best_bary_coords.y,
-                &output_color);
-
-            vector2 target_lc =
-                vector2(output_lightcoords.x, output_lightcoords.y);
-            vector2 target_tc = vector2(fmod(output_texcoords.x, 1.0),
-                                        fmod(output_texcoords.y, 1.0));
-
-            vector3 color = best_hit_tri->lightmap_->ReadTexel(target_lc) *
-                            best_hit_tri->diffuse_->ReadTexel(target_tc) *
-                            output_color;
-
-            illumination +=
-                color * fabs(incident.normalize().dot(tri->normal_));
-            sample_count += 1.0f;
-          }
-        }
+  // Packets with few rays, or rays that fan out too widely to share culling
+  // work, are traced one ray at a time.
+  if (ENABLE_SHADOW_CUBE_MAPS || ray_count < SHADOW_PACKET_MIN_RAYS ||
+      axis_length <= BASE_EPSILON || cone_cosine < SHADOW_PACKET_MIN_COSINE) {
+    for (uint32 k = 0; k < SHADOW_PACKET_SIZE; k++) {
+      if ((active_mask & (1 << k)) &&
+          IsLightOccluded(context, origins[k], light)) {
+        occluded_mask |= 1 << k;
+      }
+    }
 
-        if (sample_count) {
-          illumination = illumination / sample_count;
-          illumination.x = pow(::base::saturate(illumination.x), 1.0 / 2.6);
-          illumination.y = pow(::base::saturate(illumination.y), 1.0 / 2.6);
-          illumination.z = pow(::base::saturate(illumination.z), 1.0 / 2.6);
-        }
+    context->shadow_packet_fallbacks += ray_count;
+    return occluded_mask;
+  }
 
-        illumination += tri->lightmap_->ReadTexel(lumel);
-        illumination = illumination.clamp(0.0, 1.0);
-        tri->gi_lightmap_->WriteTexel(lumel, illumination);
+  context->shadow_packets++;
+  context->shadow_packet_rays += ray_count;
+  context->occluder_cache_lookups += ray_count;
+
+  // Try the last occluder of this light for every lane before searching.
+  int32& cached_occluder = context->occluder_cache[light];
+  if (cached_occluder >= 0 && cached_occluder != context->triangle_index) {
+    for (uint32 k = 0; k < SHADOW_PACKET_SIZE; k++) {
+      if ((active_mask & (1 << k)) &&
+          TriangleOccludesRay(cached_occluder,
+                              ::base::ray(origins[k], target))) {
+        occluded_mask |= 1 << k;
+        context->occluder_cache_hits++;
       }
     }
-
-    tri->gi_lightmap_->BlurTexture(3, 1);
-    tri->gi_lightmap_->BlurTexture(3, 1);
   }
-}
 
-void World::ComputeIndirectIllumination() {
-#if ENABLE_MULTITHREADING
-  ::std::vector<::std::thread> thread_list;
-  uint32 thread_count =
-      min(triangles_.size(), ::std::thread::hardware_concurrency());
+  float32 cone_angle = acos(::base::clip_range(cone_cosine, -1.0f, 1.0f));
+  uint32 pending_mask = active_mask & ~occluded_mask;
 
-  for (uint32 thread_idx = 0; thread_idx < thread_count; thread_idx++) {
-    thread_list.emplace_back(&ComputeIndirectIlluminationHelper, this,
-                             thread_idx);
-  }
+  // Tests one candidate triangle against the pending lanes, after culling it
+  // against the packet as a whole.
+  auto test_triangle = [&](uint32 j) {
+    const TriangleGeometry* test_tri = &triangle_geometry_[j];
+    if (!IsTriangleInPvs(context->visible_leaves, j)) {
+      return;
+    }
 
-  for (auto& thread_ : thread_list) {
-    thread_.join();
-  }
-#else
-  ComputeIndirectIlluminationHelper(this, 0);
-#endif
+    // Cull triangles whose plane has the light and every ray origin strictly
+    // on the same side.
+    const vector4& plane = test_tri->plane;
+    float32 light_side = plane.x * target.x + plane.y * target.y +
+                         plane.z * target.z + plane.w;
+    bool same_side = light_side != 0.0f;
+    for (uint32 k = 0; k < SHADOW_PACKET_SIZE && same_side; k++) {
+      if (pending_mask & (1 << k)) {
+        float32 origin_side = plane.x * origins[k].x + plane.y * origins[k].y +
+                              plane.z * origins[k].z + plane.w;
+        same_side = (origin_side > 0.0f) == (light_side > 0.0f) &&
+                    origin_side != 0.0f;
+      }
+    }
 
-  // Upload all of our textures to the GPU.
-  for (uint32 i = 0; i < triangles_.size(); i++) {
-    Triangle* tri = &triangles_[i];
-    tri->gi_lightmap_->UploadTexture();
-  }
+    if (same_side) {
+      return;
+    }
 
-  cout << "Completed global illumination pass." << endl;
-}
+    // Cull triangles outside the packet's bounds.
+    const vector3& v0 = test_tri->vertices[0];
+    const vector3& v1 = test_tri->vertices[1];
+    const vector3& v2 = test_tri->vertices[2];
+    bool outside = false;
+    for (int32 axis_index = 0; axis_index < 3 && !outside; axis_index++) {
+      outside = min(v0[axis_index], min(v1[axis_index], v2[axis_index])) >
+                    packet_bounds.bounds_max[axis_index] ||
+                max(v0[axis_index], max(v1[axis_index], v2[axis_index])) <
+                    packet_bounds.bounds_min[axis_index];
+    }
 
-void World::GenerateLightmaps() {
-  // Pass 1: direct illumination contribution.
-  ComputeDirectIllumination();
-  // Pass 2: indirect illumination contribution.
-  ComputeIndirectIllumination();
-}
\ No newline at end of file
+    if (outside) {
+      return;
+    }
+
+    // Cull triangles whose bounding sphere lies outside the packet's cone.
+    vector3 center = (v0 + v1 + v2) / 3.0f;
+    float32 radius = sqrt((double)max(
+        (v0 - center).dot(v0 - center),
+        max((v1 - center).dot(v1 - center), (v2 - center).dot(v2 - center))));
+    if (PacketConeExcludesSphere(target, axis, cone_angle, max_length, center,
+                                 radius)) {
+      return;
+    }
+
+    for (uint32 k = 0; k < SHADOW_PACKET_SIZE; k++) {
+      if ((pending_mask & (1 << k)) &&
+          TriangleOccludesRay(j, ::base::ray(origins[k], target))) {
+        occluded_mask |= 1 << k;
+        pending_mask &= ~(1 << k);
+        cached_occluder = j;
+      }
+    }
+  };
+
+  if (!triangle_grid_.IsEmpty()) {
+    // Walk each unresolved ray through the grid. Triangles met along one ray
+    // are tested against the whole packet, so later walks may be skipped.
+    for (uint32 k = 0; k < SHADOW_PACKET_SIZE; k++) {
+      UniformGridWalk walk;
+      if (!(pending_mask & (1 << k)) ||
+          !triangle_grid_.BeginWalk(origins[k], target - origins[k], 1.0f,
+                                    &walk)) {
+        continue;
+      }
+
+      const uint32* cell_triangles = NULL;
+      uint32 cell_triangle_count = 0;
+      float32 t_cell_exit = 0.0f;
+      while ((pending_mask & (1 << k)) &&
+             triangle_grid_.StepWalk(&walk, &cell_triangles,
+                                     &cell_triangle_count, &t_cell_exit)) {
+        for (uint32 p = 0; p < cell_triangle_count && (pending_mask & (1 << k));
+             p++) {
+          uint32 j = cell_triangles[p];
+          if (j != context->triangle_index &&
+              !triangle_geometry_[j].requires_alpha) {
+            test_triangle(j);
+          }
+        }
+      }
+    }
+
+    return occluded_mask;
+  }
+
+#if ENABLE_BVH
+  if (HasBvh()) {
+    WalkBvh(
+        NULL,
+        [&](const float32* bounds_min, const float32* bounds_max) {
+          // Cull children outside the packet's bounds or bounding cone.
+          for (int32 axis_index = 0; axis_index < 3; axis_index++) {
+            if (bounds_min[axis_index] >
+                    packet_bounds.bounds_max[axis_index] ||
+                bounds_max[axis_index] <
+                    packet_bounds.bounds_min[axis_index]) {
+              return false;
+            }
+          }
+
+          vector3 extent = QueryBoxExtent(bounds_min, bounds_max);
+          return !PacketConeExcludesSphere(
+              target, axis, cone_angle, max_length,
+              QueryBoxCenter(bounds_min, bounds_max),
+              0.5f * sqrt((double)extent.dot(extent)));
+        },
+        [&](uint32 j) {
+          if (j != context->triangle_index &&
+              !triangle_geometry_[j].requires_alpha) {
+            test_triangle(j);
+          }
+          return 0 != pending_mask;
+        });
+
+    return occluded_mask;
+  }
+#endif
+
+  for (uint32 j = 0; j < triangles_.size() && pending_mask; j++) {
+    if (j != context->triangle_index && !triangle_geometry_[j].requires_alpha) {
+      test_triangle(j);
+    }
+  }
+
+  return occluded_mask;
+}
+
+void World::BuildShadowCubeMaps() {
+  shadow_cube_maps_.clear();
+  shadow_cube_maps_.resize(min(lights_.size(), SHADOW_CUBE_MAX_LIGHTS));
+
+  uint64 memory_usage = 0;
+  for (uint32 light = 0; light < shadow_cube_maps_.size(); light++) {
+    const Light& source = lights_[light];
+    ShadowCubeMap* cube_map = &shadow_cube_maps_[light];
+    cube_map->Initialize(source.position_, SHADOW_CUBE_RESOLUTION,
+                         source.influence_radius_);
+
+    for (uint32 i = 0; i < triangle_geometry_.size(); i++) {
+      const TriangleGeometry* geometry = &triangle_geometry_[i];
+      if (geometry->requires_alpha) {
+        // Transparent triangles never occlude shadow rays.
+        continue;
+      }
+
+      ::base::bounds tri_bounds;
+      tri_bounds += geometry->vertices[0];
+      tri_bounds += geometry->vertices[1];
+      tri_bounds += geometry->vertices[2];
+      if (!::base::sphere_intersect_bounds(
+              source.position_, source.influence_radius_, tri_bounds)) {
+        continue;
+      }
+
+      cube_map->RasterizeTriangle(geometry->vertices[0],
+                                  geometry->vertices[1],
+                                  geometry->vertices[2]);
+    }
+
+    memory_usage += cube_map->QueryMemoryUsage();
+  }
+
+  cout << "Built " << shadow_cube_maps_.size() << " shadow cube maps ("
+       << memory_usage / (1024 * 1024) << " MB)." << endl;
+}
+
+::base::bounds World::ComputeLightmapBounds(uint32 triangle_index) const {
+  const Texture* lightmap =
+      textures_[triangles_[triangle_index].lightmap_].get();
+  uint32 max_x = lightmap->texture_width_ - 1;
+  uint32 max_y = lightmap->texture_height_ - 1;
+  ::base::bounds lumel_bounds;
+
+  // Lumels map affinely onto the triangle's plane, so the corner lumels bound
+  // all of the others.
+  lumel_bounds += ComputeLumelPosition(triangle_index, 0, 0);
+  lumel_bounds += ComputeLumelPosition(triangle_index, max_x, 0);
+  lumel_bounds += ComputeLumelPosition(triangle_index, 0, max_y);
+  lumel_bounds += ComputeLumelPosition(triangle_index, max_x, max_y);
+  return lumel_bounds;
+}
+
+::std::vector<uint32> World::FindInfluencingLights(
+    uint32 triangle_index) const {
+  ::base::bounds lumel_bounds = ComputeLightmapBounds(triangle_index);
+  ::std::vector<uint32> light_indices;
+
+  for (uint32 light = 0; light < lights_.size(); light++) {
+    if (::base::sphere_intersect_bounds(lights_[light].position_,
+                                        lights_[light].influence_radius_,
+                                        lumel_bounds)) {
+      light_indices.push_back(light);
+    }
+  }
+
+  return light_indices;
+}
+
+void World::PrepareDirectLightingContext(
+    uint32 triangle_index, DirectLightingContext* context) const {
+  context->triangle_index = triangle_index;
+
+  // The occluder cache belongs to the thread and outlives each triangle.
+  if (context->occluder_cache.size() != lights_.size()) {
+    context->occluder_cache.assign(lights_.size(), -1);
+  }
+
+  context->packet_occlusion = NULL;
+  context->lumel_index = 0;
+
+  // Only lights whose influence sphere reaches the lightmap are considered.
+  context->light_indices = FindInfluencingLights(triangle_index);
+
+  context->visible_leaves.clear();
+  if (world_bsp_.HasVisibility() && !context->light_indices.empty()) {
+    const Texture* lightmap =
+        textures_[triangles_[triangle_index].lightmap_].get();
+    uint32 max_x = lightmap->texture_width_ - 1;
+    uint32 max_y = lightmap->texture_height_ - 1;
+    vector3 corners[4] = {ComputeLumelPosition(triangle_index, 0, 0),
+                          ComputeLumelPosition(triangle_index, max_x, 0),
+                          ComputeLumelPosition(triangle_index, max_x, max_y),
+                          ComputeLumelPosition(triangle_index, 0, max_y)};
+
+    // Shadow rays ignore hits within BASE_EPSILON of either end, so a ray may
+    // slip through a triangle that close to its lumel. Grow the lumels' region
+    // by that much for the farthest light.
+    float32 reach = 0.0f;
+    for (uint32 light : context->light_indices) {
+      reach = max(reach, lights_[light].influence_radius_);
+    }
+
+    ::std::vector<uint32> lumel_leaves;
+    world_bsp_.FindLeaves(corners, 4, BASE_EPSILON * reach, &lumel_leaves);
+    for (uint32 leaf : lumel_leaves) {
+      world_bsp_.AccumulateVisibleLeaves(leaf, &context->visible_leaves);
+    }
+
+    // A light outside the PVS is occluded from every lumel, and occluded
+    // lights contribute nothing, so dropping it leaves the lightmap unchanged.
+    uint32 kept = 0;
+    for (uint32 light : context->light_indices) {
+      const ::std::vector<uint32>& leaves = light_leaves_[light];
+      bool visible = leaves.empty();
+      for (uint32 i = 0; i < leaves.size() && !visible; i++) {
+        visible =
+            (context->visible_leaves[leaves[i] / 64] >> (leaves[i] % 64)) & 1;
+      }
+
+      if (visible) {
+        context->light_indices[kept++] = light;
+      }
+    }
+
+    context->pvs_culled_lights += context->light_indices.size() - kept;
+    context->light_indices.resize(kept);
+  }
+
+#if DIRECT_LIGHT_SELECTION == LIGHT_SELECTION_SAMPLED
+  const Texture* lightmap =
+      textures_[triangles_[triangle_index].lightmap_].get();
+  uint32 max_x = lightmap->texture_width_ - 1;
+  uint32 max_y = lightmap->texture_height_ - 1;
+  vector3 probes[5] = {
+      ComputeLumelPosition(triangle_index, 0, 0),
+      ComputeLumelPosition(triangle_index, max_x, 0),
+      ComputeLumelPosition(triangle_index, 0, max_y),
+      ComputeLumelPosition(triangle_index, max_x, max_y),
+      ComputeLumelPosition(triangle_index, max_x / 2, max_y / 2)};
+
+  // Weight each light by its average unoccluded contribution at the corners
+  // and center of the lightmap, assuming it faces the surface.
+  ::std::vector<float32> weights(context->light_indices.size());
+  for (uint32 i = 0; i < context->light_indices.size(); i++) {
+    const Light& light = lights_[context->light_indices[i]];
+    float32 intensity =
+        MaxChannel(vector3(light.color_.x, light.color_.y, light.color_.z)) *
+        light.intensity_;
+    for (uint32 p = 0; p < 5; p++) {
+      float32 length = (light.position_ - probes[p]).length();
+      float32 attenuation = (500.0f * intensity) / (1.0 + pow(length, 2));
+      weights[i] += pow(::base::saturate(attenuation), 1.0 / 2.6) / 5.0f;
+    }
+  }
+
+  context->light_table.initialize(weights);
+#endif
+}
+
+vector3 World::ComputeLumelDirectIllumination(DirectLightingContext* context,
+                                              const vector3& origin,
+                                              uint64* visibility) const {
+#if DIRECT_LIGHT_SELECTION == LIGHT_SELECTION_TREE
+  return ComputeLumelLightcutIllumination(context, origin, visibility);
+#elif DIRECT_LIGHT_SELECTION == LIGHT_SELECTION_SAMPLED
+  return ComputeLumelSampledIllumination(context, origin, visibility);
+#else
+  return ComputeLumelLightListIllumination(context, origin, visibility);
+#endif
+}
+
+vector3 World::ComputeLumelLightListIllumination(
+    DirectLightingContext* context, const vector3& origin,
+    uint64* visibility) const {
+  const Triangle* tri = &triangles_[context->triangle_index];
+  vector3 illumination;
+
+  if (visibility) {
+    *visibility = 0;
+  }
+
+  for (uint32 slot = 0; slot < context->light_indices.size(); slot++) {
+    uint32 light = context->light_indices[slot];
+    float32 radius = lights_[light].influence_radius_;
+    if ((lights_[light].position_ - origin).dot(
+            lights_[light].position_ - origin) > radius * radius) {
+      // Too far away to register, so skip the shadow ray.
+      continue;
+    }
+
+    bool occluded =
+        context->packet_occlusion
+            ? (context->packet_occlusion[slot] >> context->packet_lane) & 1
+            : IsLightOccluded(context, origin, light);
+    if (occluded) {
+      continue;
+    }
+
+    // We did not hit anything. Compute the light value and accumulate it.
+    vector3 incident = (lights_[light].position_ - origin);
+    float32 length = incident.length();
+    float32 dot = fabs(incident.normalize().dot(tri->normal_));
+    float32 attenuation =
+        (500.0f * lights_[light].intensity_) / (1.0 + pow(length, 2));
+    vector3 illum = lights_[light].color_ * dot * attenuation;
+    illum.x = pow(::base::saturate(illum.x), 1.0 / 2.6);
+    illum.y = pow(::base::saturate(illum.y), 1.0 / 2.6);
+    illum.z = pow(::base::saturate(illum.z), 1.0 / 2.6);
+    illumination = QuantizeTexel((illumination + illum).clamp(0.0, 1.0));
+
+    if (visibility) {
+      *visibility |= (1ull << (light % 64));
+    }
+  }
+
+  return illumination;
+}
+
+// A cluster within the lightcut of a single lumel.
+struct LightcutEntry {
+  uint32 node;
+  // The cluster's estimated contribution.
+  vector3 estimate;
+  // An upper bound on the error of the estimate (zero for single lights).
+  float32 error;
+  // True if the cluster's representative light reached the lumel.
+  bool visible;
+
+  bool operator<(const LightcutEntry& rhs) const { return error < rhs.error; }
+};
+
+vector3 World::ComputeLumelLightcutIllumination(
+    DirectLightingContext* context, const vector3& origin,
+    uint64* visibility) const {
+  const Triangle* tri = &triangles_[context->triangle_index];
+  ::std::vector<LightcutEntry> cut;
+  vector3 illumination;
+
+  if (visibility) {
+    *visibility = 0;
+  }
+
+  if (light_tree_.IsEmpty()) {
+    return illumination;
+  }
+
+  // Evaluates a single cluster, reusing the parent's shadow ray when the
+  // cluster shares its representative. Returns false if no light in the
+  // cluster can reach the point.
+  auto evaluate_node = [&](uint32 node_index, const LightcutEntry* parent,
+                           LightcutEntry* output) {
+    const LightTreeNode& node = light_tree_.QueryNode(node_index);
+    if (!::base::sphere_intersect_bounds(origin, node.influence_radius,
+                                         node.bounds)) {
+      return false;
+    }
+
+    const Light& light = lights_[node.representative];
+    output->node = node_index;
+    output->visible =
+        (parent && light_tree_.QueryNode(parent->node).representative ==
+                       node.representative)
+            ? parent->visible
+            : !IsLightOccluded(context, origin, node.representative);
+
+    // Each light is gamma corrected and quantized individually by the
+    // exhaustive pass, so we treat the cluster as light_count copies of its
+    // mean light.
+    vector3 mean_intensity = node.intensity / node.light_count;
+    vector3 incident = (light.position_ - origin);
+    float32 length = incident.length();
+    float32 dot = fabs(incident.normalize().dot(tri->normal_));
+    float32 geometry = (500.0f * dot) / (1.0 + pow(length, 2));
+    output->estimate = vector3();
+
+    if (output->visible) {
+      vector3 illum = mean_intensity * geometry;
+      output->estimate.x = pow(::base::saturate(illum.x), 1.0 / 2.6);
+      output->estimate.y = pow(::base::saturate(illum.y), 1.0 / 2.6);
+      output->estimate.z = pow(::base::saturate(illum.z), 1.0 / 2.6);
+      output->estimate = QuantizeTexel(output->estimate) * node.light_count;
+    }
+
+    output->error = 0.0f;
+    if (node.children[0] >= 0) {
+      // Bound the cluster by placing all of its lights at the closest point
+      // of its bounds, facing the surface, and fully visible.
+      vector3 closest = origin;
+      for (uint32 axis = 0; axis < 3; axis++) {
+        closest.v[axis] = ::base::clip_range(origin.v[axis],
+                                             node.bounds.bounds_min.v[axis],
+                                             node.bounds.bounds_max.v[axis]);
+      }
+      float32 distance = (closest - origin).length();
+      float32 max_geometry = 500.0f / (1.0 + pow(distance, 2));
+      float32 max_illum = pow(
+          ::base::saturate(MaxChannel(mean_intensity) * max_geometry),
+          1.0 / 2.6);
+      output->error =
+          QuantizeTexel(vector3(max_illum, max_illum, max_illum)).x *
+          node.light_count;
+    }
+
+    return true;
+  };
+
+  LightcutEntry root;
+  if (evaluate_node(0, NULL, &root)) {
+    cut.push_back(root);
+    illumination += root.estimate;
+  }
+
+  // Repeatedly split the cluster with the largest error bound until every
+  // bound is a small fraction of the total.
+  while (!cut.empty() && cut.size() < LIGHT_TREE_MAX_CUT) {
+    ::std::pop_heap(cut.begin(), cut.end());
+    LightcutEntry worst = cut.back();
+
+    if (worst.error <= LIGHT_TREE_ERROR_RATIO * MaxChannel(illumination)) {
+      ::std::push_heap(cut.begin(), cut.end());
+      break;
+    }
+
+    cut.pop_back();
+    illumination -= worst.estimate;
+
+    const LightTreeNode& node = light_tree_.QueryNode(worst.node);
+    for (uint32 c = 0; c < 2; c++) {
+      LightcutEntry child;
+      if (evaluate_node(node.children[c], &worst, &child)) {
+        cut.push_back(child);
+        ::std::push_heap(cut.begin(), cut.end());
+        illumination += child.estimate;
+      }
+    }
+  }
+
+  if (visibility) {
+    for (const LightcutEntry& entry : cut) {
+      if (entry.visible) {
+        *visibility |=
+            (1ull << (light_tree_.QueryNode(entry.node).representative % 64));
+      }
+    }
+  }
+
+  return illumination.clamp(0.0, 1.0);
+}
+
+vector3 World::ComputeLumelSampledIllumination(
+    DirectLightingContext* context, const vector3& origin,
+    uint64* visibility) const {
+  const Triangle* tri = &triangles_[context->triangle_index];
+  vector3 illumination;
+
+  if (visibility) {
+    *visibility = 0;
+  }
+
+  if (context->light_table.is_empty()) {
+    return illumination;
+  }
+
+  // Each lumel draws from its own stream, so the choice of lights does not
+  // depend on which thread shades it.
+  ::base::random_stream stream(::base::random_key(
+      RANDOM_STREAM_DIRECT, context->triangle_index, context->lumel_index));
+
+  for (uint32 sample = 0; sample < DIRECT_LIGHT_SAMPLE_COUNT; sample++) {
+    float32 u = stream.random_float();
+    float32 v = stream.random_float();
+    uint32 entry = context->light_table.sample(u, v);
+    uint32 light = context->light_indices[entry];
+    float32 radius = lights_[light].influence_radius_;
+    if ((lights_[light].position_ - origin).dot(
+            lights_[light].position_ - origin) > radius * radius) {
+      continue;
+    }
+
+    if (IsLightOccluded(context, origin, light)) {
+      continue;
+    }
+
+    vector3 incident = (lights_[light].position_ - origin);
+    float32 length = incident.length();
+    float32 dot = fabs(incident.normalize().dot(tri->normal_));
+    float32 attenuation =
+        (500.0f * lights_[light].intensity_) / (1.0 + pow(length, 2));
+    vector3 illum = lights_[light].color_ * dot * attenuation;
+    illum.x = pow(::base::saturate(illum.x), 1.0 / 2.6);
+    illum.y = pow(::base::saturate(illum.y), 1.0 / 2.6);
+    illum.z = pow(::base::saturate(illum.z), 1.0 / 2.6);
+
+    // Dividing by the selection probability keeps the estimate of the summed
+    // (per-light quantized) contribution unbiased.
+    float32 probability = context->light_table.query_probability(entry);
+    illumination += QuantizeTexel(illum) /
+                    (probability * DIRECT_LIGHT_SAMPLE_COUNT);
+
+    if (visibility) {
+      *visibility |= (1ull << (light % 64));
+    }
+  }
+
+  return illumination.clamp(0.0, 1.0);
+}
+
+void World::ComputeExhaustiveDirectIllumination(
+    DirectLightingContext* context) {
+#if ENABLE_SHADOW_PACKETS && DIRECT_LIGHT_SELECTION == LIGHT_SELECTION_ALL
+  ComputePacketDirectIllumination(context);
+  return;
+#endif
+
+  Texture* lightmap =
+      textures_[triangles_[context->triangle_index].lightmap_].get();
+  float32 width = lightmap->texture_width_;
+  float32 height = lightmap->texture_height_;
+
+  uint32 lumel_count = lightmap->texture_width_ * lightmap->texture_height_;
+
+  // Visit the lumels in memory order, so that neighbouring lumels trace
+  // similar rays one after another and write to the same cache lines.
+  for (uint32 i = 0; i < lumel_count; i++) {
+    // Stop at the next tile boundary once the bake is cancelled.
+    if (!(i % (LIGHTMAP_TILE_SIZE * LIGHTMAP_TILE_SIZE)) &&
+        bake_progress_.IsCancelled()) {
+      return;
+    }
+
+    uint32 lx = 0, ly = 0;
+    lightmap->QueryTexelCoords(i, &lx, &ly);
+    vector2 lumel(lx / width, ly / height);
+    vector3 trace_origin = QueryLumelPosition(context->triangle_index, i);
+    context->lumel_index = i;
+    lightmap->WriteTexel(
+        lumel, ComputeLumelDirectIllumination(context, trace_origin, NULL));
+  }
+
+  direct_traced_lumels_ += lumel_count;
+}
+
+void World::ComputePacketDirectIllumination(DirectLightingContext* context) {
+  Texture* lightmap =
+      textures_[triangles_[context->triangle_index].lightmap_].get();
+  uint32 width = lightmap->texture_width_;
+  uint32 height = lightmap->texture_height_;
+  uint32 lumel_count = width * height;
+
+  ::std::vector<uint32> occlusion(context->light_indices.size());
+  vector3 origins[SHADOW_PACKET_SIZE];
+  uint32 lumel_x[SHADOW_PACKET_SIZE];
+  uint32 lumel_y[SHADOW_PACKET_SIZE];
+
+  // Each packet takes the next SHADOW_PACKET_SIZE lumels in memory order. In
+  // the tiled layout these form a compact block of the lightmap.
+  for (uint32 first = 0; first < lumel_count; first += SHADOW_PACKET_SIZE) {
+    // Stop at the next tile boundary once the bake is cancelled.
+    uint32 tile_offset = first % (LIGHTMAP_TILE_SIZE * LIGHTMAP_TILE_SIZE);
+    if (tile_offset < SHADOW_PACKET_SIZE && bake_progress_.IsCancelled()) {
+      return;
+    }
+
+    uint32 lane_count = min(SHADOW_PACKET_SIZE, lumel_count - first);
+    for (uint32 k = 0; k < lane_count; k++) {
+      lightmap->QueryTexelCoords(first + k, &lumel_x[k], &lumel_y[k]);
+      origins[k] = QueryLumelPosition(context->triangle_index, first + k);
+    }
+
+    // Resolve every light for the whole packet, skipping lanes that are out
+    // of the light's reach.
+    for (uint32 slot = 0; slot < context->light_indices.size(); slot++) {
+      const Light& light = lights_[context->light_indices[slot]];
+      float32 radius = light.influence_radius_;
+      uint32 active_mask = 0;
+      for (uint32 k = 0; k < lane_count; k++) {
+        if ((light.position_ - origins[k]).dot(light.position_ - origins[k]) <=
+            radius * radius) {
+          active_mask |= 1 << k;
+        }
+      }
+
+      occlusion[slot] =
+          active_mask ? TraceShadowPacket(context, origins, active_mask,
+                                          context->light_indices[slot])
+                      : 0;
+    }
+
+    context->packet_occlusion = &occlusion[0];
+    for (uint32 k = 0; k < lane_count; k++) {
+      context->packet_lane = k;
+      context->lumel_index = first + k;
+      vector2 lumel((float32)lumel_x[k] / width, (float32)lumel_y[k] / height);
+      lightmap->WriteTexel(
+          lumel, ComputeLumelDirectIllumination(context, origins[k], NULL));
+    }
+    context->packet_occlusion = NULL;
+  }
+
+  direct_traced_lumels_ += lumel_count;
+}
+
+void World::RefineAdaptiveBlock(DirectLightingContext* context,
+                                AdaptiveLumelGrid* grid, uint32 x0, uint32 y0,
+                                uint32 x1, uint32 y1) {
+  const Texture* lightmap =
+      textures_[triangles_[context->triangle_index].lightmap_].get();
+  uint32 corner_x[4] = {x0, x1, x0, x1};
+  uint32 corner_y[4] = {y0, y0, y1, y1};
+  uint32 corners[4];
+
+  // Trace the block corners (if a neighbouring block hasn't already).
+  for (uint32 c = 0; c < 4; c++) {
+    corners[c] = corner_y[c] * grid->width + corner_x[c];
+    if (grid->state[corners[c]] != AdaptiveLumelGrid::kTraced) {
+      context->lumel_index =
+          lightmap->QueryTexelIndex(corner_x[c], corner_y[c]);
+      vector3 trace_origin =
+          QueryLumelPosition(context->triangle_index, context->lumel_index);
+      grid->illumination[corners[c]] = ComputeLumelDirectIllumination(
+          context, trace_origin, &grid->visibility[corners[c]]);
+      grid->state[corners[c]] = AdaptiveLumelGrid::kTraced;
+      direct_traced_lumels_++;
+    }
+  }
+
+  // Blocks that are at most one lumel across have no interior.
+  if (x1 - x0 <= 1 && y1 - y0 <= 1) {
+    return;
+  }
+
+  bool uniform = true;
+  for (uint32 c = 1; c < 4 && uniform; c++) {
+    vector3 delta =
+        grid->illumination[corners[c]] - grid->illumination[corners[0]];
+    if (grid->visibility[corners[c]] != grid->visibility[corners[0]] ||
+        fabs(delta.x) > ADAPTIVE_IRRADIANCE_THRESHOLD ||
+        fabs(delta.y) > ADAPTIVE_IRRADIANCE_THRESHOLD ||
+        fabs(delta.z) > ADAPTIVE_IRRADIANCE_THRESHOLD) {
+      uniform = false;
+    }
+  }
+
+  if (uniform) {
+    // Every corner sees the same lights with similar irradiance, so we
+    // bilinearly interpolate the interior instead of tracing it.
+    for (uint32 y = y0; y <= y1; y++) {
+      for (uint32 x = x0; x <= x1; x++) {
+        uint32 index = y * grid->width + x;
+        if (grid->state[index] == AdaptiveLumelGrid::kTraced) {
+          continue;
+        }
+        float32 s = (x1 > x0) ? (float32)(x - x0) / (x1 - x0) : 0.0f;
+        float32 t = (y1 > y0) ? (float32)(y - y0) / (y1 - y0) : 0.0f;
+        vector3 top = grid->illumination[corners[0]] * (1.0f - s) +
+                      grid->illumination[corners[1]] * s;
+        vector3 bottom = grid->illumination[corners[2]] * (1.0f - s) +
+                         grid->illumination[corners[3]] * s;
+        grid->illumination[index] = top * (1.0f - t) + bottom * t;
+        grid->state[index] = AdaptiveLumelGrid::kInterpolated;
+      }
+    }
+    return;
+  }
+
+  // The block straddles a shadow edge or penumbra, so split it in four.
+  uint32 mx = (x0 + x1) / 2;
+  uint32 my = (y0 + y1) / 2;
+  RefineAdaptiveBlock(context, grid, x0, y0, mx, my);
+  RefineAdaptiveBlock(context, grid, mx, y0, x1, my);
+  RefineAdaptiveBlock(context, grid, x0, my, mx, y1);
+  RefineAdaptiveBlock(context, grid, mx, my, x1, y1);
+}
+
+void World::ComputeAdaptiveDirectIllumination(
+    DirectLightingContext* context) {
+  Texture* lightmap =
+      textures_[triangles_[context->triangle_index].lightmap_].get();
+  uint32 width = lightmap->texture_width_;
+  uint32 height = lightmap->texture_height_;
+  AdaptiveLumelGrid grid(width, height);
+
+  if (width < 2 || height < 2) {
+    ComputeExhaustiveDirectIllumination(context);
+    return;
+  }
+
+  for (uint32 by = 0; by < height - 1; by += ADAPTIVE_BLOCK_SIZE) {
+    for (uint32 bx = 0; bx < width - 1; bx += ADAPTIVE_BLOCK_SIZE) {
+      // Stop at the next block once the bake is cancelled.
+      if (bake_progress_.IsCancelled()) {
+        return;
+      }
+
+      RefineAdaptiveBlock(context, &grid, bx, by,
+                          min(bx + ADAPTIVE_BLOCK_SIZE, width - 1),
+                          min(by + ADAPTIVE_BLOCK_SIZE, height - 1));
+    }
+  }
+
+  for (uint32 i = 0; i < width * height; i++) {
+    uint32 lx = 0, ly = 0;
+    lightmap->QueryTexelCoords(i, &lx, &ly);
+    vector2 lumel(lx / (float32)width, ly / (float32)height);
+    lightmap->WriteTexel(lumel, grid.illumination[ly * width + lx]);
+  }
+}
+
+void ComputeDirectIlluminationHelper(World* world, uint32 triangle_index,
+                                     DirectLightingContext* context) {
+  world->PrepareDirectLightingContext(triangle_index, context);
+  world->direct_light_pairs_ += context->light_indices.size();
+  uint64 first_ray = context->occluder_cache_lookups;
+
+#if ENABLE_ADAPTIVE_DIRECT
+  world->ComputeAdaptiveDirectIllumination(context);
+#else
+  world->ComputeExhaustiveDirectIllumination(context);
+#endif
+
+  // textures_[triangles_[i].lightmap_]->BlurTexture(3, 1);
+  // textures_[triangles_[i].lightmap_]->BlurTexture(3, 1);
+
+  // A cancelled pass may have stopped early, so its lumels are not counted.
+  if (world->bake_progress_.IsCancelled()) {
+    return;
+  }
+
+  const Texture* lightmap =
+      world->textures_[world->triangles_[triangle_index].lightmap_].get();
+  world->bake_progress_.AddWork(
+      lightmap->texture_width_ * lightmap->texture_height_,
+      context->occluder_cache_lookups - first_ray,
+      world->surface_costs_[triangle_index].direct_seconds);
+}
+
+void World::PrepareDirectIllumination() {
+  direct_traced_lumels_ = 0;
+  direct_light_pairs_ = 0;
+  direct_occluder_cache_hits_ = 0;
+  direct_occluder_cache_lookups_ = 0;
+  direct_shadow_cube_lookups_ = 0;
+  direct_shadow_cube_fallbacks_ = 0;
+  direct_shadow_packets_ = 0;
+  direct_shadow_packet_rays_ = 0;
+  direct_shadow_packet_fallbacks_ = 0;
+  direct_pvs_culled_lights_ = 0;
+
+#if ENABLE_SHADOW_CUBE_MAPS
+  BuildShadowCubeMaps();
+#endif
+
+#if DIRECT_LIGHT_SELECTION == LIGHT_SELECTION_TREE
+  light_tree_.Build(lights_);
+  cout << "Built light tree with " << light_tree_.QueryNodeCount()
+       << " nodes." << endl;
+#endif
+}
+
+void World::ReportDirectIllumination(
+    const ::std::vector<DirectLightingContext>& contexts) {
+  for (const DirectLightingContext& context : contexts) {
+    if (context.occluder_cache.empty()) {
+      continue;  // The thread never picked up a triangle.
+    }
+
+    direct_occluder_cache_hits_ += context.occluder_cache_hits;
+    direct_occluder_cache_lookups_ += context.occluder_cache_lookups;
+    direct_shadow_cube_lookups_ += context.shadow_cube_lookups;
+    direct_shadow_cube_fallbacks_ += context.shadow_cube_fallbacks;
+    direct_shadow_packets_ += context.shadow_packets;
+    direct_shadow_packet_rays_ += context.shadow_packet_rays;
+    direct_shadow_packet_fallbacks_ += context.shadow_packet_fallbacks;
+    direct_pvs_culled_lights_ += context.pvs_culled_lights;
+  }
+
+  uint64 total_lumels = 0;
+  for (uint32 i = 0; i < triangles_.size(); i++) {
+    const Texture* lightmap = textures_[triangles_[i].lightmap_].get();
+    total_lumels += lightmap->texture_width_ * lightmap->texture_height_;
+  }
+
+  cout << "Direct pass traced " << direct_traced_lumels_ << " of "
+       << total_lumels << " lumels." << endl;
+  cout << "Direct pass considered " << direct_light_pairs_ << " of "
+       << triangles_.size() * lights_.size() << " triangle/light pairs."
+       << endl;
+
+  if (direct_pvs_culled_lights_) {
+    cout << "The PVS culled " << direct_pvs_culled_lights_
+         << " triangle/light pairs." << endl;
+  }
+
+  if (direct_occluder_cache_lookups_) {
+    cout << "Occluder cache hit rate: "
+         << (100.0 * direct_occluder_cache_hits_) /
+                direct_occluder_cache_lookups_
+         << "% (" << direct_occluder_cache_hits_ << " of "
+         << direct_occluder_cache_lookups_ << " shadow rays)." << endl;
+  }
+
+  if (direct_shadow_cube_lookups_) {
+    cout << "Shadow cube maps resolved "
+         << direct_shadow_cube_lookups_ - direct_shadow_cube_fallbacks_
+         << " of " << direct_shadow_cube_lookups_
+         << " visibility queries without a ray." << endl;
+  }
+
+  if (direct_shadow_packets_ || direct_shadow_packet_fallbacks_) {
+    cout << "Traced " << direct_shadow_packet_rays_ << " shadow rays in "
+         << direct_shadow_packets_ << " packets, and "
+         << direct_shadow_packet_fallbacks_
+         << " rays from divergent packets singly." << endl;
+  }
+}
+
+void World::TraceGatherRays(const ::std::vector<GatherRay>& rays,
+                            ::std::vector<GatherHit>* hits) const {
+  hits->resize(rays.size());
+  for (uint32 i = 0; i < rays.size(); i++) {
+    (*hits)[i].triangle = -1;
+    (*hits)[i].hit_info = ::base::collision();
+  }
+
+  if (rays.empty()) {
+    return;
+  }
+
+  ::base::bounds origin_bounds;
+  for (uint32 i = 0; i < rays.size(); i++) {
+    origin_bounds += rays[i].trace_ray.start;
+  }
+
+  vector3 extent = origin_bounds.bounds_max - origin_bounds.bounds_min;
+
+  // Bin each ray by its direction octant and the cell of the batch's origin
+  // bounds that holds its start. The ray index fills the low bits so that
+  // sorting keeps rays of the same bin in their original order.
+  ::std::vector<uint64> sort_keys(rays.size());
+  for (uint32 i = 0; i < rays.size(); i++) {
+    const ::base::ray& trace_ray = rays[i].trace_ray;
+    uint32 bin = (trace_ray.dir.x < 0) | ((trace_ray.dir.y < 0) << 1) |
+                 ((trace_ray.dir.z < 0) << 2);
+
+    for (int32 axis = 0; axis < 3; axis++) {
+      float32 offset = 0.0f;
+      if (extent[axis] > BASE_EPSILON) {
+        offset = (trace_ray.start[axis] - origin_bounds.bounds_min[axis]) /
+                 extent[axis];
+      }
+      uint32 cell = min((uint32)(offset * GATHER_ORIGIN_CELLS),
+                        (uint32)GATHER_ORIGIN_CELLS - 1);
+      bin = bin * GATHER_ORIGIN_CELLS + cell;
+    }
+
+    sort_keys[i] = ((uint64)bin << 32) | i;
+  }
+
+  ::std::sort(sort_keys.begin(), sort_keys.end());
+
+  ::std::vector<uint32> order(rays.size());
+  for (uint32 i = 0; i < rays.size(); i++) {
+    order[i] = (uint32)sort_keys[i];
+  }
+
+  // Trace each bin in groups of at most GATHER_GROUP_SIZE rays.
+  uint32 group_start = 0;
+  for (uint32 i = 1; i <= rays.size(); i++) {
+    if (i == rays.size() || i - group_start == GATHER_GROUP_SIZE ||
+        (sort_keys[i] >> 32) != (sort_keys[group_start] >> 32)) {
+      TraceGatherRayGroup(rays, &order[group_start], i - group_start, hits);
+      group_start = i;
+    }
+  }
+}
+
+void World::TraceGatherRayGroup(const ::std::vector<GatherRay>& rays,
+                                const uint32* group, uint32 group_size,
+                                ::std::vector<GatherHit>* hits) const {
+  // Intersects ray k of the group with triangle j, keeping the closest hit.
+  // Ties go to the lowest triangle index, matching a linear scan.
+  auto intersect_triangle = [&](uint32 j, uint32 k) {
+    const GatherRay& gather_ray = rays[group[k]];
+    if (gather_ray.source_triangle == j) {
+      return;
+    }
+
+    const TriangleGeometry* test_tri = &triangle_geometry_[j];
+    ::base::collision test_hit;
+    vector2 test_bary_coords;
+    if (::base::ray_intersect_triangle(
+            test_tri->vertices[0], test_tri->vertices[1],
+            test_tri->vertices[2], test_tri->plane,
+            gather_ray.trace_ray, &test_hit, &test_bary_coords)) {
+      GatherHit& hit = (*hits)[group[k]];
+      bool nearer = test_hit.param < hit.hit_info.param ||
+                    (test_hit.param == hit.hit_info.param &&
+                     (int32)j < hit.triangle);
+      if (nearer && test_hit.param > BASE_EPSILON &&
+          test_hit.param < 1.0f - BASE_EPSILON) {
+        hit.triangle = j;
+        hit.hit_info = test_hit;
+        hit.bary_coords = test_bary_coords;
+      }
+    }
+  };
+
+  if (!triangle_grid_.IsEmpty()) {
+    // Walk each ray through the grid, stopping once the closest hit lies
+    // within the cells already visited.
+    for (uint32 k = 0; k < group_size; k++) {
+      const GatherRay& gather_ray = rays[group[k]];
+      const GatherHit& hit = (*hits)[group[k]];
+      UniformGridWalk walk;
+      if (!triangle_grid_.BeginWalk(gather_ray.trace_ray.start,
+                                    gather_ray.trace_ray.dir,
+                                    min(1.0f, hit.hit_info.param), &walk)) {
+        continue;
+      }
+
+      const uint32* cell_triangles = NULL;
+      uint32 cell_triangle_count = 0;
+      float32 t_cell_exit = 0.0f;
+      while (triangle_grid_.StepWalk(&walk, &cell_triangles,
+                                     &cell_triangle_count, &t_cell_exit)) {
+        for (uint32 p = 0; p < cell_triangle_count; p++) {
+          uint32 j = cell_triangles[p];
+          if (!triangle_geometry_[j].requires_alpha) {
+            intersect_triangle(j, k);
+          }
+        }
+
+        if (hit.hit_info.param < t_cell_exit) {
+          break;
+        }
+      }
+    }
+
+    return;
+  }
+
+#if ENABLE_BVH
+  if (HasBvh()) {
+    // Walk the hierarchy once for the whole group, carrying a mask of the
+    // rays that still overlap each leaf. Children are ordered front to back
+    // along the group's lead ray, so that hits found in nearer children can
+    // cull the farther ones.
+    vector3 inverse_dirs[GATHER_GROUP_SIZE];
+    for (uint32 k = 0; k < group_size; k++) {
+      inverse_dirs[k] = InverseDirection(rays[group[k]].trace_ray.dir);
+    }
+
+    const vector3& lead_dir = rays[group[0]].trace_ray.dir;
+    uint64 active_mask = 0;
+    WalkBvh(
+        &lead_dir,
+        [&](const float32* bounds_min, const float32* bounds_max) {
+          active_mask = 0;
+          for (uint32 k = 0; k < group_size; k++) {
+            const GatherRay& gather_ray = rays[group[k]];
+            float32 t_max = min(1.0f, (*hits)[group[k]].hit_info.param);
+            if (SegmentOverlapsBounds(gather_ray.trace_ray.start,
+                                      inverse_dirs[k], t_max, bounds_min,
+                                      bounds_max)) {
+              active_mask |= 1ull << k;
+            }
+          }
+          return 0 != active_mask;
+        },
+        [&](uint32 j) {
+          if (triangle_geometry_[j].requires_alpha) {
+            // Ignore transparent or partially transparent triangles.
+            return true;
+          }
+
+          // Leaves are visited right after their bounds are tested, so the
+          // mask still belongs to this triangle's leaf.
+          for (uint32 k = 0; k < group_size; k++) {
+            if (active_mask & (1ull << k)) {
+              intersect_triangle(j, k);
+            }
+          }
+          return true;
+        });
+
+    return;
+  }
+#endif
+
+  for (uint32 j = 0; j < triangles_.size(); j++) {
+    if (triangle_geometry_[j].requires_alpha) {
+      // Ignore transparent or partially transparent triangles.
+      continue;
+    }
+
+    for (uint32 k = 0; k < group_size; k++) {
+      intersect_triangle(j, k);
+    }
+  }
+}
+
+void World::ResolveGatherBatch(uint32 triangle_index,
+                               const ::std::vector<vector2>& lumels,
+                               const ::std::vector<GatherRay>& rays,
+                               ::std::vector<GatherHit>* hits) {
+  Triangle* tri = &triangles_[triangle_index];
+  TraceGatherRays(rays, hits);
+
+  for (uint32 b = 0; b < lumels.size(); b++) {
+    const vector2& lumel = lumels[b];
+    vector3 illumination;  // = textures_[tri->lightmap_]->ReadTexel(lumel);
+    float32 sample_count = 0.0f;
+
+    // Average whatever light data each of the lumel's samples hit.
+    for (uint32 sample = 0; sample < SAMPLE_COUNT; sample++) {
+      const GatherRay& gather_ray = rays[b * SAMPLE_COUNT + sample];
+      const GatherHit& hit = (*hits)[b * SAMPLE_COUNT + sample];
+      if (hit.triangle < 0) {
+        continue;
+      }
+
+      // We hit something -- sample it's lighting and add it to our total.
+      Triangle* best_hit_tri = &triangles_[hit.triangle];
+      const vector2& best_bary_coords = hit.bary_coords;
+      vector3 incident = (hit.hit_info.point - gather_ray.trace_ray.start);
+      const vector3& t0 = best_hit_tri->vertices_[0].tc;
+      const vector3& t1 = best_hit_tri->vertices_[1].tc;
+      const vector3& t2 = best_hit_tri->vertices_[2].tc;
+
+      const vector3& l0 = best_hit_tri->vertices_[0].lc;
+      const vector3& l1 = best_hit_tri->vertices_[1].lc;
+      const vector3& l2 = best_hit_tri->vertices_[2].lc;
+
+      const vector3& c0 = best_hit_tri->vertices_[0].color;
+      const vector3& c1 = best_hit_tri->vertices_[1].color;
+      const vector3& c2 = best_hit_tri->vertices_[2].color;
+
+      vector3 output_texcoords, output_lightcoords, output_color;
+
+      triangle_interpolate_barycentric_coeff(
+          t0, t1, t2, best_bary_coords.x, best_bary_coords.y,
+          &output_texcoords);
+
+      triangle_interpolate_barycentric_coeff(
+          l0, l1, l2, best_bary_coords.x, best_bary_coords.y,
+          &output_lightcoords);
+
+      triangle_interpolate_barycentric_coeff(
+          c0, c1, c2, best_bary_coords.x, best_bary_coords.y, &output_color);
+
+      vector2 target_lc = vector2(output_lightcoords.x, output_lightcoords.y);
+      vector2 target_tc = vector2(fmod(output_texcoords.x, 1.0),
+                                  fmod(output_texcoords.y, 1.0));
+
+      vector3 color =
+          textures_[best_hit_tri->lightmap_]->ReadTexel(target_lc) *
+          textures_[best_hit_tri->diffuse_]->ReadTexel(target_tc) *
+          output_color;
+
+      illumination += color * fabs(incident.normalize().dot(tri->normal_));
+      sample_count += 1.0f;
+    }
+
+    if (sample_count) {
+      illumination = illumination / sample_count;
+      illumination.x = pow(::base::saturate(illumination.x), 1.0 / 2.6);
+      illumination.y = pow(::base::saturate(illumination.y), 1.0 / 2.6);
+      illumination.z = pow(::base::saturate(illumination.z), 1.0 / 2.6);
+    }
+
+    illumination += textures_[tri->lightmap_]->ReadTexel(lumel);
+    illumination = illumination.clamp(0.0, 1.0);
+    textures_[tri->gi_lightmap_]->WriteTexel(lumel, illumination);
+  }
+
+  const SurfaceCost& cost = surface_costs_[triangle_index];
+  bake_progress_.AddWork(
+      lumels.size(), rays.size(),
+      cost.indirect_seconds * lumels.size() / cost.lumel_count);
+}
+
+void World::QueueGatherRays(uint32 triangle_index, uint32 lumel_index,
+                            const vector3& origin,
+                            ::std::vector<GatherRay>* rays) {
+  const Triangle* tri = &triangles_[triangle_index];
+
+  // The directions come from the lumel's own stream, so the bake is the same
+  // for any number of threads.
+  ::base::random_stream stream(
+      ::base::random_key(RANDOM_STREAM_GATHER, triangle_index, lumel_index));
+  uint64 random_values[RANDOM_BATCH_SIZE];
+  for (uint32 sample = 0; sample < SAMPLE_COUNT; sample++) {
+    uint32 batch_index = sample % RANDOM_BATCH_SIZE;
+    if (!batch_index) {
+      stream.random_integers(random_values, RANDOM_BATCH_SIZE);
+    }
+
+    vector3 ray_target =
+        origin + normal_generator.random_reflection(
+                     tri->normal_ * -1.0, tri->normal_, BASE_PI,
+                     random_values[batch_index]) *
+                     GATHER_RAY_LENGTH;
+    rays->push_back({::base::ray(origin, ray_target), triangle_index});
+  }
+}
+
+void ComputeIndirectIlluminationHelper(World* world, uint32 triangle_index) {
+  ::std::vector<Triangle>& triangles_ = world->triangles_;
+  ::std::vector<::std::shared_ptr<Texture>>& textures_ = world->textures_;
+
+  ::std::vector<vector2> gather_lumels;
+  ::std::vector<GatherRay> gather_rays;
+  ::std::vector<GatherHit> gather_hits;
+  Triangle* tri = &triangles_[triangle_index];
+  Texture* gi_lightmap = textures_[tri->gi_lightmap_].get();
+  float32 width = gi_lightmap->texture_width_;
+  float32 height = gi_lightmap->texture_height_;
+  uint32 lumel_count =
+      gi_lightmap->texture_width_ * gi_lightmap->texture_height_;
+
+  // Visit the lumels in memory order, so that each gather batch covers a
+  // compact block of the lightmap.
+  for (uint32 lumel_index = 0; lumel_index < lumel_count; lumel_index++) {
+    // Stop at the next tile boundary once the bake is cancelled.
+    if (!(lumel_index % (LIGHTMAP_TILE_SIZE * LIGHTMAP_TILE_SIZE)) &&
+        world->bake_progress_.IsCancelled()) {
+      return;
+    }
+
+    uint32 lx = 0, ly = 0;
+    gi_lightmap->QueryTexelCoords(lumel_index, &lx, &ly);
+    vector2 lumel(::base::clip_range(lx / width, 0.0, 1.0),
+                  ::base::clip_range(ly / height, 0.0, 1.0));
+    vector3 trace_origin =
+        world->QueryLumelPosition(triangle_index, lumel_index);
+
+    // Queue the lumel's rays and trace them together with the rays of
+    // neighbouring lumels.
+    world->QueueGatherRays(triangle_index, lumel_index, trace_origin,
+                           &gather_rays);
+
+    gather_lumels.push_back(lumel);
+    if (gather_lumels.size() == GATHER_BATCH_LUMELS) {
+      world->ResolveGatherBatch(triangle_index, gather_lumels, gather_rays,
+                                &gather_hits);
+      gather_lumels.clear();
+      gather_rays.clear();
+    }
+  }
+
+  if (!gather_lumels.empty()) {
+    world->ResolveGatherBatch(triangle_index, gather_lumels, gather_rays,
+                              &gather_hits);
+    gather_lumels.clear();
+    gather_rays.clear();
+  }
+
+  // Nothing reads this triangle's indirect lightmap during the pass, so it
+  // can return to the linear layout for the blur right away.
+  gi_lightmap->SetTiledLayout(false);
+  gi_lightmap->BlurTexture(3, 1);
+  gi_lightmap->BlurTexture(3, 1);
+}
+
+bool World::FindGatherLeaves(uint32 triangle_index,
+                             ::std::vector<uint64>* visible_leaves) const {
+  visible_leaves->clear();
+  if (options_.direct_barrier || !world_bsp_.HasVisibility()) {
+    return false;
+  }
+
+  const Texture* lightmap =
+      textures_[triangles_[triangle_index].gi_lightmap_].get();
+  uint32 max_x = lightmap->texture_width_ - 1;
+  uint32 max_y = lightmap->texture_height_ - 1;
+  vector3 corners[4] = {ComputeLumelPosition(triangle_index, 0, 0),
+                        ComputeLumelPosition(triangle_index, max_x, 0),
+                        ComputeLumelPosition(triangle_index, max_x, max_y),
+                        ComputeLumelPosition(triangle_index, 0, max_y)};
+
+  for (const vector3& corner : corners) {
+    if (!world_bsp_.IsPointCovered(corner)) {
+      return false;
+    }
+  }
+
+  // Gather rays ignore hits within BASE_EPSILON of their origin, as a fraction
+  // of their length, so grow the lumels' region by that much.
+  ::std::vector<uint32> lumel_leaves;
+  world_bsp_.FindLeaves(corners, 4, BASE_EPSILON * GATHER_RAY_LENGTH,
+                        &lumel_leaves);
+  for (uint32 leaf : lumel_leaves) {
+    world_bsp_.AccumulateVisibleLeaves(leaf, visible_leaves);
+  }
+
+  return true;
+}
+
+void World::PrepareAccelerationStructure(const ::std::string& cache_filename) {
+  AccelerationStructureType type = options_.acceleration_structure;
+
+  if (kAccelerationAuto == type) {
+    // Grids suit large scenes whose triangles spread evenly through their
+    // bounds, which shows up as a high fraction of occupied cells. Grids build
+    // quickly enough that we simply build one and look. Instanced worlds keep
+    // the BVH, whose size follows their unique geometry rather than the
+    // flattened triangle count.
+    type = kAccelerationBvh;
+    if (instances_.empty() &&
+        triangles_.size() >= UNIFORM_GRID_MIN_TRIANGLES) {
+      BuildUniformGrid();
+      if (triangle_grid_.QueryOccupancy() >= UNIFORM_GRID_MIN_OCCUPANCY) {
+        type = kAccelerationGrid;
+      } else {
+        triangle_grid_.Clear();
+      }
+    }
+  }
+
+  if (kAccelerationGrid == type) {
+    if (triangle_grid_.IsEmpty()) {
+      BuildUniformGrid();
+    }
+    cout << "Using the uniform grid for ray queries." << endl;
+    return;
+  }
+
+#if ENABLE_BVH
+  // Only the static triangles are cached. The prefab and instance hierarchies
+  // are rebuilt, which is quick since they only cover the unique geometry.
+  BuildInstanceHierarchy();
+
+#if ENABLE_BVH_CACHE
+  uint64 geometry_hash = ComputeGeometryHash();
+  if (triangle_bvh_.MapFromFile(cache_filename, geometry_hash,
+                                static_triangle_count_)) {
+    cout << "Mapped BVH with " << triangle_bvh_.QueryNodeCount()
+         << " nodes from " << cache_filename << "." << endl;
+    return;
+  }
+#endif
+
+  BuildAccelerationStructure();
+
+#if ENABLE_BVH_CACHE
+  // A dry run leaves the cache as it was.
+  if (static_triangle_count_ && !options_.estimate_only &&
+      !triangle_bvh_.SaveToFile(cache_filename, geometry_hash)) {
+    cout << "Failed to write BVH cache " << cache_filename << "." << endl;
+  }
+#endif
+#endif
+}
+
+void World::BuildAccelerationStructure() {
+  auto start_time = ::std::chrono::steady_clock::now();
+
+  ::std::vector<::base::bounds> triangle_bounds(static_triangle_count_);
+  for (uint32 i = 0; i < static_triangle_count_; i++) {
+    triangle_bounds[i] += triangle_geometry_[i].vertices[0];
+    triangle_bounds[i] += triangle_geometry_[i].vertices[1];
+    triangle_bounds[i] += triangle_geometry_[i].vertices[2];
+  }
+
+  triangle_bvh_.Build(triangle_bounds, &thread_pool_);
+
+  ::std::chrono::duration<float32, ::std::milli> elapsed =
+      ::std::chrono::steady_clock::now() - start_time;
+  cout << "Built BVH with " << triangle_bvh_.QueryNodeCount() << " nodes ("
+       << triangle_bvh_.QueryMemoryUsage() / 1024 << " KB) over "
+       << static_triangle_count_ << " triangles in " << elapsed.count()
+       << " ms." << endl;
+}
+
+void World::BuildInstanceHierarchy() {
+  if (instances_.empty()) {
+    return;
+  }
+
+  auto start_time = ::std::chrono::steady_clock::now();
+  uint64 memory_usage = 0;
+  uint32 prefab_triangle_count = 0;
+
+  for (Prefab& prefab : prefabs_) {
+    ::std::vector<::base::bounds> triangle_bounds(prefab.geometry.size());
+    for (uint32 i = 0; i < prefab.geometry.size(); i++) {
+      for (uint32 j = 0; j < 3; j++) {
+        triangle_bounds[i] += prefab.geometry[i].vertices[j];
+      }
+    }
+
+    prefab.hierarchy = ::std::make_shared<Bvh>();
+    prefab.hierarchy->Build(triangle_bounds, &thread_pool_);
+    memory_usage += prefab.hierarchy->QueryMemoryUsage();
+    prefab_triangle_count += prefab.triangles.size();
+  }
+
+  // The instance hierarchy bounds each instance by its prefab's bounds mapped
+  // into world space.
+  ::std::vector<::base::bounds> instance_bounds(instances_.size());
+  for (uint32 i = 0; i < instances_.size(); i++) {
+    const Prefab& prefab = prefabs_[instances_[i].prefab];
+    const ::base::matrix4& transform = instances_[i].transform;
+    if (prefab.triangles.empty()) {
+      instance_bounds[i] +=
+          vector3(transform[12], transform[13], transform[14]);
+      continue;
+    }
+
+    float32 bounds_min[3], bounds_max[3];
+    for (uint32 axis = 0; axis < 3; axis++) {
+      bounds_min[axis] = prefab.local_bounds.bounds_min[axis];
+      bounds_max[axis] = prefab.local_bounds.bounds_max[axis];
+    }
+    TransformBoxBounds(transform, bounds_min, bounds_max);
+    instance_bounds[i] += vector3(bounds_min[0], bounds_min[1], bounds_min[2]);
+    instance_bounds[i] += vector3(bounds_max[0], bounds_max[1], bounds_max[2]);
+  }
+
+  instance_bvh_.Build(instance_bounds, &thread_pool_);
+  memory_usage += instance_bvh_.QueryMemoryUsage();
+
+  ::std::chrono::duration<float32, ::std::milli> elapsed =
+      ::std::chrono::steady_clock::now() - start_time;
+  cout << "Built " << prefabs_.size() << " prefab BVHs over "
+       << prefab_triangle_count << " triangles and an instance BVH over "
+       << instances_.size() << " instances (" << memory_usage / 1024
+       << " KB) in " << elapsed.count() << " ms." << endl;
+}
+
+void World::BuildUniformGrid() {
+  auto start_time = ::std::chrono::steady_clock::now();
+
+  ::std::vector<vector3> positions(triangles_.size() * 3);
+  for (uint32 i = 0; i < triangles_.size(); i++) {
+    for (uint32 j = 0; j < 3; j++) {
+      positions[i * 3 + j] = triangle_geometry_[i].vertices[j];
+    }
+  }
+
+  triangle_grid_.Build(positions, UNIFORM_GRID_DENSITY);
+
+  ::std::chrono::duration<float32, ::std::milli> elapsed =
+      ::std::chrono::steady_clock::now() - start_time;
+  const uint32* resolution = triangle_grid_.QueryResolution();
+  cout << "Built uniform grid with " << resolution[0] << "x" << resolution[1]
+       << "x" << resolution[2] << " cells ("
+       << triangle_grid_.QueryMemoryUsage() / 1024 << " KB, "
+       << triangle_grid_.QueryOccupancy() * 100.0f << "% occupied) in "
+       << elapsed.count() << " ms." << endl;
+}
+
+void World::CompileBsp() {
+  if (triangles_.size() > BSP_MAX_TRIANGLES) {
+    cout << "Skipping the BSP for " << triangles_.size() << " triangles."
+         << endl;
+    return;
+  }
+
+  auto start_time = ::std::chrono::steady_clock::now();
+
+  ::std::vector<vector3> positions(triangles_.size() * 3);
+  ::std::vector<uint8> blockers(triangles_.size());
+  for (uint32 i = 0; i < triangles_.size(); i++) {
+    for (uint32 j = 0; j < 3; j++) {
+      positions[i * 3 + j] = triangle_geometry_[i].vertices[j];
+    }
+    blockers[i] = !triangle_geometry_[i].requires_alpha;
+  }
+
+  world_bsp_.Build(positions, blockers, &thread_pool_);
+
+  // Shadow rays also ignore hits within BASE_EPSILON of the light, so each
+  // light is grown by that much of its reach.
+  light_leaves_.assign(lights_.size(), ::std::vector<uint32>());
+  for (uint32 i = 0; i < lights_.size(); i++) {
+    if (world_bsp_.IsPointCovered(lights_[i].position_)) {
+      world_bsp_.FindLeaves(&lights_[i].position_, 1,
+                            BASE_EPSILON * lights_[i].influence_radius_,
+                            &light_leaves_[i]);
+    }
+  }
+
+  ::std::chrono::duration<float32, ::std::milli> elapsed =
+      ::std::chrono::steady_clock::now() - start_time;
+  cout << "Compiled BSP with " << world_bsp_.QueryNodeCount() << " nodes, "
+       << world_bsp_.QueryLeafCount() << " leaves and "
+       << world_bsp_.QueryPortalCount() << " portals ("
+       << world_bsp_.QueryMemoryUsage() / 1024 << " KB) in " << elapsed.count()
+       << " ms." << endl;
+
+  if (world_bsp_.HasVisibility()) {
+    cout << "Each leaf sees " << world_bsp_.QueryAverageVisibility() * 100.0f
+         << "% of the leaves on average." << endl;
+  }
+}
+
+// Folds size bytes at data into a 64 bit FNV-1a hash.
+inline void HashBytes(const void* data, uint64 size, uint64* hash) {
+  const uint8* bytes = (const uint8*)data;
+  for (uint64 i = 0; i < size; i++) {
+    *hash = (*hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+}
+
+uint64 World::ComputeGeometryHash() const {
+  // Covers the triangle count and the bits of each position.
+  uint64 hash = 0xcbf29ce484222325ull;
+  uint32 triangle_count = static_triangle_count_;
+  HashBytes(&triangle_count, sizeof(triangle_count), &hash);
+  for (uint32 i = 0; i < triangle_count; i++) {
+    for (uint32 j = 0; j < 3; j++) {
+      HashBytes(triangle_geometry_[i].vertices[j].v, 3 * sizeof(float32),
+                &hash);
+    }
+  }
+
+  return hash;
+}
+
+uint64 World::ComputeBakeHash() const {
+  // The settings that change what the passes compute.
+  uint64 hash = 0xcbf29ce484222325ull;
+  uint32 settings[] = {SAMPLE_COUNT,
+                       RANDOM_NORMAL_COUNT,
+                       ENABLE_ADAPTIVE_DIRECT,
+                       ADAPTIVE_BLOCK_SIZE,
+                       DIRECT_LIGHT_SELECTION,
+                       LIGHT_TREE_MAX_CUT,
+                       DIRECT_LIGHT_SAMPLE_COUNT,
+                       ENABLE_SHADOW_CUBE_MAPS,
+                       SHADOW_CUBE_RESOLUTION,
+                       SHADOW_CUBE_MAX_LIGHTS};
+  float32 thresholds[] = {ADAPTIVE_IRRADIANCE_THRESHOLD,
+                          LIGHT_INFLUENCE_THRESHOLD, LIGHT_TREE_ERROR_RATIO,
+                          GATHER_RAY_LENGTH};
+  HashBytes(settings, sizeof(settings), &hash);
+  HashBytes(thresholds, sizeof(thresholds), &hash);
+
+  // Every triangle, instances included, with its shading and lightmap size.
+  uint32 triangle_count = triangles_.size();
+  HashBytes(&triangle_count, sizeof(triangle_count), &hash);
+  for (uint32 i = 0; i < triangle_count; i++) {
+    const TriangleGeometry* geometry = &triangle_geometry_[i];
+    const Triangle* tri = &triangles_[i];
+    for (uint32 j = 0; j < 3; j++) {
+      HashBytes(geometry->vertices[j].v, 3 * sizeof(float32), &hash);
+      HashBytes(tri->vertices_[j].color.v, 4 * sizeof(float32), &hash);
+      HashBytes(tri->vertices_[j].tc.v, 2 * sizeof(float32), &hash);
+      HashBytes(tri->vertices_[j].lc.v, 2 * sizeof(float32), &hash);
+    }
+
+    uint32 shading[] = {geometry->requires_alpha, tri->diffuse_,
+                        textures_[tri->lightmap_]->texture_width_};
+    HashBytes(shading, sizeof(shading), &hash);
+  }
+
+  for (const Light& light : lights_) {
+    HashBytes(light.position_.v, 3 * sizeof(float32), &hash);
+    HashBytes(light.color_.v, 4 * sizeof(float32), &hash);
+    HashBytes(&light.intensity_, sizeof(light.intensity_), &hash);
+    HashBytes(&light.enabled_, sizeof(light.enabled_), &hash);
+  }
+
+  // The pixels of the textures that the world loaded. Lightmaps keep theirs
+  // in the arena and are left out.
+  for (const ::std::shared_ptr<Texture>& texture : textures_) {
+    if (texture && !texture->texture_map_.empty()) {
+      uint32 size[] = {texture->texture_width_, texture->texture_height_};
+      HashBytes(size, sizeof(size), &hash);
+      HashBytes(texture->texture_map_.data(), texture->texture_map_.size(),
+                &hash);
+    }
+  }
+
+  return hash;
+}
+
+void World::EstimateSurfaceCosts(uint32 sample_count,
+                                 ::std::vector<SurfaceCost>* costs) {
+  costs->assign(triangles_.size(), SurfaceCost());
+  ::std::vector<DirectLightingContext> contexts(
+      thread_pool_.QueryThreadCount());
+  thread_pool_.ParallelFor(triangles_.size(), [&](uint32 i,
+                                                  uint32 thread_index) {
+    DirectLightingContext* context = &contexts[thread_index];
+    SurfaceCost* cost = &(*costs)[i];
+    const Texture* lightmap = textures_[triangles_[i].lightmap_].get();
+    uint32 lumel_count = lightmap->texture_width_ * lightmap->texture_height_;
+    uint32 lumel_samples = min(sample_count, lumel_count);
+
+    // The sampled lumels come from a stream of their own, so that every run
+    // measures the same lumels.
+    ::base::random_stream stream(
+        ::base::random_key(RANDOM_STREAM_ESTIMATE, i, 0));
+    ::std::vector<uint32> lumel_indices(lumel_samples);
+    ::std::vector<vector3> origins(lumel_samples);
+    for (uint32 j = 0; j < lumel_samples; j++) {
+      uint32 lx = 0, ly = 0;
+      lumel_indices[j] = stream.random_integer_range(0, lumel_count - 1);
+      lightmap->QueryTexelCoords(lumel_indices[j], &lx, &ly);
+      origins[j] = ComputeLumelPosition(i, lx, ly);
+    }
+
+    // Each sampled lumel is lit singly, which bounds the cost of the packet
+    // and adaptive direct passes from above. The context's setup is paid
+    // once per surface rather than per lumel.
+    auto start_time = ::std::chrono::steady_clock::now();
+    PrepareDirectLightingContext(i, context);
+    auto prepared_time = ::std::chrono::steady_clock::now();
+    uint64 first_lookup = context->occluder_cache_lookups;
+    for (uint32 j = 0; j < lumel_samples; j++) {
+      context->lumel_index = lumel_indices[j];
+      ComputeLumelDirectIllumination(context, origins[j], NULL);
+    }
+    auto direct_time = ::std::chrono::steady_clock::now();
+
+    // Gather rays are traced but not resolved, which leaves out the texture
+    // reads and the blur.
+    ::std::vector<GatherRay> rays;
+    ::std::vector<GatherHit> hits;
+    for (uint32 j = 0; j < lumel_samples; j++) {
+      QueueGatherRays(i, lumel_indices[j], origins[j], &rays);
+    }
+    TraceGatherRays(rays, &hits);
+    auto gather_time = ::std::chrono::steady_clock::now();
+
+    float64 scale = (float64)lumel_count / lumel_samples;
+    ::std::chrono::duration<float64> prepare = prepared_time - start_time;
+    ::std::chrono::duration<float64> direct = direct_time - prepared_time;
+    ::std::chrono::duration<float64> gather = gather_time - direct_time;
+    cost->lumel_count = lumel_count;
+    cost->direct_seconds = prepare.count() + direct.count() * scale;
+    cost->indirect_seconds = gather.count() * scale;
+    cost->direct_rays =
+        (context->occluder_cache_lookups - first_lookup) * scale;
+    cost->gather_rays = (uint64)lumel_count * SAMPLE_COUNT;
+  });
+}
+
+void World::EstimateLightmaps() {
+  if (triangles_.empty()) {
+    return;
+  }
+
+  PrepareDirectIllumination();
+
+  auto start_time = ::std::chrono::steady_clock::now();
+  ::std::vector<SurfaceCost> costs;
+  EstimateSurfaceCosts(ESTIMATE_SAMPLE_LUMELS, &costs);
+  ::std::chrono::duration<float32, ::std::milli> elapsed =
+      ::std::chrono::steady_clock::now() - start_time;
+
+  SurfaceCost total = SurfaceCost();
+  float64 largest_seconds = 0.0;
+  for (const SurfaceCost& cost : costs) {
+    total.lumel_count += cost.lumel_count;
+    total.direct_seconds += cost.direct_seconds;
+    total.indirect_seconds += cost.indirect_seconds;
+    total.direct_rays += cost.direct_rays;
+    total.gather_rays += cost.gather_rays;
+    largest_seconds =
+        max(largest_seconds, cost.direct_seconds + cost.indirect_seconds);
+  }
+
+  // The passes of one surface run on one thread, so the bake takes at least
+  // as long as its most expensive surface.
+  uint32 thread_count = thread_pool_.QueryThreadCount();
+  float64 bake_seconds =
+      max((total.direct_seconds + total.indirect_seconds) / thread_count,
+          largest_seconds);
+
+  cout << "Estimated " << triangles_.size() << " surfaces of "
+       << total.lumel_count << " lumels from up to " << ESTIMATE_SAMPLE_LUMELS
+       << " lumels each in " << elapsed.count() << " ms." << endl;
+  cout << "Direct pass: " << total.direct_rays << " shadow rays in "
+       << total.direct_seconds << " s of thread time." << endl;
+  cout << "Indirect pass: " << total.gather_rays << " gather rays in "
+       << total.indirect_seconds << " s of thread time." << endl;
+  cout << "Estimated bake time: " << bake_seconds << " s on " << thread_count
+       << " threads." << endl;
+
+  // Every surface has a lightmap and a global illumination lightmap of three
+  // bytes per lumel, held for the life of the world. The lumel samples and
+  // each thread's gather batch only exist during the bake.
+  uint64 lightmap_bytes = 2ull * 3 * total.lumel_count;
+  uint64 gather_bytes = (uint64)thread_count * GATHER_BATCH_LUMELS *
+                        SAMPLE_COUNT * (sizeof(GatherRay) + sizeof(GatherHit));
+  cout << "Estimated bake memory: " << lightmap_bytes / 1024
+       << " KB of lightmaps, " << total.lumel_count * 3 * sizeof(float32) / 1024
+       << " KB of lumel samples and " << gather_bytes / 1024
+       << " KB of gather batches." << endl;
+
+  // Bucket the surfaces by powers of two of their cost in milliseconds.
+  ::std::vector<uint32> histogram;
+  for (const SurfaceCost& cost : costs) {
+    float64 milliseconds =
+        (cost.direct_seconds + cost.indirect_seconds) * 1000.0;
+    uint32 bucket = milliseconds < 1.0 ? 0 : 1 + (uint32)log2(milliseconds);
+    if (bucket >= histogram.size()) {
+      histogram.resize(bucket + 1, 0);
+    }
+    histogram[bucket]++;
+  }
+
+  uint32 first_bucket = histogram.size();
+  uint32 largest_bucket = 0;
+  for (uint32 bucket = 0; bucket < histogram.size(); bucket++) {
+    if (histogram[bucket]) {
+      first_bucket = min(first_bucket, bucket);
+    }
+    largest_bucket = max(largest_bucket, histogram[bucket]);
+  }
+
+  cout << "Surface cost histogram:" << endl;
+  for (uint32 bucket = first_bucket; bucket < histogram.size(); bucket++) {
+    if (bucket) {
+      cout << "  " << (1u << (bucket - 1)) << " to " << (1u << bucket)
+           << " ms: ";
+    } else {
+      cout << "  under 1 ms: ";
+    }
+    cout << ::std::string(histogram[bucket] * 40 / largest_bucket, '#') << " "
+         << histogram[bucket] << endl;
+  }
+}
+
+// Returns the name of the file that keeps the lightmaps of shard index out of
+// count.
+inline ::std::string MakeShardFilename(const ::std::string& lightmap_filename,
+                                       uint32 index, uint32 count) {
+  return lightmap_filename + ".shard" + ::std::to_string(index) + "of" +
+         ::std::to_string(count);
+}
+
+::std::vector<uint64> World::ComputeLightmapOffsets() const {
+  // Each surface's lightmaps lie one after the other in the arena.
+  ::std::vector<uint64> lightmap_offsets(2 * triangles_.size() + 1, 0);
+  for (uint32 i = 0; i < triangles_.size(); i++) {
+    const Texture* lightmap = textures_[triangles_[i].lightmap_].get();
+    uint64 lightmap_size =
+        (uint64)lightmap->texture_width_ * lightmap->texture_height_ * 3;
+    lightmap_offsets[2 * i + 1] = lightmap_offsets[2 * i] + lightmap_size;
+    lightmap_offsets[2 * i + 2] = lightmap_offsets[2 * i + 1] + lightmap_size;
+  }
+
+  return lightmap_offsets;
+}
+
+void World::SelectShardSurfaces(::std::vector<uint8>* owned) const {
+  uint32 triangle_count = triangles_.size();
+  owned->assign(triangle_count, 0);
+  if (!options_.shard_by_cost) {
+    for (uint32 i = options_.shard_index; i < triangle_count;
+         i += options_.shard_count) {
+      (*owned)[i] = 1;
+    }
+    return;
+  }
+
+  // Timings differ from one process to the next, so the partition weighs
+  // each surface by its estimated rays instead. The most expensive surfaces
+  // are placed first, each on the shard with the fewest rays so far.
+  ::std::vector<uint64> surface_rays(triangle_count);
+  ::std::vector<uint32> surface_order(triangle_count);
+  for (uint32 i = 0; i < triangle_count; i++) {
+    surface_rays[i] =
+        surface_costs_[i].direct_rays + surface_costs_[i].gather_rays;
+    surface_order[i] = i;
+  }
+
+  ::std::stable_sort(surface_order.begin(), surface_order.end(),
+                     [&surface_rays](uint32 a, uint32 b) {
+                       return surface_rays[a] > surface_rays[b];
+                     });
+
+  ::std::vector<uint64> shard_rays(options_.shard_count, 0);
+  for (uint32 i : surface_order) {
+    uint32 shard = ::std::min_element(shard_rays.begin(), shard_rays.end()) -
+                   shard_rays.begin();
+    shard_rays[shard] += surface_rays[i];
+    (*owned)[i] = (shard == options_.shard_index);
+  }
+}
+
+void World::GenerateLightmaps(const ::std::string& lightmap_filename) {
+  uint32 triangle_count = triangles_.size();
+  if (!triangle_count) {
+    return;
+  }
+
+  // Lightmap k spans lightmap_offsets[k] up to lightmap_offsets[k + 1].
+  ::std::vector<uint64> lightmap_offsets = ComputeLightmapOffsets();
+
+  // A resumed bake loads the lightmaps that a checkpoint of the same scene
+  // holds, and skips the passes that made them. Either way a new checkpoint
+  // records every lightmap as its pass finishes, starting with the loaded
+  // ones. A shard's checkpoint is its shard file, which outlives the bake.
+  bool sharded = options_.shard_count != 0;
+  ::std::string checkpoint_filename =
+      sharded ? MakeShardFilename(lightmap_filename, options_.shard_index,
+                                  options_.shard_count)
+              : lightmap_filename + ".ckpt";
+  uint64 scene_hash = ComputeBakeHash();
+  ::std::vector<uint8> loaded(2 * triangle_count, 0);
+  if (options_.resume &&
+      BakeCheckpoint::Load(checkpoint_filename, scene_hash, lightmap_offsets,
+                           lightmap_arena_.QueryData(), &loaded)) {
+    cout << "Resumed "
+         << ::std::count(loaded.begin(), loaded.end(), (uint8)1) << " of "
+         << 2 * triangle_count << " lightmaps from " << checkpoint_filename
+         << "." << endl;
+  }
+
+  // An indirect lightmap is only of use along with its direct lightmap.
+  for (uint32 i = 0; i < triangle_count; i++) {
+    loaded[2 * i + 1] &= loaded[2 * i];
+  }
+
+  if (!bake_checkpoint_.Begin(checkpoint_filename, scene_hash,
+                              lightmap_offsets, lightmap_arena_.QueryData(),
+                              loaded)) {
+    cout << "Failed to create checkpoint file " << checkpoint_filename << "."
+         << endl;
+  }
+
+  // Bake into the tiled layout, so that neighbouring lumels share cache lines.
+  // Each lightmap returns to the linear layout that the GPU and the lightmap
+  // file expect once nothing reads it any more. Fully loaded surfaces are
+  // final, and stay linear.
+  thread_pool_.ParallelFor(triangle_count, [&](uint32 i, uint32) {
+    if (!loaded[2 * i + 1]) {
+      textures_[triangles_[i].lightmap_]->SetTiledLayout(true);
+      textures_[triangles_[i].gi_lightmap_]->SetTiledLayout(true);
+    }
+  });
+
+  // Both passes start their rays from the same lumel positions, so map every
+  // lumel to world space once, in the order the passes visit them.
+  PrepareLumelSamples();
+  PrepareDirectIllumination();
+
+  // Start the most expensive surfaces first, so that the bake does not end on
+  // a single large surface while the other threads sit idle. The estimate
+  // also lets the progress lines predict the time left.
+  ::std::vector<uint32> surface_order(triangle_count);
+  for (uint32 i = 0; i < triangle_count; i++) {
+    surface_order[i] = i;
+  }
+
+  EstimateSurfaceCosts(COST_ORDERING_SAMPLE_LUMELS, &surface_costs_);
+
+#if ENABLE_COST_ORDERING
+  ::std::stable_sort(surface_order.begin(), surface_order.end(),
+                     [this](uint32 a, uint32 b) {
+                       return surface_costs_[a].direct_seconds +
+                                  surface_costs_[a].indirect_seconds >
+                              surface_costs_[b].direct_seconds +
+                                  surface_costs_[b].indirect_seconds;
+                     });
+#endif
+
+  ::std::vector<uint32> surface_ranks(triangle_count);
+  for (uint32 i = 0; i < triangle_count; i++) {
+    surface_ranks[surface_order[i]] = i;
+  }
+
+  // A shard runs the passes of its own surfaces, and the direct passes of the
+  // surfaces that their gathers can reach.
+  ::std::vector<uint8> owned(triangle_count, 1);
+  ::std::vector<uint8> gather_inputs(triangle_count, 0);
+  ::std::vector<uint64> visible_leaves;
+  if (sharded) {
+    SelectShardSurfaces(&owned);
+    bool reaches_all = false;
+    bool reaches_any = false;
+    ::std::vector<uint64> reached_leaves;
+    for (uint32 i = 0; i < triangle_count && !reaches_all; i++) {
+      if (!owned[i] || loaded[2 * i + 1]) {
+        continue;
+      }
+
+      reaches_any = true;
+      reaches_all = !FindGatherLeaves(i, &visible_leaves);
+      reached_leaves.resize(visible_leaves.size(), 0);
+      for (uint32 j = 0; j < visible_leaves.size(); j++) {
+        reached_leaves[j] |= visible_leaves[j];
+      }
+    }
+
+    for (uint32 i = 0; i < triangle_count; i++) {
+      gather_inputs[i] =
+          reaches_all ||
+          (reaches_any && world_bsp_.IsTriangleVisible(i, reached_leaves));
+    }
+  }
+
+  // The file is written as the bake goes, one run of complete rows at a time.
+  // The arena stacks the lightmaps into a single column of lightmap sized
+  // images. Rows go to a temporary file that only replaces the lightmap file
+  // once the bake completes, so that a cancelled bake leaves it untouched. A
+  // shard leaves the file to MergeLightmapShards.
+  ::std::string partial_filename = lightmap_filename + ".partial";
+  uint32 row_width = textures_[triangles_[0].lightmap_]->texture_width_;
+  uint64 row_size = row_width * 3ull;
+  uint32 row_count = lightmap_arena_.QuerySize() / row_size;
+  uint32 rows_written = 0;
+  ::std::ofstream lightmap_file;
+  bool lightmap_file_valid = false;
+  if (!sharded) {
+    cout << "Saving lightmaps to file " << lightmap_filename << "." << endl;
+    lightmap_file.open(partial_filename, ::std::ios::out | ::std::ios::binary);
+    lightmap_file_valid =
+        ::base::BeginBitmapImage(&lightmap_file, row_width, row_count);
+  }
+
+  // Each surface runs through four tasks: its direct pass, its indirect pass
+  // (which blurs the result), the return of its direct lightmap to the linear
+  // layout, and the write of the rows that it completes. Each pass
+  // checkpoints its lightmap, and is left out if the lightmap was loaded
+  // instead. The passes are prioritized by cost and the rest in file order,
+  // so that rows reach the file as soon as their surfaces are done. A
+  // surface's indirect pass only waits for the direct passes of the surfaces
+  // in its PVS, unless its lumels lie outside the region that the PVS covers.
+  TaskGraph graph;
+  ::std::vector<DirectLightingContext> contexts(
+      thread_pool_.QueryThreadCount());
+  uint32 all_direct_done = graph.AddTask(nullptr, 0);
+  uint32 barrier_gathers_done = graph.AddTask(nullptr, 0);
+
+  // Join points for each leaf, for once the direct lightmaps of the surfaces
+  // in the leaf are done and for once every gather that can reach the leaf is
+  // done.
+  uint32 leaf_count =
+      world_bsp_.HasVisibility() ? world_bsp_.QueryLeafCount() : 0;
+  ::std::vector<uint32> leaf_direct_done(leaf_count);
+  ::std::vector<uint32> leaf_gathers_done(leaf_count);
+  for (uint32 leaf = 0; leaf < leaf_count; leaf++) {
+    leaf_direct_done[leaf] = graph.AddTask(nullptr, 0);
+    leaf_gathers_done[leaf] = graph.AddTask(nullptr, 0);
+  }
+
+  // A pass that was cancelled may have stopped part way through its lightmap,
+  // which is then not checkpointed.
+  uint32 barrier_count = 0;
+  uint32 previous_write = 0;
+  ::std::vector<uint8> runs_direct(triangle_count, 0);
+  for (uint32 i = 0; i < triangle_count; i++) {
+    Texture* lightmap = textures_[triangles_[i].lightmap_].get();
+
+    // The direct lightmap is still tiled when its pass ends, so a linear copy
+    // of it is checkpointed.
+    uint32 direct = 0;
+    runs_direct[i] = !loaded[2 * i] && (owned[i] || gather_inputs[i]);
+    if (runs_direct[i]) {
+      direct = graph.AddTask(
+          [&, i, lightmap](uint32 thread_index) {
+            ComputeDirectIlluminationHelper(this, i, &contexts[thread_index]);
+            if (owned[i] && !bake_progress_.IsCancelled()) {
+              ::std::vector<uint8> pixels(lightmap_offsets[2 * i + 1] -
+                                          lightmap_offsets[2 * i]);
+              lightmap->CopyLinearPixels(pixels.data());
+              bake_checkpoint_.AddLightmap(2 * i, pixels.data());
+            }
+          },
+          surface_ranks[i]);
+      graph.AddDependency(direct, all_direct_done);
+      if (leaf_count) {
+        for (uint32 j = 0; j < world_bsp_.QueryTriangleLeafCount(i); j++) {
+          uint32 leaf = world_bsp_.QueryTriangleLeaf(i, j);
+          graph.AddDependency(direct, leaf_direct_done[leaf]);
+        }
+      }
+    }
+
+    if (!owned[i]) {
+      continue;
+    }
+
+    uint32 write = 0;
+    if (!sharded) {
+      uint32 row_end =
+          min(lightmap_offsets[2 * i + 2] / row_size, (uint64)row_count);
+      write = graph.AddTask(
+          [&, row_end](uint32) {
+            if (lightmap_file_valid && row_end > rows_written &&
+                !bake_progress_.IsCancelled()) {
+              lightmap_file_valid = ::base::WriteBitmapRows(
+                  &lightmap_file,
+                  lightmap_arena_.QueryData() + rows_written * row_size,
+                  row_width, row_end - rows_written);
+              rows_written = row_end;
+            }
+          },
+          i);
+      if (i) {
+        graph.AddDependency(previous_write, write);
+      }
+      previous_write = write;
+    }
+
+    if (loaded[2 * i + 1]) {
+      continue;
+    }
+
+    uint32 gather = graph.AddTask(
+        [&, i](uint32) {
+          ComputeIndirectIlluminationHelper(this, i);
+          if (!bake_progress_.IsCancelled()) {
+            bake_checkpoint_.AddLightmap(
+                2 * i + 1,
+                lightmap_arena_.QueryData() + lightmap_offsets[2 * i + 1]);
+          }
+        },
+        surface_ranks[i]);
+    uint32 finish = graph.AddTask(
+        [lightmap](uint32) { lightmap->SetTiledLayout(false); }, i);
+    graph.AddDependency(gather, finish);
+    graph.AddDependency(barrier_gathers_done, finish);
+    if (!sharded) {
+      graph.AddDependency(finish, write);
+    }
+
+    if (runs_direct[i]) {
+      graph.AddDependency(direct, gather);
+    }
+
+    if (leaf_count) {
+      for (uint32 j = 0; j < world_bsp_.QueryTriangleLeafCount(i); j++) {
+        uint32 leaf = world_bsp_.QueryTriangleLeaf(i, j);
+        graph.AddDependency(leaf_gathers_done[leaf], finish);
+      }
+    }
+
+    if (!FindGatherLeaves(i, &visible_leaves)) {
+      graph.AddDependency(all_direct_done, gather);
+      graph.AddDependency(gather, barrier_gathers_done);
+      barrier_count++;
+      continue;
+    }
+
+    for (uint32 leaf = 0; leaf < leaf_count; leaf++) {
+      if (visible_leaves[leaf / 64] & (1ull << (leaf % 64))) {
+        graph.AddDependency(leaf_direct_done[leaf], gather);
+        graph.AddDependency(gather, leaf_gathers_done[leaf]);
+      }
+    }
+  }
+
+  // Each pass visits every lumel of its lightmap.
+  uint64 total_lumels = 0;
+  float64 total_seconds = 0.0;
+  for (uint32 i = 0; i < triangle_count; i++) {
+    uint64 lightmap_lumels =
+        (lightmap_offsets[2 * i + 1] - lightmap_offsets[2 * i]) / 3;
+    if (runs_direct[i]) {
+      total_lumels += lightmap_lumels;
+      total_seconds += surface_costs_[i].direct_seconds;
+    }
+
+    if (owned[i] && !loaded[2 * i + 1]) {
+      total_lumels += lightmap_lumels;
+      total_seconds += surface_costs_[i].indirect_seconds;
+    }
+  }
+
+  bake_progress_.Begin(total_lumels, total_seconds, PROGRESS_INTERVAL_MS,
+                       options_.cancel_bake);
+  graph.Run(&thread_pool_);
+  lightmap_file.close();
+
+  if (bake_progress_.IsCancelled()) {
+    remove(partial_filename.c_str());
+    bake_checkpoint_.End(false);
+    lumel_samples_ = LumelSampleBuffer();
+    surface_costs_.clear();
+    cout << "Cancelled the bake after " << bake_progress_.QueryLumelsDone()
+         << " of " << bake_progress_.QueryTotalLumels()
+         << " lumels. The lightmap file was left untouched, and the finished "
+            "lightmaps were kept in "
+         << checkpoint_filename << " for a resumed bake." << endl;
+    return;
+  }
+
+  ReportDirectIllumination(contexts);
+  uint32 owned_count = ::std::count(owned.begin(), owned.end(), (uint8)1);
+  cout << "Baked " << owned_count << " surfaces as a graph of "
+       << graph.QueryTaskCount() << " tasks (" << barrier_count
+       << " waited for every direct lightmap)." << endl;
+
+  // The shard file holds the shard's lightmaps until they are merged. The
+  // arena holds only part of the lightmaps, so nothing is uploaded.
+  if (sharded) {
+    bake_checkpoint_.End(false);
+    lumel_samples_ = LumelSampleBuffer();
+    surface_costs_.clear();
+    cout << "Saved shard " << options_.shard_index << " of "
+         << options_.shard_count << " to file " << checkpoint_filename << "."
+         << endl;
+    return;
+  }
+
+  // Replace the lightmap file with the finished one. The checkpoint is only
+  // needed until then.
+  remove(lightmap_filename.c_str());
+  if (!lightmap_file_valid ||
+      rename(partial_filename.c_str(), lightmap_filename.c_str())) {
+    remove(partial_filename.c_str());
+    bake_checkpoint_.End(false);
+    cout << "Failed to save lightmaps to file " << lightmap_filename << "."
+         << endl;
+  } else {
+    bake_checkpoint_.End(true);
+  }
+
+  // Upload all of our textures to the GPU.
+  UploadLightmaps();
+
+  lumel_samples_ = LumelSampleBuffer();
+  surface_costs_.clear();
+}
+
+bool World::MergeLightmapShards(const ::std::string& lightmap_filename) {
+  uint32 triangle_count = triangles_.size();
+  if (!triangle_count) {
+    return false;
+  }
+
+  // Every lightmap must come from exactly one shard, so the result does not
+  // depend on the order in which the shards are read.
+  ::std::vector<uint64> lightmap_offsets = ComputeLightmapOffsets();
+  uint64 scene_hash = ComputeBakeHash();
+  ::std::vector<uint8> merged(2 * triangle_count, 0);
+  ::std::vector<uint8> shard_lightmaps;
+  bool merge_valid = true;
+  for (uint32 shard = 0; shard < options_.merge_shard_count && merge_valid;
+       shard++) {
+    ::std::string shard_filename = MakeShardFilename(
+        lightmap_filename, shard, options_.merge_shard_count);
+    if (!BakeCheckpoint::Load(shard_filename, scene_hash, lightmap_offsets,
+                              lightmap_arena_.QueryData(), &shard_lightmaps)) {
+      cout << "Shard file " << shard_filename
+           << " is missing or was not baked for the current map." << endl;
+      merge_valid = false;
+      break;
+    }
+
+    for (uint32 k = 0; k < 2 * triangle_count; k++) {
+      if (shard_lightmaps[k] && merged[k]) {
+        cout << "Shard file " << shard_filename
+             << " holds lightmaps that an earlier shard already holds."
+             << endl;
+        merge_valid = false;
+        break;
+      }
+
+      merged[k] |= shard_lightmaps[k];
+    }
+  }
+
+  uint32 missing_count = ::std::count(merged.begin(), merged.end(), (uint8)0);
+  if (merge_valid && missing_count) {
+    cout << "The shards are missing " << missing_count << " of "
+         << 2 * triangle_count << " lightmaps." << endl;
+    merge_valid = false;
+  }
+
+  if (!merge_valid) {
+    memset(lightmap_arena_.QueryData(), 0, lightmap_arena_.QuerySize());
+    return false;
+  }
+
+  uint32 row_width = textures_[triangles_[0].lightmap_]->texture_width_;
+  uint32 row_count = lightmap_arena_.QuerySize() / (row_width * 3ull);
+  if (!::base::SaveBitmapImage(lightmap_filename, lightmap_arena_.QueryData(),
+                               row_width, row_count)) {
+    cout << "Failed to save lightmaps to file " << lightmap_filename << "."
+         << endl;
+    return false;
+  }
+
+  cout << "Merged " << options_.merge_shard_count
+       << " shards into lightmap file " << lightmap_filename << "." << endl;
+  return true;
+}
@@ -32,29 +32,204 @@
 #ifndef __ASSETS_H__
 #define __ASSETS_H__
 
+#include <atomic>
+#include <cstdio>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include "bake_checkpoint.h"
+#include "bake_progress.h"
+#include "bsp.h"
+#include "bvh.h"
+#include "jmath/alias.h"
 #include "jmath/base.h"
+#include "jmath/matrix4.h"
 #include "jmath/normal.h"
+#include "jmath/trace.h"
 #include "jmath/vector3.h"
 #include "jmath/vector4.h"
+#include "jmath/volume.h"
+#include "light_tree.h"
+#include "lightmap_arena.h"
+#include "shadow_cube.h"
+#include "thread_pool.h"
+#include "uniform_grid.h"
 
 using ::base::float32;
+using ::base::float64;
 using ::base::int32;
 using ::base::uint32;
+using ::base::uint64;
 using ::base::uint8;
 using ::base::vector2;
 using ::base::vector3;
 using ::base::vector4;
 
 class World;
+struct AdaptiveLumelGrid;
+
+// The spatial index used to accelerate ray queries.
+enum AccelerationStructureType {
+  kAccelerationAuto,
+  kAccelerationBvh,
+  kAccelerationGrid
+};
+
+// Settings for loading and lightmapping a world, typically taken from the
+// command line.
+typedef struct WorldOptions {
+  WorldOptions()
+      : acceleration_structure(kAccelerationAuto),
+        thread_count(0),
+        direct_barrier(false),
+        estimate_only(false),
+        resume(false),
+        shard_index(0),
+        shard_count(0),
+        shard_by_cost(false),
+        merge_shard_count(0),
+        cancel_bake(NULL) {}
+  // The spatial index to build. Auto picks a grid for large, evenly filled
+  // scenes and a BVH otherwise.
+  AccelerationStructureType acceleration_structure;
+  // The number of threads that load and bake the world, or zero for one per
+  // hardware thread.
+  uint32 thread_count;
+  // If true, every surface's indirect pass waits for the direct pass of every
+  // surface. Otherwise it only waits for the surfaces in its PVS.
+  bool direct_barrier;
+  // If true, the lightmaps are not allocated, baked or loaded, and nothing is
+  // written to disk. Their cost is estimated from a sample of lumels instead.
+  bool estimate_only;
+  // If true, a bake picks up the surfaces that an interrupted bake of the
+  // same scene checkpointed, rather than starting over.
+  bool resume;
+  // If shard_count is non-zero, the bake only covers the surfaces of shard
+  // shard_index out of shard_count, and saves their lightmaps to a shard file
+  // instead of the lightmap file. Surfaces are dealt out to the shards in
+  // turn, or by estimated cost if shard_by_cost is set.
+  uint32 shard_index;
+  uint32 shard_count;
+  bool shard_by_cost;
+  // If non-zero, the lightmap file is merged from this many shard files
+  // rather than loaded or baked.
+  uint32 merge_shard_count;
+  // If non-null, the bake stops soon after this turns true, and the lightmap
+  // file is left as it was.
+  const ::std::atomic<bool>* cancel_bake;
+} WorldOptions;
+
+// Returns true if a world loaded with options will be drawn. Estimates, shards
+// and merges only write their results, and run without a window or a graphics
+// context to upload textures to.
+inline bool IsInteractive(const WorldOptions& options) {
+  return !options.estimate_only && !options.shard_count &&
+         !options.merge_shard_count;
+}
+
+// State shared by every lumel of a triangle during the direct pass.
+typedef struct DirectLightingContext {
+  DirectLightingContext()
+      : occluder_cache_hits(0),
+        occluder_cache_lookups(0),
+        shadow_cube_lookups(0),
+        shadow_cube_fallbacks(0),
+        shadow_packets(0),
+        shadow_packet_rays(0),
+        shadow_packet_fallbacks(0),
+        pvs_culled_lights(0) {}
+  // The triangle whose lightmap is being computed.
+  uint32 triangle_index;
+  // The lights whose influence sphere reaches the triangle's lightmap, less
+  // any outside the PVS of every lumel.
+  ::std::vector<uint32> light_indices;
+  // The leaves potentially visible from any lumel of the triangle, or nothing
+  // if there is no PVS. Shadow rays skip occluders outside of them.
+  ::std::vector<uint64> visible_leaves;
+  // Draws from light_indices in proportion to each light's estimated
+  // contribution to the triangle. Only built for sampled light selection.
+  ::base::alias_table light_table;
+  // When non-null, holds a mask of occluded packet lanes for each entry of
+  // light_indices, and packet_lane selects the lumel being shaded.
+  const uint32* packet_occlusion;
+  uint32 packet_lane;
+  // The texel index (in memory order) of the lumel being shaded, which keys
+  // its random stream.
+  uint32 lumel_index;
+  // The last triangle found to block each light, or -1. Unlike the fields
+  // above this persists across the triangles handled by a thread.
+  ::std::vector<int32> occluder_cache;
+  // The number of shadow rays resolved by the occluder cache.
+  uint64 occluder_cache_hits;
+  // The number of shadow rays cast through IsLightOccluded.
+  uint64 occluder_cache_lookups;
+  // The number of visibility queries answered from shadow cube maps.
+  uint64 shadow_cube_lookups;
+  // The number of cube map queries that fell back to an exact ray.
+  uint64 shadow_cube_fallbacks;
+  // The number of shadow ray packets traced, and the rays they carried.
+  uint64 shadow_packets;
+  uint64 shadow_packet_rays;
+  // The number of rays whose packet diverged and was traced one ray at a time.
+  uint64 shadow_packet_fallbacks;
+  // The number of influencing lights dropped because they were outside the
+  // PVS.
+  uint64 pvs_culled_lights;
+} DirectLightingContext;
+
+typedef struct GatherRay {
+  // The segment to trace, from a lumel out into the scene.
+  ::base::ray trace_ray;
+  // The triangle that owns the lumel, which never occludes its own rays.
+  uint32 source_triangle;
+} GatherRay;
+
+typedef struct GatherHit {
+  // The nearest opaque triangle hit by the ray, or -1 for a miss.
+  int32 triangle;
+  // The collision with the nearest triangle.
+  ::base::collision hit_info;
+  // The barycentric coordinates of the collision within the triangle.
+  vector2 bary_coords;
+} GatherHit;
+
+// The estimated cost of baking a surface, extrapolated from a sample of its
+// lumels.
+typedef struct SurfaceCost {
+  SurfaceCost()
+      : lumel_count(0),
+        direct_seconds(0.0),
+        indirect_seconds(0.0),
+        direct_rays(0),
+        gather_rays(0) {}
+  uint64 lumel_count;
+  // The thread time of the surface's direct and indirect passes.
+  float64 direct_seconds;
+  float64 indirect_seconds;
+  // The number of shadow rays and gather rays that the passes trace.
+  uint64 direct_rays;
+  uint64 gather_rays;
+} SurfaceCost;
+
+// The world space position of every lumel, computed once before the bake and
+// shared by its passes. Triangle i owns the samples from first_sample[i] up to
+// first_sample[i + 1], one for each texel of its lightmaps in memory order.
+typedef struct LumelSampleBuffer {
+  ::std::vector<uint64> first_sample;
+  ::std::vector<float32> position_x;
+  ::std::vector<float32> position_y;
+  ::std::vector<float32> position_z;
+} LumelSampleBuffer;
 
 class Light {
   friend class World;
-  friend void ComputeDirectIlluminationHelper(World* world, uint32 thread_index);
-  friend void ComputeIndirectIlluminationHelper(World* world, uint32 thread_index);
+  friend class LightTree;
+  friend void ComputeDirectIlluminationHelper(World* world,
+                                              uint32 triangle_index,
+                                              DirectLightingContext* context);
+  friend void ComputeIndirectIlluminationHelper(World* world,
+                                                uint32 triangle_index);
 
  public:
   Light(const vector3& position, const vector4& color, float32 intensity);
@@ -63,19 +238,26 @@ class Light {
   vector4 color_;
   vector3 position_;
   float32 intensity_;
+  // Beyond this distance the light's contribution quantizes to zero.
+  float32 influence_radius_;
   bool enabled_;
 };
 
 class Texture {
   friend World;
-  friend void ComputeDirectIlluminationHelper(World* world, uint32 thread_index);
-  friend void ComputeIndirectIlluminationHelper(World* world, uint32 thread_index);
+  friend void ComputeDirectIlluminationHelper(World* world,
+                                              uint32 triangle_index,
+                                              DirectLightingContext* context);
+  friend void ComputeIndirectIlluminationHelper(World* world,
+                                                uint32 triangle_index);
 
  public:
-  // Loads a texture (bitmap) into memory.
+  // Loads a texture (bitmap) into memory. Safe to call from any thread, but
+  // UploadTexture must follow on the thread that owns the graphics context.
   Texture(const ::std::string& filename);
-  // Creates a texture with the specified dimensions.
-  Texture(uint32 width, uint32 height);
+  // Creates a texture with the specified dimensions over width * height * 3
+  // bytes of pixels owned by the caller, such as the lightmap arena.
+  Texture(uint32 width, uint32 height, uint8* pixels);
   // Destroys the texture and clears it from graphics memory.
   virtual ~Texture();
   // Binds the texture to the current graphics context, at the unit
@@ -85,25 +267,57 @@ class Texture {
   vector3 ReadTexel(const vector2& coord) const;
   // Writes a texel at the specified coordinate.
   void WriteTexel(const vector2& coord, const vector3& texel);
-  // Performs a 3x3 blur of the texture data.
+  // Performs a 3x3 blur of the texture data. The texture must be linear.
   void BlurTexture(int32 radius, int32 step);
-  // Uploads the current texture state to the GPU.
+  // Uploads the current texture state to the GPU. The texture must be linear.
   void UploadTexture();
+  // Rearranges the pixels between the linear row-major layout and the tiled
+  // layout, in which square tiles are stored one after another and the texels
+  // of each tile are stored in Z-order.
+  void SetTiledLayout(bool tiled);
+  // Copies the texture's pixels to pixels in the linear layout, whichever
+  // layout the texture uses.
+  void CopyLinearPixels(uint8* pixels) const;
+  // Returns the position in memory order (in texels) of the texel at x, y.
+  uint32 QueryTexelIndex(uint32 x, uint32 y) const;
+  // Returns the coordinates of the texel at index in memory order, so that
+  // walking index visits neighbouring texels together.
+  void QueryTexelCoords(uint32 index, uint32* x, uint32* y) const;
 
  private:
   // The internal graphics index for this texture.
   uint32 gl_texture_index_;
-  // The graphical data for this texture.
+  // The graphical data for textures that own their pixels.
   ::std::vector<uint8> texture_map_;
+  // The texture's pixels, either in texture_map_ or owned elsewhere.
+  uint8* texture_data_;
   // Texture image width
   uint32 texture_width_;
   // Texture image height
   uint32 texture_height_;
+  // Whether the pixels use the tiled layout rather than the linear one.
+  bool texture_tiled_;
 };
 
+// The part of a triangle that ray queries read for every candidate. It lives
+// in its own array, apart from the shading data in Triangle, so that traversal
+// streams through compact records.
+typedef struct TriangleGeometry {
+  // The three vertex positions.
+  vector3 vertices[3];
+  // The plane of the triangle (to speed up collision checks). Its first three
+  // components are the triangle's normal.
+  vector4 plane;
+  // True if the triangle requires alpha blending. Such triangles never occlude
+  // rays.
+  bool requires_alpha;
+} TriangleGeometry;
+
+// Returns the geometry of the triangle v0, v1, v2.
+TriangleGeometry MakeTriangleGeometry(const vector3& v0, const vector3& v1,
+                                      const vector3& v2, bool requires_alpha);
+
 typedef struct Vertex {
-  // The vertex coordinate.
-  vector3 vert;
   // The color for this vertex.
   vector4 color;
   // The texture coordinate;
@@ -112,77 +326,355 @@ typedef struct Vertex {
   vector2 lc;
 } Vertex;
 
+// The shading data of a triangle, which the bake reads once per lumel rather
+// than once per ray. Textures are handles into the world's texture table.
 class Triangle {
  friend World;
- friend void ComputeDirectIlluminationHelper(World* world, uint32 thread_index);
- friend void ComputeIndirectIlluminationHelper(World* world, uint32 thread_index);
+ friend void ComputeDirectIlluminationHelper(World* world,
+                                             uint32 triangle_index,
+                                             DirectLightingContext* context);
+ friend void ComputeIndirectIlluminationHelper(World* world,
+                                               uint32 triangle_index);
 
  public:
-  // Also allocates a lightmap texture based on the size of the triangle and our
-  // scale factor.
-  Triangle(const vector3& v0, const vector2& t0, const vector4& c0, const vector3& v1,
-           const vector2& t1, const vector4& c1, const vector3& v2, const vector2& t2, const vector4& c2,
-           const ::std::shared_ptr<Texture>& diffuse);
+  // The lightmaps are attached later, once the triangle's size is known.
+  Triangle(const TriangleGeometry& geometry, const vector2& t0,
+           const vector4& c0, const vector2& t1, const vector4& c1,
+           const vector2& t2, const vector4& c2, uint32 diffuse);
   // Attaches a lightmap texture to the triangle.
-  void AttachLightmap(const ::std::shared_ptr<Texture>& lightmap);
+  void AttachLightmap(uint32 lightmap);
   // Attaches a global illumination lightmap texture to the triangle.
-  void AttachGlobalLightmap(const ::std::shared_ptr<Texture>& lightmap);
+  void AttachGlobalLightmap(uint32 lightmap);
   // Samples the modulated light at the given world coordinate.
   vector3 ReadLight(const vector3& point) const;
-  // Renders the triangle with multitexturing, if enabled.
-  void Draw(bool textures_enabled, bool lights_enabled,
+  // Renders the triangle with multitexturing, if enabled. Texture handles are
+  // resolved through textures.
+  void Draw(const TriangleGeometry& geometry,
+            const ::std::vector<::std::shared_ptr<Texture>>& textures,
+            bool textures_enabled, bool lights_enabled,
             bool global_illum_enabled) const;
 
  private:
-  // Three vertices for our triangle.
+  // The shading attributes of the three vertices.
   Vertex vertices_[3];
   // The normal vector for the triangle.
   vector3 normal_;
-  // The plane of the triangle (to speed up collision checks).
-  vector4 plane_;
   // The diffuse texture.
-  ::std::shared_ptr<Texture> diffuse_;
+  uint32 diffuse_;
   // The lightmap texture.
-  ::std::shared_ptr<Texture> lightmap_;
+  uint32 lightmap_;
   // The global illumination lightmap texture.
-  ::std::shared_ptr<Texture> gi_lightmap_;
-  // True if the triangle requires alpha blending.
-  bool requires_alpha_;
+  uint32 gi_lightmap_;
 };
 
+// A piece of geometry that the world file declares once and places any number
+// of times through instances.
+typedef struct Prefab {
+  // The prefab's triangles, with their geometry in the prefab's own space.
+  ::std::vector<TriangleGeometry> geometry;
+  ::std::vector<Triangle> triangles;
+  // The bounds of the triangles, in the prefab's space.
+  ::base::bounds local_bounds;
+  // A bounding volume hierarchy over the triangles, shared by every instance.
+  ::std::shared_ptr<Bvh> hierarchy;
+} Prefab;
+
+// A placement of a prefab in the world.
+typedef struct PrefabInstance {
+  // The index of the placed prefab.
+  uint32 prefab;
+  // Maps the prefab's space to world space. The bottom row is (0, 0, 0, 1).
+  ::base::matrix4 transform;
+  // The index of the instance's first triangle in the world's triangles. Each
+  // instance owns a transformed copy of its prefab's triangles, since every
+  // copy needs lightmaps of its own.
+  uint32 first_triangle;
+} PrefabInstance;
+
 class World {
- friend void ComputeDirectIlluminationHelper(World* world, uint32 thread_index);
- friend void ComputeIndirectIlluminationHelper(World* world, uint32 thread_index);
+ friend void ComputeDirectIlluminationHelper(World* world,
+                                             uint32 triangle_index,
+                                             DirectLightingContext* context);
+ friend void ComputeIndirectIlluminationHelper(World* world,
+                                               uint32 triangle_index);
 
  public:
   // Load a file and compute its lightmap.
-  World(const ::std::string& filename);
+  World(const ::std::string& filename,
+        const WorldOptions& options = WorldOptions());
   // Returns true if the world was initialized successfully.
   bool IsValid() const;
-  // Render the world.
-  void Draw(bool textures_enabled, bool lights_enabled,
+  // Render the world as seen from eye, skipping triangles outside the eye's
+  // potentially visible set.
+  void Draw(const vector3& eye, bool textures_enabled, bool lights_enabled,
             bool global_illum_enabled) const;
 
  private:
+  // The triangles' traversal data and shading data, in matching order.
+  ::std::vector<TriangleGeometry> triangle_geometry_;
   ::std::vector<Triangle> triangles_;
   ::std::vector<Light> lights_;
+  // The pixels of every lightmap, with each triangle's lightmap followed by
+  // its global illumination lightmap. This is also the layout of the
+  // lightmap file.
+  LightmapArena lightmap_arena_;
+  // The texture table. The world file's diffuse textures come first, followed
+  // by each triangle's lightmaps, which are views into lightmap_arena_.
   ::std::vector<::std::shared_ptr<Texture>> textures_;
+  // The settings the world was loaded with.
+  WorldOptions options_;
+  // The threads shared by every stage of loading and baking.
+  ThreadPool thread_pool_;
+  // The prefabs declared by the world file and their placements.
+  ::std::vector<Prefab> prefabs_;
+  ::std::vector<PrefabInstance> instances_;
+  // The number of triangles that do not belong to an instance. They precede
+  // the instances' triangles in triangles_.
+  uint32 static_triangle_count_;
+  // A bounding volume hierarchy over the static triangles, used by every ray
+  // query unless the uniform grid is built instead.
+  Bvh triangle_bvh_;
+  // A bounding volume hierarchy over the world space bounds of each instance.
+  // Its leaves lead into the hierarchy of the instance's prefab.
+  Bvh instance_bvh_;
+  // A uniform grid over triangles_, built in place of the BVH for evenly
+  // filled scenes.
+  UniformGrid triangle_grid_;
+  // A BSP tree over triangles_ holding each leaf's potentially visible set,
+  // used to cull lights and occluders in the direct pass, to order the bake's
+  // tasks and to cull leaves when drawing.
+  BspTree world_bsp_;
+  // The leaves that each light lies in, or nothing for lights outside the
+  // region that world_bsp_'s portals cover.
+  ::std::vector<::std::vector<uint32>> light_leaves_;
+  // The leaves that Draw last found the eye in, and the leaves visible from
+  // them. They are kept across frames so that Draw only rebuilds the visible
+  // set when the eye moves into other leaves.
+  mutable ::std::vector<uint32> draw_eye_leaves_;
+  mutable ::std::vector<uint32> draw_scratch_leaves_;
+  mutable ::std::vector<uint64> draw_visible_leaves_;
+  // A hierarchy of light clusters, built when lightcuts are enabled.
+  LightTree light_tree_;
+  // Depth cube maps for the first lights, built when shadow cube maps are
+  // enabled. Lights without a map use exact shadow rays.
+  ::std::vector<ShadowCubeMap> shadow_cube_maps_;
+  // The work done by the current bake, and whether it has been cancelled.
+  BakeProgress bake_progress_;
+  // The surfaces that the current bake has finished, kept on disk until the
+  // lightmap file is written.
+  BakeCheckpoint bake_checkpoint_;
+  // The lumel positions shared by the passes of a bake, empty otherwise.
+  LumelSampleBuffer lumel_samples_;
+  // The estimated cost of each surface during a bake, empty otherwise.
+  ::std::vector<SurfaceCost> surface_costs_;
   // A random normal generator.
   ::base::normal_sphere normal_generator;
+  // The number of lumels that were traced (not interpolated) by the direct
+  // pass.
+  ::std::atomic<uint64> direct_traced_lumels_;
+  // The number of triangle/light pairs that survived influence culling.
+  ::std::atomic<uint64> direct_light_pairs_;
+  // Shadow ray totals for the direct pass occluder caches.
+  ::std::atomic<uint64> direct_occluder_cache_hits_;
+  ::std::atomic<uint64> direct_occluder_cache_lookups_;
+  // Visibility query totals for the direct pass shadow cube maps.
+  ::std::atomic<uint64> direct_shadow_cube_lookups_;
+  ::std::atomic<uint64> direct_shadow_cube_fallbacks_;
+  // Shadow ray packet totals for the direct pass.
+  ::std::atomic<uint64> direct_shadow_packets_;
+  ::std::atomic<uint64> direct_shadow_packet_rays_;
+  ::std::atomic<uint64> direct_shadow_packet_fallbacks_;
+  // The number of triangle/light pairs culled by the PVS.
+  ::std::atomic<uint64> direct_pvs_culled_lights_;
   // Parses the world file and loads its contents.
   bool LoadWorldFromFile(const ::std::string& filename);
+  // Parses the prefabs and instances that may follow the world's polygons, and
+  // adds each instance's triangles to the world.
+  bool LoadPrefabsFromFile(FILE* file_ptr);
+  // Parses the faces of a polygon block (the line that opens it is in
+  // face_line) and appends its triangles to geometry and triangles.
+  void ReadFace(FILE* file_ptr, const char* face_line,
+                ::std::vector<TriangleGeometry>* geometry,
+                ::std::vector<Triangle>* triangles) const;
   // Parses a lightmap file and loads its contents.
   bool LoadLightmapsFromFile(const ::std::string& filename);
-  // Saves our lightmap data to the specified file.
-  void SaveLightmapsToFile(const ::std::string& filename);
-  // Generates lightmaps for all surfaces in the world.
-  void GenerateLightmaps();
-  // Initializes lightmap memory and sets up lightmap UVs.
-  void PrepareTrianglesForLightmapping();
-  // Updates the level-1 lightmap with direct illumination.
-  void ComputeDirectIllumination();
-  // Updates the level-2 lightmap with indirect illumination.
-  void ComputeIndirectIllumination();
+  // Uploads every triangle's lightmaps, if the world will be drawn.
+  void UploadLightmaps();
+  // Generates lightmaps for all surfaces in the world, writing them to the
+  // specified file as they complete. Finished surfaces are checkpointed next
+  // to the file, and a resumed bake loads them instead of baking them. A
+  // shard bakes only its own surfaces and keeps them in its shard file.
+  void GenerateLightmaps(const ::std::string& lightmap_filename);
+  // Marks the surfaces that belong to this process's shard. Every shard
+  // computes the same partition, from costs counted in rays rather than
+  // measured in time.
+  void SelectShardSurfaces(::std::vector<uint8>* owned) const;
+  // Combines the shard files of an earlier sharded bake into the lightmap
+  // file. Returns false, and leaves the file as it was, if a shard is
+  // missing, belongs to another scene or overlaps another shard.
+  bool MergeLightmapShards(const ::std::string& lightmap_filename);
+  // Estimates the time, rays and memory that GenerateLightmaps would take, and
+  // reports them along with a histogram of the surfaces' costs.
+  void EstimateLightmaps();
+  // Measures the passes of each surface on sample_count random lumels,
+  // through the same tracing as the bake, and extrapolates them to the whole
+  // surface. Expects PrepareDirectIllumination to have run.
+  void EstimateSurfaceCosts(uint32 sample_count,
+                            ::std::vector<SurfaceCost>* costs);
+  // Selects and prepares the spatial index used for ray queries. A BVH is
+  // mapped from cache_filename if it was built for the current geometry, and
+  // otherwise built and written to the cache.
+  void PrepareAccelerationStructure(const ::std::string& cache_filename);
+  // Builds the bounding volume hierarchy over the world's triangles.
+  void BuildAccelerationStructure();
+  // Builds the hierarchy of each prefab and the hierarchy over the instances.
+  void BuildInstanceHierarchy();
+  // Returns true if any BVH has been built or mapped.
+  bool HasBvh() const;
+  // Walks the static triangle hierarchy and then the hierarchy of every
+  // instance, in world space. Children whose bounds fail overlaps are culled,
+  // and visit is called with each triangle of the remaining leaves until it
+  // returns false. If order_dir is non-null, children are visited front to
+  // back along it. Returns false if visit stopped the walk.
+  template <typename BoundsTest, typename TriangleVisitor>
+  bool WalkBvh(const vector3* order_dir, const BoundsTest& overlaps,
+               const TriangleVisitor& visit) const;
+  // Walks a single hierarchy for WalkBvh. Child bounds are mapped to world
+  // space by instance unless it is null, and primitives are offset by
+  // first_primitive before they are visited.
+  template <typename BoundsTest, typename PrimitiveVisitor>
+  bool WalkBvhLevel(const Bvh& bvh, const PrefabInstance* instance,
+                    uint32 first_primitive, const vector3* order_dir,
+                    const BoundsTest& overlaps,
+                    const PrimitiveVisitor& visit) const;
+  // Builds the uniform grid over the world's triangles.
+  void BuildUniformGrid();
+  // Compiles the BSP tree and PVS over the world's triangles and finds the
+  // leaves of each light.
+  void CompileBsp();
+  // Returns true if the triangle touches a leaf in visible_leaves, or if
+  // visible_leaves is empty (no PVS).
+  bool IsTriangleInPvs(const ::std::vector<uint64>& visible_leaves,
+                       uint32 triangle_index) const;
+  // Returns a hash of every static triangle's vertex positions, in order.
+  uint64 ComputeGeometryHash() const;
+  // Returns a hash of everything that the lightmaps depend on: the triangles
+  // and their shading, the lights, the loaded textures and the bake settings.
+  uint64 ComputeBakeHash() const;
+  // Returns where each lightmap starts in the arena, followed by the arena's
+  // size. Surface i's direct lightmap is lightmap 2 * i and its indirect
+  // lightmap is lightmap 2 * i + 1.
+  ::std::vector<uint64> ComputeLightmapOffsets() const;
+  // Initializes lightmap memory and sets up lightmap UVs. Returns false if
+  // the lightmap arena could not be allocated.
+  bool PrepareTrianglesForLightmapping();
+  // Resets the direct pass totals and builds the direct pass's light
+  // structures.
+  void PrepareDirectIllumination();
+  // Adds up the totals of the contexts that ran the direct pass and reports
+  // them.
+  void ReportDirectIllumination(
+      const ::std::vector<DirectLightingContext>& contexts);
+  // Maps a lumel of a triangle's lightmap to its world space position.
+  vector3 ComputeLumelPosition(uint32 triangle_index, uint32 lx,
+                               uint32 ly) const;
+  // Fills lumel_samples_ for every triangle, following the current layout of
+  // its lightmaps.
+  void PrepareLumelSamples();
+  // Returns the world space position of the lumel at texel_index (in memory
+  // order) of a triangle's lightmap, from lumel_samples_.
+  vector3 QueryLumelPosition(uint32 triangle_index, uint32 texel_index) const;
+  // Returns true if the opaque triangle at occluder_index blocks the ray.
+  bool TriangleOccludesRay(uint32 occluder_index,
+                           const ::base::ray& trace_ray) const;
+  // Returns the index of an opaque triangle (other than triangle_index) that
+  // blocks the segment between origin and target, or -1 if there is none.
+  // Triangles outside visible_leaves are skipped unless it is empty.
+  int32 FindSegmentOccluder(uint32 triangle_index, const vector3& origin,
+                            const vector3& target,
+                            const ::std::vector<uint64>& visible_leaves) const;
+  // Returns true if the light is blocked from origin on the context's
+  // triangle, testing the context's cached occluder for the light first.
+  bool IsLightOccluded(DirectLightingContext* context, const vector3& origin,
+                       uint32 light) const;
+  // Returns a mask of the lanes (bits of active_mask) whose segment from
+  // origins[lane] to the light is blocked. Coherent packets are traced
+  // together, culling triangles against the packet's bounds and bounding cone,
+  // while divergent packets fall back to IsLightOccluded for each lane.
+  uint32 TraceShadowPacket(DirectLightingContext* context,
+                           const vector3* origins, uint32 active_mask,
+                           uint32 light) const;
+  // Rasterizes the opaque triangles within each light's influence radius into
+  // the light's shadow cube map.
+  void BuildShadowCubeMaps();
+  // Traces a batch of gather rays, writing the nearest hit for each ray to the
+  // matching entry of hits. Rays are binned by direction octant and origin
+  // cell and traced in coherent groups.
+  void TraceGatherRays(const ::std::vector<GatherRay>& rays,
+                       ::std::vector<GatherHit>* hits) const;
+  // Traces a coherent group of rays (indices into rays) against every
+  // triangle, testing each triangle against the whole group before moving on.
+  void TraceGatherRayGroup(const ::std::vector<GatherRay>& rays,
+                           const uint32* group, uint32 group_size,
+                           ::std::vector<GatherHit>* hits) const;
+  // Appends the SAMPLE_COUNT gather rays of a lumel, which start at origin, to
+  // rays.
+  void QueueGatherRays(uint32 triangle_index, uint32 lumel_index,
+                       const vector3& origin, ::std::vector<GatherRay>* rays);
+  // Traces the gather rays queued for a batch of lumels on one triangle
+  // (SAMPLE_COUNT consecutive rays per lumel) and writes each lumel's global
+  // illumination texel.
+  void ResolveGatherBatch(uint32 triangle_index,
+                          const ::std::vector<vector2>& lumels,
+                          const ::std::vector<GatherRay>& rays,
+                          ::std::vector<GatherHit>* hits);
+  // Returns the world space bounds of every lumel in a triangle's lightmap.
+  ::base::bounds ComputeLightmapBounds(uint32 triangle_index) const;
+  // Returns the indices of the lights whose influence sphere reaches any
+  // lumel of the triangle.
+  ::std::vector<uint32> FindInfluencingLights(uint32 triangle_index) const;
+  // Computes the direct illumination at a point on the context's triangle
+  // using the configured light selection strategy. If visibility is non-null
+  // it receives a mask of the lights that reached the point (folded into 64
+  // bits).
+  vector3 ComputeLumelDirectIllumination(DirectLightingContext* context,
+                                         const vector3& origin,
+                                         uint64* visibility) const;
+  // Sums the contribution of each of the context's lights at a point.
+  vector3 ComputeLumelLightListIllumination(DirectLightingContext* context,
+                                            const vector3& origin,
+                                            uint64* visibility) const;
+  // Estimates the contribution of every light at a point by refining a cut
+  // through the light tree, casting one shadow ray per cluster in the cut.
+  vector3 ComputeLumelLightcutIllumination(DirectLightingContext* context,
+                                           const vector3& origin,
+                                           uint64* visibility) const;
+  // Estimates the contribution of the context's lights at a point from a fixed
+  // number of lights drawn in proportion to their expected contribution.
+  vector3 ComputeLumelSampledIllumination(DirectLightingContext* context,
+                                          const vector3& origin,
+                                          uint64* visibility) const;
+  // Prepares the per-triangle state of a direct lighting context.
+  void PrepareDirectLightingContext(uint32 triangle_index,
+                                    DirectLightingContext* context) const;
+  // Traces every lumel of a triangle's lightmap against the context's lights.
+  void ComputeExhaustiveDirectIllumination(DirectLightingContext* context);
+  // Traces every lumel of a triangle's lightmap in tiles of SHADOW_PACKET_SIZE
+  // lumels, resolving each light's visibility for a tile with one packet.
+  void ComputePacketDirectIllumination(DirectLightingContext* context);
+  // Traces lights at the corners of coarse lumel blocks and only subdivides
+  // blocks whose corners disagree, interpolating the rest.
+  void ComputeAdaptiveDirectIllumination(DirectLightingContext* context);
+  // Refines a single block of the adaptive direct pass. Corners are inclusive.
+  void RefineAdaptiveBlock(DirectLightingContext* context,
+                           AdaptiveLumelGrid* grid, uint32 x0, uint32 y0,
+                           uint32 x1, uint32 y1);
+  // Fills visible_leaves with the leaves that a triangle's gather rays may
+  // hit. Returns false if the gather must instead wait for every direct
+  // lightmap, which is when there is no PVS, the options ask for it, or the
+  // triangle's lumels are not covered by the PVS.
+  bool FindGatherLeaves(uint32 triangle_index,
+                        ::std::vector<uint64>* visible_leaves) const;
 };
 
 #endif  // __ASSETS_H__
\ No newline at end of file
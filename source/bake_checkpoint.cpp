@@ -0,0 +1,163 @@
+#include "bake_checkpoint.h"
+
+#include <cstring>
+
+// The file is a header followed by one record per finished lightmap, each a
+// BakeCheckpointRecord and then the lightmap's pixels.
+#define BAKE_CHECKPOINT_MAGIC (0x314B434C)  // "LCK1"
+#define BAKE_CHECKPOINT_VERSION (1)
+// A new checkpoint is written under this suffix until it replaces the old.
+#define BAKE_CHECKPOINT_NEW_SUFFIX ".new"
+
+typedef struct BakeCheckpointHeader {
+  uint32 magic;
+  uint32 version;
+  uint64 scene_hash;
+  uint32 lightmap_count;
+  uint32 reserved;
+  uint64 total_size;
+} BakeCheckpointHeader;
+
+typedef struct BakeCheckpointRecord {
+  uint32 lightmap;
+  uint32 reserved;
+} BakeCheckpointRecord;
+
+BakeCheckpoint::BakeCheckpoint() : file_(NULL) {}
+
+BakeCheckpoint::~BakeCheckpoint() { End(false); }
+
+bool BakeCheckpoint::Load(const ::std::string& filename, uint64 scene_hash,
+                          const ::std::vector<uint64>& lightmap_offsets,
+                          uint8* data, ::std::vector<uint8>* finished) {
+  uint32 lightmap_count = lightmap_offsets.size() - 1;
+  finished->assign(lightmap_count, 0);
+
+  // A crash between removing an old checkpoint and renaming its replacement
+  // leaves only the replacement, which holds every record of the old one.
+  // Finish the rename before reading it.
+  FILE* file_ptr = NULL;
+  fopen_s(&file_ptr, filename.c_str(), "rb");
+  if (!file_ptr) {
+    rename((filename + BAKE_CHECKPOINT_NEW_SUFFIX).c_str(), filename.c_str());
+    fopen_s(&file_ptr, filename.c_str(), "rb");
+  }
+
+  if (!file_ptr) {
+    return false;
+  }
+
+  BakeCheckpointHeader header;
+  if (1 != fread(&header, sizeof(header), 1, file_ptr) ||
+      BAKE_CHECKPOINT_MAGIC != header.magic ||
+      BAKE_CHECKPOINT_VERSION != header.version ||
+      scene_hash != header.scene_hash ||
+      lightmap_count != header.lightmap_count ||
+      lightmap_offsets[lightmap_count] != header.total_size) {
+    fclose(file_ptr);
+    return false;
+  }
+
+  // Read records until the end of the file, or until a record that was cut
+  // short by the interruption.
+  BakeCheckpointRecord record;
+  ::std::vector<uint8> pixels;
+  while (1 == fread(&record, sizeof(record), 1, file_ptr) &&
+         record.lightmap < lightmap_count) {
+    uint64 offset = lightmap_offsets[record.lightmap];
+    uint64 size = lightmap_offsets[record.lightmap + 1] - offset;
+    pixels.resize(size);
+    if (size != fread(pixels.data(), 1, size, file_ptr)) {
+      break;
+    }
+
+    memcpy(data + offset, pixels.data(), size);
+    (*finished)[record.lightmap] = 1;
+  }
+
+  fclose(file_ptr);
+  return true;
+}
+
+bool BakeCheckpoint::Begin(const ::std::string& filename, uint64 scene_hash,
+                           const ::std::vector<uint64>& lightmap_offsets,
+                           const uint8* data,
+                           const ::std::vector<uint8>& finished) {
+  End(false);
+
+  ::std::string new_filename = filename + BAKE_CHECKPOINT_NEW_SUFFIX;
+  fopen_s(&file_, new_filename.c_str(), "wb");
+  if (!file_) {
+    return false;
+  }
+
+  filename_ = new_filename;
+  lightmap_offsets_ = lightmap_offsets;
+  uint32 lightmap_count = lightmap_offsets.size() - 1;
+  BakeCheckpointHeader header = {BAKE_CHECKPOINT_MAGIC,
+                                 BAKE_CHECKPOINT_VERSION,
+                                 scene_hash,
+                                 lightmap_count,
+                                 0,
+                                 lightmap_offsets[lightmap_count]};
+  bool file_valid = 1 == fwrite(&header, sizeof(header), 1, file_);
+  for (uint32 i = 0; i < lightmap_count && file_valid; i++) {
+    if (finished[i]) {
+      file_valid = WriteRecord(i, data + lightmap_offsets[i]);
+    }
+  }
+
+  // The old checkpoint is only replaced once the new one holds all of its
+  // records. The new one is then reopened to append to it.
+  fclose(file_);
+  file_ = NULL;
+  if (!file_valid) {
+    End(true);
+    return false;
+  }
+
+  // Should the rename fail, Load still finds the new checkpoint.
+  remove(filename.c_str());
+  if (rename(new_filename.c_str(), filename.c_str())) {
+    End(false);
+    return false;
+  }
+
+  filename_ = filename;
+  fopen_s(&file_, filename.c_str(), "ab");
+  if (!file_) {
+    End(false);
+    return false;
+  }
+
+  return true;
+}
+
+bool BakeCheckpoint::AddLightmap(uint32 lightmap, const uint8* lightmap_data) {
+  ::std::lock_guard<::std::mutex> lock(mutex_);
+  if (!file_) {
+    return false;
+  }
+
+  return WriteRecord(lightmap, lightmap_data);
+}
+
+bool BakeCheckpoint::WriteRecord(uint32 lightmap, const uint8* lightmap_data) {
+  BakeCheckpointRecord record = {lightmap, 0};
+  uint64 size = lightmap_offsets_[lightmap + 1] - lightmap_offsets_[lightmap];
+  return 1 == fwrite(&record, sizeof(record), 1, file_) &&
+         size == fwrite(lightmap_data, 1, size, file_) && !fflush(file_);
+}
+
+void BakeCheckpoint::End(bool remove_file) {
+  if (file_) {
+    fclose(file_);
+    file_ = NULL;
+  }
+
+  if (remove_file && !filename_.empty()) {
+    remove(filename_.c_str());
+  }
+
+  filename_.clear();
+}
@@ -0,0 +1,92 @@
+/*
+//
+// Copyright (c) 1998-2014 Joe Bertolami. All Right Reserved.
+//
+//   Redistribution and use in source and binary forms, with or without
+//   modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, CLUDG, BUT NOT LIMITED TO, THE
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//   ARE DISCLAIMED.  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//   LIABLE FOR ANY DIRECT, DIRECT, CIDENTAL, SPECIAL, EXEMPLARY, OR
+//   CONSEQUENTIAL DAMAGES (CLUDG, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+//   GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSESS TERRUPTION)
+//   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER  CONTRACT, STRICT
+//   LIABILITY, OR TORT (CLUDG NEGLIGENCE OR OTHERWISE) ARISG  ANY WAY  OF THE
+//   USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Additional Information:
+//
+//   For more information, visit http://www.bertolami.com.
+//
+*/
+
+#ifndef __BAKE_CHECKPOINT_H__
+#define __BAKE_CHECKPOINT_H__
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "jmath/base.h"
+
+using ::base::uint32;
+using ::base::uint64;
+using ::base::uint8;
+
+// A journal of the lightmaps that a bake has finished, from which an
+// interrupted bake can resume. Each finished lightmap is appended as a record
+// holding its index and its pixels in the linear layout, and flushed right
+// away. A crash thus loses at most the record being written, which Load
+// ignores.
+class BakeCheckpoint {
+ public:
+  BakeCheckpoint();
+  ~BakeCheckpoint();
+  // Reads the checkpoint at filename. Lightmap i spans lightmap_offsets[i] up
+  // to lightmap_offsets[i + 1] in data, and is copied there and flagged in
+  // finished if the checkpoint holds it. Returns false if the file could not
+  // be opened or was not written for scene_hash and the same lightmaps.
+  static bool Load(const ::std::string& filename, uint64 scene_hash,
+                   const ::std::vector<uint64>& lightmap_offsets, uint8* data,
+                   ::std::vector<uint8>* finished);
+  // Starts a new checkpoint at filename that holds the lightmaps flagged in
+  // finished, with their pixels read from data. It is written under a
+  // temporary name and only then replaces any file already at filename, so
+  // that the records of an earlier checkpoint survive a crash in between.
+  // Returns false if the file could not be created.
+  bool Begin(const ::std::string& filename, uint64 scene_hash,
+             const ::std::vector<uint64>& lightmap_offsets, const uint8* data,
+             const ::std::vector<uint8>& finished);
+  // Appends a finished lightmap, whose pixels start at lightmap_data. May be
+  // called from any thread. Returns false if the record could not be written.
+  bool AddLightmap(uint32 lightmap, const uint8* lightmap_data);
+  // Closes the checkpoint. It is deleted if remove_file is set, once the bake
+  // no longer needs it.
+  void End(bool remove_file);
+
+ private:
+  // Appends and flushes the record of a lightmap. Expects mutex_ to be held,
+  // or the checkpoint not to be shared yet.
+  bool WriteRecord(uint32 lightmap, const uint8* lightmap_data);
+
+  BakeCheckpoint(const BakeCheckpoint&) = delete;
+  BakeCheckpoint& operator=(const BakeCheckpoint&) = delete;
+
+  ::std::string filename_;
+  FILE* file_;
+  ::std::vector<uint64> lightmap_offsets_;
+  // Serializes the records that workers append.
+  ::std::mutex mutex_;
+};
+
+#endif  // __BAKE_CHECKPOINT_H__
@@ -0,0 +1,77 @@
+#include "bake_progress.h"
+
+#include <chrono>
+#include <iostream>
+
+using ::std::cout;
+using ::std::endl;
+
+// Returns the steady clock time in nanoseconds.
+inline int64 QuerySteadyTime() {
+  return ::std::chrono::duration_cast<::std::chrono::nanoseconds>(
+             ::std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+BakeProgress::BakeProgress()
+    : lumels_done_(0),
+      rays_traced_(0),
+      work_done_(0),
+      next_report_(0),
+      start_time_(0),
+      report_interval_(0),
+      total_lumels_(0),
+      total_work_(0),
+      cancel_(NULL) {}
+
+void BakeProgress::Begin(uint64 total_lumels, float64 total_seconds,
+                         uint32 report_interval_ms,
+                         const ::std::atomic<bool>* cancel) {
+  lumels_done_ = 0;
+  rays_traced_ = 0;
+  work_done_ = 0;
+  start_time_ = QuerySteadyTime();
+  report_interval_ = report_interval_ms * 1000000ll;
+  next_report_ = start_time_ + report_interval_;
+  total_lumels_ = total_lumels;
+  total_work_ = total_seconds * 1.0e6;
+  cancel_ = cancel;
+}
+
+void BakeProgress::AddWork(uint64 lumels, uint64 rays, float64 seconds) {
+  uint64 work = seconds * 1.0e6;
+  uint64 lumels_done =
+      lumels_done_.fetch_add(lumels, ::std::memory_order_relaxed) + lumels;
+  uint64 rays_traced =
+      rays_traced_.fetch_add(rays, ::std::memory_order_relaxed) + rays;
+  uint64 work_done =
+      work_done_.fetch_add(work, ::std::memory_order_relaxed) + work;
+
+  // Only the worker that moves the deadline on prints the line.
+  int64 now = QuerySteadyTime();
+  int64 next_report = next_report_.load(::std::memory_order_relaxed);
+  if (now < next_report ||
+      !next_report_.compare_exchange_strong(next_report,
+                                            now + report_interval_,
+                                            ::std::memory_order_relaxed)) {
+    return;
+  }
+
+  // The estimate may be off by a constant factor, so the time left follows
+  // from the rate at which estimated work has been getting done.
+  float64 elapsed = (now - start_time_) * 1.0e-9;
+  float64 work_left = work_done < total_work_ ? total_work_ - work_done : 0;
+  cout << "Progress: " << (100.0 * lumels_done) / total_lumels_ << "% ("
+       << lumels_done << " of " << total_lumels_ << " lumels), "
+       << (uint64)(rays_traced / elapsed) << " rays/s, about "
+       << (uint64)(work_done ? elapsed * work_left / work_done : 0)
+       << " s left." << endl;
+}
+
+bool BakeProgress::IsCancelled() const {
+  return cancel_ && cancel_->load(::std::memory_order_relaxed);
+}
+
+uint64 BakeProgress::QueryLumelsDone() const { return lumels_done_; }
+
+uint64 BakeProgress::QueryTotalLumels() const { return total_lumels_; }
@@ -0,0 +1,84 @@
+/*
+//
+// Copyright (c) 1998-2014 Joe Bertolami. All Right Reserved.
+//
+//   Redistribution and use in source and binary forms, with or without
+//   modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, CLUDG, BUT NOT LIMITED TO, THE
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//   ARE DISCLAIMED.  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//   LIABLE FOR ANY DIRECT, DIRECT, CIDENTAL, SPECIAL, EXEMPLARY, OR
+//   CONSEQUENTIAL DAMAGES (CLUDG, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+//   GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSESS TERRUPTION)
+//   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER  CONTRACT, STRICT
+//   LIABILITY, OR TORT (CLUDG NEGLIGENCE OR OTHERWISE) ARISG  ANY WAY  OF THE
+//   USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Additional Information:
+//
+//   For more information, visit http://www.bertolami.com.
+//
+*/
+
+#ifndef __BAKE_PROGRESS_H__
+#define __BAKE_PROGRESS_H__
+
+#include <atomic>
+
+#include "jmath/base.h"
+
+using ::base::float64;
+using ::base::int64;
+using ::base::uint32;
+using ::base::uint64;
+
+// Counts the work of a bake as its workers finish it, and reports the bake's
+// progress at a fixed interval. Workers publish their work with relaxed
+// atomics, and whichever worker finds a report due prints it, so that no
+// thread waits on another.
+class BakeProgress {
+ public:
+  BakeProgress();
+  // Starts counting towards total_lumels, printing a progress line at most
+  // every report_interval_ms milliseconds. total_seconds is the estimated
+  // thread time of the whole bake, from which the time left is extrapolated.
+  // If cancel is non-null, the bake is cancelled once it turns true.
+  void Begin(uint64 total_lumels, float64 total_seconds,
+             uint32 report_interval_ms, const ::std::atomic<bool>* cancel);
+  // Adds the lumels and rays that a worker has finished, along with the
+  // estimated thread time of that work, and prints a progress line if one is
+  // due. May be called from any thread.
+  void AddWork(uint64 lumels, uint64 rays, float64 seconds);
+  // Returns true if the bake has been asked to stop. Workers check this at
+  // tile boundaries and drop the rest of their work.
+  bool IsCancelled() const;
+  uint64 QueryLumelsDone() const;
+  uint64 QueryTotalLumels() const;
+
+ private:
+  BakeProgress(const BakeProgress&) = delete;
+  BakeProgress& operator=(const BakeProgress&) = delete;
+
+  ::std::atomic<uint64> lumels_done_;
+  ::std::atomic<uint64> rays_traced_;
+  // The estimated thread time of the finished work, in microseconds.
+  ::std::atomic<uint64> work_done_;
+  // The steady clock time, in nanoseconds, at which the next line is due.
+  ::std::atomic<int64> next_report_;
+  int64 start_time_;
+  int64 report_interval_;
+  uint64 total_lumels_;
+  uint64 total_work_;
+  const ::std::atomic<bool>* cancel_;
+};
+
+#endif  // __BAKE_PROGRESS_H__
@@ -119,10 +119,14 @@ inline uint32 bitmap_greater_multiple(uint32 value, uint32 multiple) {
   return value;
 }
 
-/* Loads a 24 bit RGB bitmap file into a vector. */
-bool LoadBitmapImage(const string& filename, vector<uint8>* output,
-                     uint32* width, uint32* height, string* error = nullptr) {
-  if (filename.empty() || !output) {
+/* Loads a 24 bit RGB bitmap file. The pixels are written to output, which is
+   resized to fit, or if it is null to fixed_output, which must hold exactly
+   fixed_size bytes. */
+inline bool LoadBitmapImageData(const string& filename, vector<uint8>* output,
+                                uint8* fixed_output, uint64 fixed_size,
+                                uint32* width, uint32* height,
+                                string* error) {
+  if (filename.empty() || (!output && !fixed_output)) {
     if (error) {
       *error = "Invalid inputs to LoadBitmapImage.";
     }
@@ -159,10 +163,21 @@ bool LoadBitmapImage(const string& filename, vector<uint8>* output,
   uint32 image_row_pitch = bih.width * 3;
   uint32 image_size = image_row_pitch * bih.height;
 
-  output->resize(image_size);
+  /* The dimensions are reported even if they do not fit fixed_output. */
   *width = bih.width;
   *height = bih.height;
 
+  uint8* image_data = fixed_output;
+  if (output) {
+    output->resize(image_size);
+    image_data = output->data();
+  } else if (image_size != fixed_size) {
+    if (error) {
+      *error = "Bitmap size does not match the destination.\n";
+    }
+    return false;
+  }
+
   /* The BMP format requires each scanline to be 32 bit aligned, so we insert
      padding if necessary. */
   uint32 scanline_padding =
@@ -172,7 +187,7 @@ bool LoadBitmapImage(const string& filename, vector<uint8>* output,
 
   for (uint32 i = 0; i < bih.height; i++) {
     uint32 y_offset = i * row_stride;
-    uint8* dest_row = &output->at(y_offset);
+    uint8* dest_row = image_data + y_offset;
 
     if (!input_file.read((char*)dest_row, row_stride)) {
       if (error) {
@@ -191,26 +206,41 @@ bool LoadBitmapImage(const string& filename, vector<uint8>* output,
 
     /* Swap the R and B channels (as BMP stores its data in BGR). */
     for (uint32 j = 0; j < bih.width; j++) {
-      uint32 x_offset = y_offset + j * 3;
-      uint8 temp_channel = output->at(x_offset + 0);
-      output->at(x_offset + 0) = output->at(x_offset + 2);
-      output->at(x_offset + 2) = temp_channel;
+      uint8 temp_channel = dest_row[j * 3 + 0];
+      dest_row[j * 3 + 0] = dest_row[j * 3 + 2];
+      dest_row[j * 3 + 2] = temp_channel;
     }
   }
 
   return true;
 }
 
-bool SaveBitmapImage(const string& filename, vector<uint8>* input, uint32 width,
-                     uint32 height, string* error = nullptr) {
-  if (filename.empty() || input->empty()) {
+/* Loads a 24 bit RGB bitmap file into a vector. */
+bool LoadBitmapImage(const string& filename, vector<uint8>* output,
+                     uint32* width, uint32* height, string* error = nullptr) {
+  return LoadBitmapImageData(filename, output, nullptr, 0, width, height,
+                             error);
+}
+
+/* Loads a 24 bit RGB bitmap file into a caller owned buffer of exactly
+   output_size bytes. Fails if the image is a different size. */
+bool LoadBitmapImage(const string& filename, uint8* output, uint64 output_size,
+                     uint32* width, uint32* height, string* error = nullptr) {
+  return LoadBitmapImageData(filename, nullptr, output, output_size, width,
+                             height, error);
+}
+
+/* Writes the headers of a 24 bit RGB bitmap file with the given dimensions.
+   WriteBitmapRows must then supply all of its rows, in order. */
+inline bool BeginBitmapImage(ofstream* output_file, uint32 width,
+                             uint32 height, string* error = nullptr) {
+  if (!output_file || !width || !height) {
     if (error) {
-      *error = "Invalid inputs to SaveBitmapImage.";
+      *error = "Invalid inputs to BeginBitmapImage.";
     }
     return false;
   }
 
-  uint32 bytes_written = 0;
   uint32 total_image_bytes = (3 * width) * height;
   uint32 header_size =
       sizeof(PTCX_BITMAP_FILE_HEADER) + sizeof(PTCX_BITMAP_INFO_HEADER);
@@ -231,44 +261,47 @@ bool SaveBitmapImage(const string& filename, vector<uint8>* input, uint32 width,
                                  0,
                                  0};
 
-  ofstream output_file(filename, ::std::ios::out | ::std::ios::binary);
-
-  if (!output_file.write((char*)&bmf_header, sizeof(PTCX_BITMAP_FILE_HEADER))) {
+  if (!output_file->write((char*)&bmf_header,
+                          sizeof(PTCX_BITMAP_FILE_HEADER))) {
     if (error) {
       *error = "Failed to write bitmap file header";
     }
     return false;
   }
 
-  if (!output_file.write((char*)&bih, sizeof(PTCX_BITMAP_INFO_HEADER))) {
+  if (!output_file->write((char*)&bih, sizeof(PTCX_BITMAP_INFO_HEADER))) {
     if (error) {
       *error = "Failed to write bitmap info header.\n";
     }
     return false;
   }
 
-  uint32 image_row_pitch = bih.width * 3;
-  uint32 image_size = image_row_pitch * bih.height;
-  uint32 row_stride = bih.width * 3;
+  return true;
+}
+
+/* Writes row_count rows of 24 bit RGB pixels to a bitmap file begun with
+   BeginBitmapImage. The input is left unchanged. */
+inline bool WriteBitmapRows(ofstream* output_file, const uint8* input,
+                            uint32 width, uint32 row_count,
+                            string* error = nullptr) {
+  uint32 row_stride = width * 3;
 
   /* The BMP format requires each scanline to be 32 bit aligned, so we insert
      padding if necessary. */
-  uint32 scanline_padding =
-      bitmap_greater_multiple(bih.width * 3, 4) - (bih.width * 3);
+  uint32 scanline_padding = bitmap_greater_multiple(width * 3, 4) - (width * 3);
 
-  for (uint32 i = 0; i < bih.height; i++) {
-    uint32 y_offset = i * row_stride;
-    uint8* src_row = &input->at(y_offset);
+  vector<uint8> src_row(row_stride);
+  for (uint32 i = 0; i < row_count; i++) {
+    const uint8* input_row = input + (uint64)i * row_stride;
 
     /* Swap the R and B channels (as BMP stores its data in BGR). */
-    for (uint32 j = 0; j < bih.width; j++) {
-      uint32 x_offset = y_offset + j * 3;
-      uint8 temp_channel = input->at(x_offset + 0);
-      input->at(x_offset + 0) = input->at(x_offset + 2);
-      input->at(x_offset + 2) = temp_channel;
+    for (uint32 j = 0; j < width; j++) {
+      src_row[j * 3 + 0] = input_row[j * 3 + 2];
+      src_row[j * 3 + 1] = input_row[j * 3 + 1];
+      src_row[j * 3 + 2] = input_row[j * 3 + 0];
     }
 
-    if (!output_file.write((char*)src_row, row_stride)) {
+    if (!output_file->write((char*)src_row.data(), row_stride)) {
       if (error) {
         *error = "Abrupt error writing file.\n";
       }
@@ -276,7 +309,7 @@ bool SaveBitmapImage(const string& filename, vector<uint8>* input, uint32 width,
     }
 
     uint32 dummy = 0; /* Padding will always be < 4 bytes. */
-    if (!output_file.write((char*)&dummy, scanline_padding)) {
+    if (!output_file->write((char*)&dummy, scanline_padding)) {
       if (error) {
         *error = "Abrupt error writing file.\n";
       }
@@ -287,6 +320,35 @@ bool SaveBitmapImage(const string& filename, vector<uint8>* input, uint32 width,
   return true;
 }
 
+/* Saves 24 bit RGB pixels to a bitmap file. The input is left unchanged. */
+bool SaveBitmapImage(const string& filename, const uint8* input, uint32 width,
+                     uint32 height, string* error = nullptr) {
+  if (filename.empty() || !input || !width || !height) {
+    if (error) {
+      *error = "Invalid inputs to SaveBitmapImage.";
+    }
+    return false;
+  }
+
+  ofstream output_file(filename, ::std::ios::out | ::std::ios::binary);
+
+  return BeginBitmapImage(&output_file, width, height, error) &&
+         WriteBitmapRows(&output_file, input, width, height, error);
+}
+
+/* Saves a vector of 24 bit RGB pixels to a bitmap file. */
+bool SaveBitmapImage(const string& filename, vector<uint8>* input, uint32 width,
+                     uint32 height, string* error = nullptr) {
+  if (!input || input->empty()) {
+    if (error) {
+      *error = "Invalid inputs to SaveBitmapImage.";
+    }
+    return false;
+  }
+
+  return SaveBitmapImage(filename, input->data(), width, height, error);
+}
+
 }  // namespace base
 
 #endif  // __BITMAP_H__
\ No newline at end of file
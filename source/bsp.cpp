@@ -0,0 +1,1180 @@
+#include "bsp.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+
+// The deepest the tree may grow. Triangles that reach this depth stay in
+// their leaf unsplit, where they no longer block any portal.
+#define BSP_MAX_DEPTH (256)
+// The number of triangle planes scored when choosing each splitter, and the
+// number of triangles each candidate is scored against.
+#define BSP_SPLITTER_CANDIDATES (32)
+#define BSP_SPLITTER_SAMPLES (1024)
+// The balance penalty equivalent to splitting one triangle.
+#define BSP_SPLIT_COST (4)
+// Plane tests treat points within this fraction of the scene's size as lying
+// on the plane.
+#define BSP_EPSILON_RATIO (1.0e-5)
+// Separating planes are only trusted when the portals they separate lie on
+// their sides to within this much tighter fraction of the scene's size.
+#define BSP_SEPARATOR_EPSILON_RATIO (1.0e-9)
+// Portals cover the scene's bounds grown by this fraction of its size on each
+// side, so the PVS also holds for lights and viewers a little way outside.
+#define BSP_PORTAL_MARGIN_RATIO (1.0)
+// Trees with more leaves than this skip the PVS, whose cost grows with the
+// square of the leaf count.
+#define BSP_MAX_VISIBILITY_LEAVES (8192)
+// The number of portals a single flow may step through before it gives up and
+// marks every leaf it might see as visible.
+#define BSP_MAX_FLOW_STEPS (256)
+
+typedef struct BspPoint {
+  float64 v[3];
+} BspPoint;
+
+// A convex polygon, in order.
+typedef ::std::vector<BspPoint> BspWinding;
+
+// A piece of a triangle that has been pushed down the tree.
+typedef struct BspFragment {
+  uint32 triangle;
+  BspWinding winding;
+} BspFragment;
+
+// A portal seen from one of its sides: looking out of from_leaf into to_leaf,
+// which lies in front of plane.
+typedef struct BspPortalSide {
+  uint32 portal;
+  uint32 from_leaf;
+  uint32 to_leaf;
+  BspPlane plane;
+  const BspWinding* winding;
+} BspPortalSide;
+
+// The state shared by the stages of a build.
+typedef struct BspBuildState {
+  const ::std::vector<uint8>* blockers;
+  ::std::vector<BspPlane> triangle_planes;
+  // The blocking fragments that lie on each node's plane.
+  ::std::vector<::std::vector<BspWinding>> node_faces;
+  // Each portal's winding, the node plane it lies on, and the leaves in front
+  // of and behind it.
+  ::std::vector<BspWinding> portal_windings;
+  ::std::vector<BspPlane> portal_planes;
+  ::std::vector<uint32> portal_leaves;
+  float64 scene_min[3];
+  float64 scene_max[3];
+} BspBuildState;
+
+inline BspPoint MakePoint(const vector3& point) {
+  BspPoint result = {{point.x, point.y, point.z}};
+  return result;
+}
+
+inline float64 PlaneDistance(const BspPlane& plane, const BspPoint& point) {
+  return plane.normal[0] * point.v[0] + plane.normal[1] * point.v[1] +
+         plane.normal[2] * point.v[2] - plane.distance;
+}
+
+inline BspPlane FlipPlane(const BspPlane& plane) {
+  BspPlane result = {{-plane.normal[0], -plane.normal[1], -plane.normal[2]},
+                     -plane.distance};
+  return result;
+}
+
+inline void Cross(const float64* a, const float64* b, float64* result) {
+  result[0] = a[1] * b[2] - a[2] * b[1];
+  result[1] = a[2] * b[0] - a[0] * b[2];
+  result[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// Builds the plane through point with the given normal, scaled to unit length.
+// Returns false if the normal is shorter than min_length.
+inline bool MakePlane(const float64* normal, const BspPoint& point,
+                      float64 min_length, BspPlane* plane) {
+  float64 length = sqrt(normal[0] * normal[0] + normal[1] * normal[1] +
+                        normal[2] * normal[2]);
+  if (length <= min_length) {
+    return false;
+  }
+
+  for (uint32 axis = 0; axis < 3; axis++) {
+    plane->normal[axis] = normal[axis] / length;
+  }
+  plane->distance = plane->normal[0] * point.v[0] +
+                    plane->normal[1] * point.v[1] +
+                    plane->normal[2] * point.v[2];
+  return true;
+}
+
+// Writes the part of winding where the plane distance is at least -offset to
+// result. A single point or a segment is clipped the same way.
+void ClipWinding(const BspWinding& winding, const BspPlane& plane,
+                 float64 offset, BspWinding* result) {
+  result->clear();
+  uint32 count = winding.size();
+  if (1 == count) {
+    if (PlaneDistance(plane, winding[0]) >= -offset) {
+      result->push_back(winding[0]);
+    }
+    return;
+  }
+
+  for (uint32 i = 0; i < count; i++) {
+    const BspPoint& a = winding[i];
+    const BspPoint& b = winding[(i + 1) % count];
+    float64 da = PlaneDistance(plane, a) + offset;
+    float64 db = PlaneDistance(plane, b) + offset;
+
+    if (da >= 0) {
+      result->push_back(a);
+    }
+
+    if ((da >= 0) != (db >= 0)) {
+      float64 t = da / (da - db);
+      BspPoint crossing;
+      for (uint32 axis = 0; axis < 3; axis++) {
+        crossing.v[axis] = a.v[axis] + (b.v[axis] - a.v[axis]) * t;
+      }
+      result->push_back(crossing);
+    }
+  }
+}
+
+// Returns a square on plane that is larger than the scene, clipped to the
+// scene's bounds grown by margin.
+BspWinding MakeBaseWinding(const BspPlane& plane, const BspBuildState& state,
+                           float64 margin) {
+  // Choose an up vector that is far from the plane's normal.
+  uint32 major_axis = 0;
+  for (uint32 axis = 1; axis < 3; axis++) {
+    if (fabs(plane.normal[axis]) > fabs(plane.normal[major_axis])) {
+      major_axis = axis;
+    }
+  }
+
+  float64 up[3] = {0, 0, 0};
+  up[2 == major_axis ? 0 : 2] = 1;
+  float64 along = up[0] * plane.normal[0] + up[1] * plane.normal[1] +
+                  up[2] * plane.normal[2];
+  float64 size = margin;
+  BspPoint center;
+  for (uint32 axis = 0; axis < 3; axis++) {
+    up[axis] -= plane.normal[axis] * along;
+    size += state.scene_max[axis] - state.scene_min[axis];
+    center.v[axis] = 0.5 * (state.scene_min[axis] + state.scene_max[axis]);
+  }
+
+  // Center the square on the point of the plane nearest the scene's center.
+  float64 center_distance = PlaneDistance(plane, center);
+  for (uint32 axis = 0; axis < 3; axis++) {
+    center.v[axis] -= plane.normal[axis] * center_distance;
+  }
+
+  float64 up_length = sqrt(up[0] * up[0] + up[1] * up[1] + up[2] * up[2]);
+  float64 right[3];
+  for (uint32 axis = 0; axis < 3; axis++) {
+    up[axis] *= size / up_length;
+  }
+  Cross(up, plane.normal, right);
+
+  BspWinding winding(4);
+  for (uint32 axis = 0; axis < 3; axis++) {
+    winding[0].v[axis] = center.v[axis] - right[axis] + up[axis];
+    winding[1].v[axis] = center.v[axis] + right[axis] + up[axis];
+    winding[2].v[axis] = center.v[axis] + right[axis] - up[axis];
+    winding[3].v[axis] = center.v[axis] - right[axis] - up[axis];
+  }
+
+  BspWinding clipped;
+  for (uint32 axis = 0; axis < 3 && !winding.empty(); axis++) {
+    BspPlane lower = {{0, 0, 0}, state.scene_min[axis] - margin};
+    BspPlane upper = {{0, 0, 0}, -(state.scene_max[axis] + margin)};
+    lower.normal[axis] = 1;
+    upper.normal[axis] = -1;
+    ClipWinding(winding, lower, 0, &clipped);
+    ClipWinding(clipped, upper, 0, &winding);
+  }
+
+  return winding;
+}
+
+// Returns true if the winding has an area worth keeping.
+inline bool IsWindingSignificant(const BspWinding& winding, float64 epsilon) {
+  if (winding.size() < 3) {
+    return false;
+  }
+
+  float64 area[3] = {0, 0, 0};
+  for (uint32 i = 2; i < winding.size(); i++) {
+    float64 a[3], b[3], normal[3];
+    for (uint32 axis = 0; axis < 3; axis++) {
+      a[axis] = winding[i - 1].v[axis] - winding[0].v[axis];
+      b[axis] = winding[i].v[axis] - winding[0].v[axis];
+    }
+    Cross(a, b, normal);
+    for (uint32 axis = 0; axis < 3; axis++) {
+      area[axis] += normal[axis];
+    }
+  }
+
+  return area[0] * area[0] + area[1] * area[1] + area[2] * area[2] >
+         4.0 * epsilon * epsilon * epsilon * epsilon;
+}
+
+// Classifies a winding against a plane: 1 if it lies in front, -1 if it lies
+// behind, 0 if it lies on the plane and 2 if it spans the plane.
+inline int32 ClassifyWinding(const BspWinding& winding, const BspPlane& plane,
+                             float64 epsilon) {
+  bool front = false;
+  bool back = false;
+  for (const BspPoint& point : winding) {
+    float64 distance = PlaneDistance(plane, point);
+    front |= distance > epsilon;
+    back |= distance < -epsilon;
+  }
+
+  return front && back ? 2 : front ? 1 : back ? -1 : 0;
+}
+
+// Clips target to the planes that separate source from pass, so that only the
+// parts of target that some line from source through pass could reach
+// remain. If flip_clip is set the opposite side of each plane is kept, which
+// clips to the planes separating pass from source instead.
+void ClipToSeparators(const BspWinding& source, const BspWinding& pass,
+                      bool flip_clip, float64 separator_epsilon,
+                      float64 clip_epsilon, BspWinding* target) {
+  BspWinding clipped;
+
+  for (uint32 i = 0; i < source.size() && !target->empty(); i++) {
+    uint32 l = (i + 1) % source.size();
+    float64 edge[3];
+    for (uint32 axis = 0; axis < 3; axis++) {
+      edge[axis] = source[l].v[axis] - source[i].v[axis];
+    }
+
+    for (uint32 j = 0; j < pass.size() && !target->empty(); j++) {
+      float64 to_pass[3], normal[3];
+      for (uint32 axis = 0; axis < 3; axis++) {
+        to_pass[axis] = pass[j].v[axis] - source[i].v[axis];
+      }
+      Cross(edge, to_pass, normal);
+
+      BspPlane plane;
+      if (!MakePlane(normal, pass[j], separator_epsilon, &plane)) {
+        continue;
+      }
+
+      // Orient the plane so that the source lies behind it.
+      int32 source_side = 0;
+      for (uint32 k = 0; k < source.size() && !source_side; k++) {
+        float64 distance = PlaneDistance(plane, source[k]);
+        source_side = distance > separator_epsilon    ? 1
+                      : distance < -separator_epsilon ? -1
+                                                      : 0;
+      }
+
+      if (!source_side) {
+        continue;
+      }
+
+      if (source_side > 0) {
+        plane = FlipPlane(plane);
+      }
+
+      // The plane separates the portals if every source point lies behind it
+      // and every pass point in front of it.
+      bool separates = true;
+      bool pass_in_front = false;
+      for (uint32 k = 0; k < source.size() && separates; k++) {
+        separates = PlaneDistance(plane, source[k]) <= separator_epsilon;
+      }
+      for (uint32 k = 0; k < pass.size() && separates; k++) {
+        float64 distance = PlaneDistance(plane, pass[k]);
+        separates = distance >= -separator_epsilon;
+        pass_in_front |= distance > separator_epsilon;
+      }
+
+      if (!separates || !pass_in_front) {
+        continue;
+      }
+
+      if (flip_clip) {
+        plane = FlipPlane(plane);
+      }
+
+      ClipWinding(*target, plane, clip_epsilon, &clipped);
+      target->swap(clipped);
+    }
+  }
+}
+
+BspTree::BspTree() : leaf_count_(0), portal_count_(0), epsilon_(0) {
+  for (uint32 axis = 0; axis < 3; axis++) {
+    portal_min_[axis] = portal_max_[axis] = 0;
+  }
+}
+
+void BspTree::Clear() {
+  nodes_.clear();
+  leaf_count_ = 0;
+  portal_count_ = 0;
+  epsilon_ = 0;
+  for (uint32 axis = 0; axis < 3; axis++) {
+    portal_min_[axis] = portal_max_[axis] = 0;
+  }
+  triangle_offsets_.clear();
+  triangle_leaves_.clear();
+  visibility_.clear();
+}
+
+bool BspTree::IsEmpty() const { return nodes_.empty(); }
+
+bool BspTree::HasVisibility() const { return !visibility_.empty(); }
+
+bool BspTree::IsPointCovered(const vector3& point) const {
+  for (uint32 axis = 0; axis < 3; axis++) {
+    if (point[axis] < portal_min_[axis] || point[axis] > portal_max_[axis]) {
+      return false;
+    }
+  }
+
+  return !IsEmpty();
+}
+
+uint32 BspTree::QueryLeafWords() const { return (leaf_count_ + 63) / 64; }
+
+uint32 BspTree::QueryNodeCount() const { return nodes_.size(); }
+
+uint32 BspTree::QueryLeafCount() const { return leaf_count_; }
+
+uint32 BspTree::QueryPortalCount() const { return portal_count_; }
+
+float32 BspTree::QueryAverageVisibility() const {
+  if (visibility_.empty()) {
+    return 1.0f;
+  }
+
+  uint64 visible_count = 0;
+  for (uint64 word : visibility_) {
+    for (; word; word &= word - 1) {
+      visible_count++;
+    }
+  }
+
+  return (float64)visible_count / ((float64)leaf_count_ * leaf_count_);
+}
+
+uint64 BspTree::QueryMemoryUsage() const {
+  return nodes_.size() * sizeof(BspNode) +
+         (triangle_offsets_.size() + triangle_leaves_.size()) * sizeof(uint32) +
+         visibility_.size() * sizeof(uint64);
+}
+
+// Builds the subtree over fragments and returns its child index (a node index
+// or ~leaf).
+static int32 BuildBspSubtree(::std::vector<BspNode>* nodes,
+                             uint32* leaf_count, BspBuildState* state,
+                             ::std::vector<BspFragment>* fragments,
+                             float64 epsilon, uint32 depth) {
+  if (fragments->empty() || depth >= BSP_MAX_DEPTH) {
+    return ~(int32)(*leaf_count)++;
+  }
+
+  // Score a spread of candidate planes by the fragments they would split and
+  // the imbalance they would leave, against a spread of the fragments.
+  uint32 count = fragments->size();
+  uint32 candidate_stride = max(1u, count / BSP_SPLITTER_CANDIDATES);
+  uint32 sample_stride = max(1u, count / BSP_SPLITTER_SAMPLES);
+  uint32 best_candidate = 0;
+  int32 best_score = BASE_MAX_INT32;
+
+  for (uint32 c = 0; c < count; c += candidate_stride) {
+    const BspPlane& plane = state->triangle_planes[(*fragments)[c].triangle];
+    int32 front = 0, back = 0, split = 0;
+    for (uint32 s = 0; s < count; s += sample_stride) {
+      switch (ClassifyWinding((*fragments)[s].winding, plane, epsilon)) {
+        case 1: front++; break;
+        case -1: back++; break;
+        case 2: split++; break;
+      }
+    }
+
+    int32 score = split * BSP_SPLIT_COST + abs(front - back);
+    if (score < best_score) {
+      best_score = score;
+      best_candidate = c;
+    }
+  }
+
+  uint32 node_index = nodes->size();
+  BspNode node;
+  node.plane = state->triangle_planes[(*fragments)[best_candidate].triangle];
+  nodes->push_back(node);
+  state->node_faces.emplace_back();
+
+  ::std::vector<BspFragment> front_fragments;
+  ::std::vector<BspFragment> back_fragments;
+  BspPlane back_plane = FlipPlane(node.plane);
+
+  for (BspFragment& fragment : *fragments) {
+    switch (ClassifyWinding(fragment.winding, node.plane, epsilon)) {
+      case 0:
+        if ((*state->blockers)[fragment.triangle]) {
+          state->node_faces[node_index].push_back(fragment.winding);
+        }
+        break;
+      case 1:
+        front_fragments.push_back(::std::move(fragment));
+        break;
+      case -1:
+        back_fragments.push_back(::std::move(fragment));
+        break;
+      default: {
+        BspFragment piece;
+        piece.triangle = fragment.triangle;
+        ClipWinding(fragment.winding, node.plane, 0, &piece.winding);
+        if (piece.winding.size() >= 3) {
+          front_fragments.push_back(piece);
+        }
+        ClipWinding(fragment.winding, back_plane, 0, &piece.winding);
+        if (piece.winding.size() >= 3) {
+          back_fragments.push_back(piece);
+        }
+      } break;
+    }
+  }
+
+  fragments->clear();
+  fragments->shrink_to_fit();
+
+  int32 front_child = BuildBspSubtree(nodes, leaf_count, state,
+                                      &front_fragments, epsilon, depth + 1);
+  int32 back_child = BuildBspSubtree(nodes, leaf_count, state, &back_fragments,
+                                     epsilon, depth + 1);
+  (*nodes)[node_index].children[0] = front_child;
+  (*nodes)[node_index].children[1] = back_child;
+  return node_index;
+}
+
+// Pushes a winding lying on some node's plane down the subtree at child,
+// appending the leaves it reaches and the piece that reaches each one.
+static void PushBspPortal(const ::std::vector<BspNode>& nodes, int32 child,
+                          const BspWinding& winding, float64 epsilon,
+                          ::std::vector<uint32>* leaves,
+                          ::std::vector<BspWinding>* pieces) {
+  if (child < 0) {
+    leaves->push_back(~child);
+    pieces->push_back(winding);
+    return;
+  }
+
+  const BspNode& node = nodes[child];
+  switch (ClassifyWinding(winding, node.plane, epsilon)) {
+    case 1:
+      PushBspPortal(nodes, node.children[0], winding, epsilon, leaves, pieces);
+      break;
+    case -1:
+      PushBspPortal(nodes, node.children[1], winding, epsilon, leaves, pieces);
+      break;
+    case 0:
+      // A portal on the node's plane borders both sides.
+      PushBspPortal(nodes, node.children[0], winding, epsilon, leaves, pieces);
+      PushBspPortal(nodes, node.children[1], winding, epsilon, leaves, pieces);
+      break;
+    default: {
+      BspWinding piece;
+      ClipWinding(winding, node.plane, 0, &piece);
+      if (IsWindingSignificant(piece, epsilon)) {
+        PushBspPortal(nodes, node.children[0], piece, epsilon, leaves, pieces);
+      }
+      ClipWinding(winding, FlipPlane(node.plane), 0, &piece);
+      if (IsWindingSignificant(piece, epsilon)) {
+        PushBspPortal(nodes, node.children[1], piece, epsilon, leaves, pieces);
+      }
+    } break;
+  }
+}
+
+// Finds the portals that lie on the plane of each node in the subtree.
+// region holds the planes that bound the node's region, facing inwards.
+static void MakeBspPortals(const ::std::vector<BspNode>& nodes,
+                           uint32 node_index, BspBuildState* state,
+                           ::std::vector<BspPlane>* region, float64 epsilon) {
+  const BspNode& node = nodes[node_index];
+
+  // Start with the node's plane within its region. The region is not grown,
+  // since a portal reaching past it could slip beneath a triangle that meets
+  // the region's boundary.
+  BspWinding winding = MakeBaseWinding(node.plane, *state, 0);
+  BspWinding clipped;
+  for (uint32 i = 0; i < region->size() && !winding.empty(); i++) {
+    ClipWinding(winding, (*region)[i], 0, &clipped);
+    winding.swap(clipped);
+  }
+
+  // Remove the blocking triangles that lie on the plane. Triangles are
+  // removed exactly, since shrinking them would open a gap along every edge
+  // that two of them share.
+  ::std::vector<BspWinding> pieces;
+  if (IsWindingSignificant(winding, epsilon)) {
+    pieces.push_back(winding);
+  }
+
+  for (const BspWinding& face : state->node_faces[node_index]) {
+    BspPoint center = {{0, 0, 0}};
+    for (const BspPoint& point : face) {
+      for (uint32 axis = 0; axis < 3; axis++) {
+        center.v[axis] += point.v[axis] / face.size();
+      }
+    }
+
+    ::std::vector<BspWinding> remaining;
+    for (BspWinding& piece : pieces) {
+      for (uint32 i = 0; i < face.size() && !piece.empty(); i++) {
+        const BspPoint& a = face[i];
+        const BspPoint& b = face[(i + 1) % face.size()];
+        float64 edge[3], normal[3];
+        for (uint32 axis = 0; axis < 3; axis++) {
+          edge[axis] = b.v[axis] - a.v[axis];
+        }
+        Cross(edge, node.plane.normal, normal);
+
+        BspPlane edge_plane;
+        if (!MakePlane(normal, a, 0, &edge_plane)) {
+          continue;
+        }
+        if (PlaneDistance(edge_plane, center) > 0) {
+          edge_plane = FlipPlane(edge_plane);
+        }
+
+        // Keep what lies outside this edge and carry on with the rest.
+        BspWinding outside;
+        ClipWinding(piece, edge_plane, 0, &outside);
+        if (IsWindingSignificant(outside, epsilon)) {
+          remaining.push_back(outside);
+        }
+        ClipWinding(piece, FlipPlane(edge_plane), 0, &clipped);
+        piece.swap(clipped);
+      }
+    }
+    pieces.swap(remaining);
+  }
+
+  // Split each piece among the leaves on either side of the plane.
+  for (const BspWinding& piece : pieces) {
+    ::std::vector<uint32> front_leaves;
+    ::std::vector<BspWinding> front_pieces;
+    PushBspPortal(nodes, node.children[0], piece, epsilon, &front_leaves,
+                  &front_pieces);
+
+    for (uint32 i = 0; i < front_leaves.size(); i++) {
+      ::std::vector<uint32> back_leaves;
+      ::std::vector<BspWinding> back_pieces;
+      PushBspPortal(nodes, node.children[1], front_pieces[i], epsilon,
+                    &back_leaves, &back_pieces);
+
+      for (uint32 j = 0; j < back_leaves.size(); j++) {
+        state->portal_windings.push_back(back_pieces[j]);
+        state->portal_planes.push_back(node.plane);
+        state->portal_leaves.push_back(front_leaves[i]);
+        state->portal_leaves.push_back(back_leaves[j]);
+      }
+    }
+  }
+
+  for (uint32 side = 0; side < 2; side++) {
+    if (node.children[side] >= 0) {
+      region->push_back(side ? FlipPlane(node.plane) : node.plane);
+      MakeBspPortals(nodes, node.children[side], state, region, epsilon);
+      region->pop_back();
+    }
+  }
+}
+
+// Joins two windings with the same orientation on the same plane into their
+// union, if they share an edge and the union is convex to within epsilon.
+static bool TryMergeWindings(const BspWinding& a, const BspWinding& b,
+                             const BspPlane& plane, float64 epsilon,
+                             BspWinding* merged) {
+  auto same_point = [epsilon](const BspPoint& p, const BspPoint& q) {
+    return fabs(p.v[0] - q.v[0]) <= epsilon &&
+           fabs(p.v[1] - q.v[1]) <= epsilon &&
+           fabs(p.v[2] - q.v[2]) <= epsilon;
+  };
+
+  uint32 a_count = a.size();
+  uint32 b_count = b.size();
+  for (uint32 i = 0; i < a_count; i++) {
+    for (uint32 j = 0; j < b_count; j++) {
+      // The shared edge runs one way around a and the other way around b.
+      if (!same_point(a[i], b[(j + 1) % b_count]) ||
+          !same_point(a[(i + 1) % a_count], b[j])) {
+        continue;
+      }
+
+      BspWinding joined;
+      for (uint32 k = 1; k <= a_count; k++) {
+        joined.push_back(a[(i + k) % a_count]);
+      }
+      for (uint32 k = 2; k < b_count; k++) {
+        joined.push_back(b[(j + k) % b_count]);
+      }
+
+      // Windings face the same way as the portal's base winding, which faces
+      // against the plane, so a convex corner turns against the normal. Drop
+      // corners that are straight to within epsilon.
+      merged->clear();
+      uint32 count = joined.size();
+      for (uint32 k = 0; k < count; k++) {
+        const BspPoint& previous = joined[(k + count - 1) % count];
+        const BspPoint& next = joined[(k + 1) % count];
+        float64 in[3], out[3], turn[3];
+        for (uint32 axis = 0; axis < 3; axis++) {
+          in[axis] = joined[k].v[axis] - previous.v[axis];
+          out[axis] = next.v[axis] - previous.v[axis];
+        }
+        Cross(in, out, turn);
+        float64 in_length =
+            sqrt(in[0] * in[0] + in[1] * in[1] + in[2] * in[2]);
+        float64 bend = -(turn[0] * plane.normal[0] +
+                         turn[1] * plane.normal[1] +
+                         turn[2] * plane.normal[2]);
+        if (bend < -epsilon * in_length) {
+          return false;
+        }
+        if (bend > epsilon * in_length) {
+          merged->push_back(joined[k]);
+        }
+      }
+
+      return merged->size() >= 3;
+    }
+  }
+
+  return false;
+}
+
+// Merges the portals between each pair of leaves on each plane wherever their
+// union is convex, undoing most of the fragmentation left by removing faces.
+static void MergeBspPortals(BspBuildState* state, float64 epsilon) {
+  ::std::vector<uint32> order(state->portal_windings.size());
+  for (uint32 i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+
+  auto same_group = [state](uint32 a, uint32 b) {
+    return state->portal_leaves[a * 2] == state->portal_leaves[b * 2] &&
+           state->portal_leaves[a * 2 + 1] == state->portal_leaves[b * 2 + 1] &&
+           !memcmp(&state->portal_planes[a], &state->portal_planes[b],
+                   sizeof(BspPlane));
+  };
+  ::std::stable_sort(order.begin(), order.end(), [state](uint32 a, uint32 b) {
+    if (state->portal_leaves[a * 2] != state->portal_leaves[b * 2]) {
+      return state->portal_leaves[a * 2] < state->portal_leaves[b * 2];
+    }
+    return state->portal_leaves[a * 2 + 1] < state->portal_leaves[b * 2 + 1];
+  });
+
+  ::std::vector<BspWinding> windings;
+  ::std::vector<BspPlane> planes;
+  ::std::vector<uint32> leaves;
+  BspWinding merged;
+
+  for (uint32 start = 0, end = 0; start < order.size(); start = end) {
+    ::std::vector<BspWinding> group;
+    for (end = start;
+         end < order.size() && same_group(order[start], order[end]); end++) {
+      group.push_back(state->portal_windings[order[end]]);
+    }
+
+    for (uint32 i = 0; i < group.size(); i++) {
+      for (uint32 j = i + 1; j < group.size(); j++) {
+        if (TryMergeWindings(group[i], group[j],
+                             state->portal_planes[order[start]], epsilon,
+                             &merged)) {
+          group[i].swap(merged);
+          group.erase(group.begin() + j);
+          j = i;
+        }
+      }
+    }
+
+    for (BspWinding& winding : group) {
+      windings.push_back(::std::move(winding));
+      planes.push_back(state->portal_planes[order[start]]);
+      leaves.push_back(state->portal_leaves[order[start] * 2]);
+      leaves.push_back(state->portal_leaves[order[start] * 2 + 1]);
+    }
+  }
+
+  state->portal_windings.swap(windings);
+  state->portal_planes.swap(planes);
+  state->portal_leaves.swap(leaves);
+}
+
+// The state of one flow through the portals, from a single portal side.
+typedef struct BspFlow {
+  const ::std::vector<BspPortalSide>* sides;
+  const ::std::vector<uint32>* side_offsets;
+  const ::std::vector<uint64>* might_see;
+  // Sides whose flow has finished, and the leaves each side sees. A finished
+  // side's exact set stands in for its might see set.
+  const ::std::vector<uint8>* side_done;
+  const ::std::vector<uint64>* side_visible;
+  uint32 words;
+  float64 epsilon;
+  float64 separator_epsilon;
+  // The side the flow started from.
+  const BspPortalSide* start;
+  uint64* visible;
+  ::std::vector<uint8> on_stack;
+  uint32 steps;
+  // The source and pass windings that each side has been entered with. A
+  // later entry within both of an earlier entry's windings can only find
+  // leaves that the earlier one already found.
+  ::std::unordered_map<uint32,
+                       ::std::vector<::std::pair<BspWinding, BspWinding>>>
+      entries;
+} BspFlow;
+
+// Returns true if every point of inner lies within the convex winding outer,
+// to within epsilon.
+static bool WindingContains(const BspWinding& outer, const BspWinding& inner,
+                            float64 epsilon) {
+  if (outer.size() < 3) {
+    return false;
+  }
+
+  float64 normal[3] = {0, 0, 0};
+  BspPoint center = {{0, 0, 0}};
+  for (uint32 i = 0; i < outer.size(); i++) {
+    const BspPoint& a = outer[i];
+    const BspPoint& b = outer[(i + 1) % outer.size()];
+    normal[0] += (a.v[1] - b.v[1]) * (a.v[2] + b.v[2]);
+    normal[1] += (a.v[2] - b.v[2]) * (a.v[0] + b.v[0]);
+    normal[2] += (a.v[0] - b.v[0]) * (a.v[1] + b.v[1]);
+    for (uint32 axis = 0; axis < 3; axis++) {
+      center.v[axis] += a.v[axis] / outer.size();
+    }
+  }
+
+  for (uint32 i = 0; i < outer.size(); i++) {
+    const BspPoint& a = outer[i];
+    const BspPoint& b = outer[(i + 1) % outer.size()];
+    float64 edge[3], edge_normal[3];
+    for (uint32 axis = 0; axis < 3; axis++) {
+      edge[axis] = b.v[axis] - a.v[axis];
+    }
+    Cross(edge, normal, edge_normal);
+
+    BspPlane edge_plane;
+    if (!MakePlane(edge_normal, a, 0, &edge_plane)) {
+      continue;
+    }
+    if (PlaneDistance(edge_plane, center) > 0) {
+      edge_plane = FlipPlane(edge_plane);
+    }
+
+    for (const BspPoint& point : inner) {
+      if (PlaneDistance(edge_plane, point) > epsilon) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+// Marks leaf as visible through the flow's start portal and continues
+// through each of its portals that the source can see through pass. previous
+// is the side the flow entered leaf through.
+static bool RecursiveBspFlow(BspFlow* flow, uint32 leaf,
+                             const BspPortalSide* previous,
+                             const BspWinding& source, const BspWinding& pass,
+                             const uint64* might) {
+  flow->visible[leaf / 64] |= 1ull << (leaf % 64);
+  flow->on_stack[leaf] = 1;
+
+  ::std::vector<uint64> next_might(flow->words);
+  BspWinding next_source, next_pass, clipped;
+  bool completed = true;
+
+  for (uint32 s = (*flow->side_offsets)[leaf];
+       s < (*flow->side_offsets)[leaf + 1] && completed; s++) {
+    const BspPortalSide& side = (*flow->sides)[s];
+    uint32 target = side.to_leaf;
+    if (side.portal == previous->portal || flow->on_stack[target] ||
+        !(might[target / 64] & (1ull << (target % 64)))) {
+      continue;
+    }
+
+    // Skip portals that cannot lead anywhere we haven't already seen.
+    const uint64* side_might = (*flow->side_done)[s]
+                                   ? &(*flow->side_visible)[s * flow->words]
+                                   : &(*flow->might_see)[s * flow->words];
+    bool more = !(flow->visible[target / 64] & (1ull << (target % 64)));
+    for (uint32 w = 0; w < flow->words; w++) {
+      next_might[w] = might[w] & side_might[w];
+      more |= (next_might[w] & ~flow->visible[w]) != 0;
+    }
+
+    if (!more) {
+      continue;
+    }
+
+    if (++flow->steps > BSP_MAX_FLOW_STEPS) {
+      completed = false;
+      break;
+    }
+
+    // Only the part of the next portal in front of the start portal can be
+    // seen through it, from the part of the source behind the next portal.
+    ClipWinding(*side.winding, flow->start->plane, flow->epsilon, &next_pass);
+    if (next_pass.size() < 3) {
+      continue;
+    }
+
+    ClipWinding(source, FlipPlane(side.plane), flow->epsilon, &next_source);
+    if (next_source.size() < 3) {
+      continue;
+    }
+
+    if (!pass.empty()) {
+      ClipWinding(next_pass, previous->plane, flow->epsilon, &clipped);
+      next_pass.swap(clipped);
+      ClipToSeparators(next_source, pass, false, flow->separator_epsilon,
+                       flow->epsilon, &next_pass);
+      ClipToSeparators(pass, next_source, true, flow->separator_epsilon,
+                       flow->epsilon, &next_pass);
+      if (next_pass.size() < 3) {
+        continue;
+      }
+    }
+
+    bool redundant = false;
+    for (const auto& entry : flow->entries[s]) {
+      if (WindingContains(entry.first, next_source, flow->separator_epsilon) &&
+          WindingContains(entry.second, next_pass, flow->separator_epsilon)) {
+        redundant = true;
+        break;
+      }
+    }
+
+    if (redundant) {
+      continue;
+    }
+
+    flow->entries[s].emplace_back(next_source, next_pass);
+    completed = RecursiveBspFlow(flow, target, &side, next_source, next_pass,
+                                 &next_might[0]);
+  }
+
+  flow->on_stack[leaf] = 0;
+  return completed;
+}
+
+void BspTree::Build(const ::std::vector<vector3>& positions,
+                    const ::std::vector<uint8>& blockers,
+                    ThreadPool* pool) {
+  Clear();
+
+  uint32 triangle_count = positions.size() / 3;
+  if (!triangle_count) {
+    return;
+  }
+
+  BspBuildState state;
+  state.blockers = &blockers;
+  for (uint32 axis = 0; axis < 3; axis++) {
+    state.scene_min[axis] = state.scene_max[axis] = positions[0][axis];
+  }
+  for (const vector3& position : positions) {
+    for (uint32 axis = 0; axis < 3; axis++) {
+      state.scene_min[axis] =
+          min(state.scene_min[axis], (float64)position[axis]);
+      state.scene_max[axis] =
+          max(state.scene_max[axis], (float64)position[axis]);
+    }
+  }
+
+  float64 scene_size = 1.0;
+  for (uint32 axis = 0; axis < 3; axis++) {
+    scene_size = max(scene_size, state.scene_max[axis] - state.scene_min[axis]);
+  }
+  epsilon_ = BSP_EPSILON_RATIO * scene_size;
+  for (uint32 axis = 0; axis < 3; axis++) {
+    state.scene_min[axis] -= BSP_PORTAL_MARGIN_RATIO * scene_size;
+    state.scene_max[axis] += BSP_PORTAL_MARGIN_RATIO * scene_size;
+    portal_min_[axis] = state.scene_min[axis];
+    portal_max_[axis] = state.scene_max[axis];
+  }
+
+  // Every triangle with an area becomes a fragment that may split the tree.
+  ::std::vector<BspFragment> fragments;
+  state.triangle_planes.resize(triangle_count);
+  for (uint32 i = 0; i < triangle_count; i++) {
+    BspFragment fragment;
+    fragment.triangle = i;
+    fragment.winding.resize(3);
+    for (uint32 j = 0; j < 3; j++) {
+      fragment.winding[j] = MakePoint(positions[i * 3 + j]);
+    }
+
+    float64 a[3], b[3], normal[3];
+    for (uint32 axis = 0; axis < 3; axis++) {
+      a[axis] = fragment.winding[1].v[axis] - fragment.winding[0].v[axis];
+      b[axis] = fragment.winding[2].v[axis] - fragment.winding[0].v[axis];
+    }
+    Cross(a, b, normal);
+
+    if (MakePlane(normal, fragment.winding[0], epsilon_ * epsilon_,
+                  &state.triangle_planes[i])) {
+      fragments.push_back(fragment);
+    }
+  }
+
+  BuildBspSubtree(&nodes_, &leaf_count_, &state, &fragments, epsilon_, 0);
+
+  // Record the leaves that each triangle touches.
+  triangle_offsets_.resize(triangle_count + 1);
+  for (uint32 i = 0; i < triangle_count; i++) {
+    triangle_offsets_[i] = triangle_leaves_.size();
+    FindLeaves(&positions[i * 3], 3, 0, &triangle_leaves_);
+  }
+  triangle_offsets_[triangle_count] = triangle_leaves_.size();
+
+  if (nodes_.empty()) {
+    // A scene without any planes is a single leaf that sees itself.
+    visibility_.assign(1, 1);
+    return;
+  }
+
+  ::std::vector<BspPlane> region;
+  MakeBspPortals(nodes_, 0, &state, &region, epsilon_);
+  MergeBspPortals(&state, epsilon_);
+  portal_count_ = state.portal_windings.size();
+
+  if (leaf_count_ > BSP_MAX_VISIBILITY_LEAVES) {
+    return;
+  }
+
+  // Each portal is seen from both of its sides. Side 2i looks from behind
+  // portal i into the leaf in front of it, and side 2i + 1 the other way.
+  ::std::vector<BspPortalSide> sides;
+  ::std::vector<uint32> side_offsets(leaf_count_ + 1, 0);
+  for (uint32 i = 0; i < portal_count_; i++) {
+    side_offsets[state.portal_leaves[i * 2 + 1]]++;
+    side_offsets[state.portal_leaves[i * 2]]++;
+  }
+  for (uint32 leaf = 0, offset = 0; leaf <= leaf_count_; leaf++) {
+    uint32 leaf_sides = side_offsets[leaf];
+    side_offsets[leaf] = offset;
+    offset += leaf_sides;
+  }
+
+  sides.resize(portal_count_ * 2);
+  ::std::vector<uint32> side_fill(side_offsets.begin(), side_offsets.end() - 1);
+  for (uint32 i = 0; i < portal_count_; i++) {
+    uint32 front_leaf = state.portal_leaves[i * 2];
+    uint32 back_leaf = state.portal_leaves[i * 2 + 1];
+    BspPortalSide forward = {i, back_leaf, front_leaf, state.portal_planes[i],
+                             &state.portal_windings[i]};
+    BspPortalSide backward = {i, front_leaf, back_leaf,
+                              FlipPlane(state.portal_planes[i]),
+                              &state.portal_windings[i]};
+    sides[side_fill[back_leaf]++] = forward;
+    sides[side_fill[front_leaf]++] = backward;
+  }
+
+  // Flood through the portals that lie partly in front of each side, with the
+  // side partly behind them, to find the leaves it might see.
+  uint32 words = QueryLeafWords();
+  ::std::vector<uint64> might_see(sides.size() * words, 0);
+  pool->ParallelFor(sides.size(), [&](uint32 s, uint32) {
+    const BspPortalSide& start = sides[s];
+    uint64* might = &might_see[s * words];
+    ::std::vector<uint32> pending(1, start.to_leaf);
+    might[start.to_leaf / 64] |= 1ull << (start.to_leaf % 64);
+
+    while (!pending.empty()) {
+      uint32 leaf = pending.back();
+      pending.pop_back();
+      for (uint32 n = side_offsets[leaf]; n < side_offsets[leaf + 1]; n++) {
+        const BspPortalSide& next = sides[n];
+        if (might[next.to_leaf / 64] & (1ull << (next.to_leaf % 64)) ||
+            next.portal == start.portal) {
+          continue;
+        }
+
+        bool in_front = false;
+        for (const BspPoint& point : *next.winding) {
+          in_front |= PlaneDistance(start.plane, point) > -epsilon_;
+        }
+        bool behind = false;
+        for (const BspPoint& point : *start.winding) {
+          behind |= PlaneDistance(next.plane, point) < epsilon_;
+        }
+
+        if (in_front && behind) {
+          might[next.to_leaf / 64] |= 1ull << (next.to_leaf % 64);
+          pending.push_back(next.to_leaf);
+        }
+      }
+    }
+  });
+
+  // Trace the exact flow from each side, then gather the sides of each leaf.
+  // Sides that might see the least go first, so that their exact sets are
+  // ready to prune the flows of the sides that might see more. Sides that
+  // might see equally many run together, which keeps the result independent
+  // of thread timing.
+  ::std::vector<uint32> side_order(sides.size());
+  ::std::vector<uint32> might_counts(sides.size(), 0);
+  for (uint32 s = 0; s < sides.size(); s++) {
+    side_order[s] = s;
+    for (uint32 w = 0; w < words; w++) {
+      for (uint64 word = might_see[s * words + w]; word; word &= word - 1) {
+        might_counts[s]++;
+      }
+    }
+  }
+  ::std::stable_sort(side_order.begin(), side_order.end(),
+                     [&](uint32 a, uint32 b) {
+                       return might_counts[a] < might_counts[b];
+                     });
+
+  ::std::vector<uint64> side_visible(sides.size() * words, 0);
+  ::std::vector<uint8> side_done(sides.size(), 0);
+  float64 separator_epsilon = BSP_SEPARATOR_EPSILON_RATIO * scene_size;
+
+  for (uint32 start = 0, end = 0; start < sides.size(); start = end) {
+    for (end = start; end < sides.size() &&
+                      might_counts[side_order[end]] ==
+                          might_counts[side_order[start]];
+         end++) {
+    }
+
+    pool->ParallelFor(end - start, [&](uint32 order, uint32) {
+      uint32 s = side_order[start + order];
+      BspFlow flow;
+      flow.sides = &sides;
+      flow.side_offsets = &side_offsets;
+      flow.might_see = &might_see;
+      flow.side_done = &side_done;
+      flow.side_visible = &side_visible;
+      flow.words = words;
+      flow.epsilon = epsilon_;
+      flow.separator_epsilon = separator_epsilon;
+      flow.start = &sides[s];
+      flow.visible = &side_visible[s * words];
+      flow.on_stack.assign(leaf_count_, 0);
+      flow.on_stack[sides[s].from_leaf] = 1;
+      flow.steps = 0;
+
+      if (!RecursiveBspFlow(&flow, sides[s].to_leaf, &sides[s],
+                            *sides[s].winding, BspWinding(),
+                            &might_see[s * words])) {
+        for (uint32 w = 0; w < words; w++) {
+          flow.visible[w] |= might_see[s * words + w];
+        }
+      }
+    });
+
+    for (uint32 order = start; order < end; order++) {
+      side_done[side_order[order]] = 1;
+    }
+  }
+
+  visibility_.assign(leaf_count_ * words, 0);
+  for (uint32 leaf = 0; leaf < leaf_count_; leaf++) {
+    uint64* leaf_visible = &visibility_[leaf * words];
+    leaf_visible[leaf / 64] |= 1ull << (leaf % 64);
+    for (uint32 s = side_offsets[leaf]; s < side_offsets[leaf + 1]; s++) {
+      for (uint32 w = 0; w < words; w++) {
+        leaf_visible[w] |= side_visible[s * words + w];
+      }
+    }
+  }
+}
+
+void BspTree::FindLeaves(const vector3* points, uint32 point_count,
+                         float32 tolerance,
+                         ::std::vector<uint32>* leaves) const {
+  if (!point_count) {
+    return;
+  }
+
+  if (nodes_.empty()) {
+    leaves->push_back(0);
+    return;
+  }
+
+  float64 offset = tolerance + epsilon_;
+  ::std::vector<::std::pair<int32, BspWinding>> pending(1);
+  pending[0].first = 0;
+  for (uint32 i = 0; i < point_count; i++) {
+    pending[0].second.push_back(MakePoint(points[i]));
+  }
+
+  BspWinding front, back;
+  while (!pending.empty()) {
+    int32 child = pending.back().first;
+    BspWinding winding = ::std::move(pending.back().second);
+    pending.pop_back();
+
+    if (child < 0) {
+      leaves->push_back(~child);
+      continue;
+    }
+
+    const BspNode& node = nodes_[child];
+    ClipWinding(winding, node.plane, offset, &front);
+    ClipWinding(winding, FlipPlane(node.plane), offset, &back);
+    if (!front.empty()) {
+      pending.emplace_back(node.children[0], front);
+    }
+    if (!back.empty()) {
+      pending.emplace_back(node.children[1], back);
+    }
+  }
+}
+
+void BspTree::AccumulateVisibleLeaves(uint32 leaf,
+                                      ::std::vector<uint64>* visible) const {
+  uint32 words = QueryLeafWords();
+  visible->resize(words, 0);
+  if (visibility_.empty()) {
+    // Without a PVS every leaf is potentially visible.
+    visible->assign(words, ~0ull);
+    return;
+  }
+
+  for (uint32 w = 0; w < words; w++) {
+    (*visible)[w] |= visibility_[leaf * words + w];
+  }
+}
+
+bool BspTree::IsTriangleVisible(uint32 triangle,
+                                const ::std::vector<uint64>& visible) const {
+  for (uint32 i = triangle_offsets_[triangle];
+       i < triangle_offsets_[triangle + 1]; i++) {
+    uint32 leaf = triangle_leaves_[i];
+    if (visible[leaf / 64] & (1ull << (leaf % 64))) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+uint32 BspTree::QueryTriangleLeafCount(uint32 triangle) const {
+  return triangle_offsets_[triangle + 1] - triangle_offsets_[triangle];
+}
+
+uint32 BspTree::QueryTriangleLeaf(uint32 triangle, uint32 index) const {
+  return triangle_leaves_[triangle_offsets_[triangle] + index];
+}
@@ -0,0 +1,131 @@
+/*
+//
+// Copyright (c) 1998-2014 Joe Bertolami. All Right Reserved.
+//
+//   Redistribution and use in source and binary forms, with or without
+//   modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, CLUDG, BUT NOT LIMITED TO, THE
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//   ARE DISCLAIMED.  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//   LIABLE FOR ANY DIRECT, DIRECT, CIDENTAL, SPECIAL, EXEMPLARY, OR
+//   CONSEQUENTIAL DAMAGES (CLUDG, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+//   GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSESS TERRUPTION)
+//   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER  CONTRACT, STRICT
+//   LIABILITY, OR TORT (CLUDG NEGLIGENCE OR OTHERWISE) ARISG  ANY WAY  OF THE
+//   USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Additional Information:
+//
+//   For more information, visit http://www.bertolami.com.
+//
+*/
+
+#ifndef __BSP_H__
+#define __BSP_H__
+
+#include <vector>
+
+#include "jmath/base.h"
+#include "jmath/vector3.h"
+#include "thread_pool.h"
+
+using ::base::float32;
+using ::base::float64;
+using ::base::int32;
+using ::base::uint32;
+using ::base::uint64;
+using ::base::uint8;
+using ::base::vector3;
+
+// A plane holding the points p where normal . p == distance.
+typedef struct BspPlane {
+  float64 normal[3];
+  float64 distance;
+} BspPlane;
+
+typedef struct BspNode {
+  // The splitting plane, taken from one of the triangles beneath the node.
+  BspPlane plane;
+  // children[0] lies in front of the plane and children[1] behind it.
+  // Non-negative values index nodes and negative values are ~leaf.
+  int32 children[2];
+} BspNode;
+
+// A binary space partition over a set of triangles, split along the
+// triangles' own planes, together with the portals between its leaves and a
+// potentially visible set for each leaf. A leaf B is in the PVS of leaf A if
+// any straight line can pass from A to B through portals without crossing a
+// blocking triangle, so everything outside a leaf's PVS is hidden from every
+// point of the leaf.
+class BspTree {
+ public:
+  BspTree();
+  // Builds the tree over triangles whose vertices are stored consecutively in
+  // positions, then finds its portals and computes the PVS of every leaf.
+  // Only triangles flagged in blockers stop sight lines. The PVS is skipped
+  // for trees with too many leaves. The portal flows run on pool.
+  void Build(const ::std::vector<vector3>& positions,
+             const ::std::vector<uint8>& blockers, ThreadPool* pool);
+  // Discards the tree.
+  void Clear();
+  // Returns true if the tree holds no nodes.
+  bool IsEmpty() const;
+  // Returns true if the PVS was computed.
+  bool HasVisibility() const;
+  // Returns true if point lies within the region that the portals cover. The
+  // PVS says nothing about sight lines from points outside of it.
+  bool IsPointCovered(const vector3& point) const;
+  // Appends every leaf that the convex polygon points[0..point_count) comes
+  // within tolerance (plus the tree's own epsilon) of to leaves. A single
+  // point or a segment may also be given.
+  void FindLeaves(const vector3* points, uint32 point_count, float32 tolerance,
+                  ::std::vector<uint32>* leaves) const;
+  // Ors the PVS of leaf into visible, which is resized to QueryLeafWords().
+  // Every leaf is visible if the PVS was skipped.
+  void AccumulateVisibleLeaves(uint32 leaf,
+                               ::std::vector<uint64>* visible) const;
+  // Returns true if any leaf that the triangle touches is set in visible.
+  bool IsTriangleVisible(uint32 triangle,
+                         const ::std::vector<uint64>& visible) const;
+  // Returns the number of leaves that the triangle touches.
+  uint32 QueryTriangleLeafCount(uint32 triangle) const;
+  // Returns the index-th leaf that the triangle touches.
+  uint32 QueryTriangleLeaf(uint32 triangle, uint32 index) const;
+  // Returns the number of 64 bit words in a leaf set.
+  uint32 QueryLeafWords() const;
+  uint32 QueryNodeCount() const;
+  uint32 QueryLeafCount() const;
+  uint32 QueryPortalCount() const;
+  // Returns the average fraction of leaves in each leaf's PVS.
+  float32 QueryAverageVisibility() const;
+  // Returns the size of the nodes, triangle lists and PVS in bytes.
+  uint64 QueryMemoryUsage() const;
+
+ private:
+  ::std::vector<BspNode> nodes_;
+  uint32 leaf_count_;
+  uint32 portal_count_;
+  // Plane tests treat points within this distance as lying on the plane.
+  float64 epsilon_;
+  // The box that the portals cover.
+  float64 portal_min_[3];
+  float64 portal_max_[3];
+  // triangle_leaves_[triangle_offsets_[i], triangle_offsets_[i + 1]) are the
+  // leaves that triangle i touches.
+  ::std::vector<uint32> triangle_offsets_;
+  ::std::vector<uint32> triangle_leaves_;
+  // QueryLeafWords() words per leaf, with bit j of leaf i's set if leaf j is
+  // potentially visible from leaf i.
+  ::std::vector<uint64> visibility_;
+};
+
+#endif  // __BSP_H__
@@ -0,0 +1,694 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cmath>
+
+#define BVH_BIN_COUNT (16)
+#define BVH_MAX_LEAF_SIZE (4)
+#define BVH_TRAVERSAL_COST (1.0f)
+#define BVH_INTERSECTION_COST (1.0f)
+#define BVH_PARALLEL_THRESHOLD (4096)
+// Beyond this depth nodes are split at the median, which halves them at every
+// level and so keeps the leaves forced at BVH_MAX_DEPTH below 2^16 primitives.
+#define BVH_MEDIAN_DEPTH (BVH_MAX_DEPTH - 17)
+// The largest quantized coordinate. Scales leave one step of headroom so that
+// rounding outwards never needs to exceed it.
+#define BVH_QUANTIZED_MAX (255)
+
+// The cache file is a header followed by the node array and then the leaf
+// primitive ordering. The version must change whenever BvhWideNode does.
+#define BVH_FILE_MAGIC (0x31485642)  // "BVH1"
+#define BVH_FILE_VERSION (2)
+
+using ::base::bounds;
+
+// Padded to a cache line so that the mapped nodes stay aligned.
+typedef struct alignas(64) BvhFileHeader {
+  uint32 magic;
+  uint32 version;
+  uint64 geometry_hash;
+  uint32 node_count;
+  uint32 primitive_count;
+} BvhFileHeader;
+
+// A plain bin of primitive bounds. Binning touches every primitive at every
+// level of the build, so bins avoid the constructors and copies of bounds.
+typedef struct BvhBin {
+  float32 bin_min[3];
+  float32 bin_max[3];
+  uint32 count;
+} BvhBin;
+
+inline void ClearBin(BvhBin* bin) {
+  for (int32 axis = 0; axis < 3; axis++) {
+    bin->bin_min[axis] = BASE_INFINITY;
+    bin->bin_max[axis] = -BASE_INFINITY;
+  }
+  bin->count = 0;
+}
+
+inline void GrowBin(BvhBin* bin, const bounds& box) {
+  for (int32 axis = 0; axis < 3; axis++) {
+    bin->bin_min[axis] = min(bin->bin_min[axis], box.bounds_min.v[axis]);
+    bin->bin_max[axis] = max(bin->bin_max[axis], box.bounds_max.v[axis]);
+  }
+  bin->count++;
+}
+
+inline void MergeBin(BvhBin* bin, const BvhBin& rhs) {
+  for (int32 axis = 0; axis < 3; axis++) {
+    bin->bin_min[axis] = min(bin->bin_min[axis], rhs.bin_min[axis]);
+    bin->bin_max[axis] = max(bin->bin_max[axis], rhs.bin_max[axis]);
+  }
+  bin->count += rhs.count;
+}
+
+inline float32 BinArea(const BvhBin& bin) {
+  if (!bin.count) {
+    return 0.0f;
+  }
+
+  float32 x = bin.bin_max[0] - bin.bin_min[0];
+  float32 y = bin.bin_max[1] - bin.bin_min[1];
+  float32 z = bin.bin_max[2] - bin.bin_min[2];
+  return 2.0f * (x * y + y * z + z * x);
+}
+
+inline bounds BinBounds(const BvhBin& bin) {
+  bounds output;
+  output.bounds_min = vector3(bin.bin_min[0], bin.bin_min[1], bin.bin_min[2]);
+  output.bounds_max = vector3(bin.bin_max[0], bin.bin_max[1], bin.bin_max[2]);
+  output.vector_count = bin.count;
+  return output;
+}
+
+// Merges rhs into lhs in place, ignoring rhs if it is empty. This avoids the
+// copies made by bounds::operator+=, which dominate build time otherwise.
+inline void MergeBounds(bounds* lhs, const bounds& rhs) {
+  if (!rhs.vector_count) {
+    return;
+  }
+
+  if (!lhs->vector_count) {
+    *lhs = rhs;
+    return;
+  }
+
+  lhs->vector_count++;
+  for (int32 axis = 0; axis < 3; axis++) {
+    lhs->bounds_min[axis] = min(lhs->bounds_min[axis], rhs.bounds_min[axis]);
+    lhs->bounds_max[axis] = max(lhs->bounds_max[axis], rhs.bounds_max[axis]);
+  }
+}
+
+// Grows bounds in place to include point.
+inline void MergePoint(bounds* lhs, const vector3& point) {
+  if (!lhs->vector_count) {
+    lhs->bounds_min = point;
+    lhs->bounds_max = point;
+    lhs->vector_count = 1;
+    return;
+  }
+
+  lhs->vector_count++;
+  for (int32 axis = 0; axis < 3; axis++) {
+    lhs->bounds_min[axis] = min(lhs->bounds_min[axis], point[axis]);
+    lhs->bounds_max[axis] = max(lhs->bounds_max[axis], point[axis]);
+  }
+}
+
+inline void SetNodeBounds(BvhNode* node, const bounds& box) {
+  for (int32 axis = 0; axis < 3; axis++) {
+    node->bounds_min[axis] = box.bounds_min.v[axis];
+    node->bounds_max[axis] = box.bounds_max.v[axis];
+  }
+}
+
+inline float32 NodeArea(const BvhNode& node) {
+  float32 x = node.bounds_max[0] - node.bounds_min[0];
+  float32 y = node.bounds_max[1] - node.bounds_min[1];
+  float32 z = node.bounds_max[2] - node.bounds_min[2];
+  return 2.0f * (x * y + y * z + z * x);
+}
+
+inline uint32 FindBin(float32 value, float32 minimum, float32 scale) {
+  int32 bin = (int32)((value - minimum) * scale);
+  return (uint32)max(0, min(bin, BVH_BIN_COUNT - 1));
+}
+
+// Returns the number of chunks that a pass over count primitives is split
+// into, which is one unless pool is non-null and the range is large.
+inline uint32 QueryChunkCount(ThreadPool* pool, uint32 count) {
+  return pool && count > BVH_PARALLEL_THRESHOLD ? pool->QueryThreadCount() : 1;
+}
+
+// Splits [start, end) into chunk_count contiguous chunks and runs
+// task(chunk, chunk_start, chunk_end) for each one. A single chunk runs on the
+// calling thread, and several run on pool.
+template <typename Task>
+void RunParallelChunks(ThreadPool* pool, uint32 start, uint32 end,
+                       uint32 chunk_count, const Task& task) {
+  if (chunk_count == 1) {
+    task(0, start, end);
+    return;
+  }
+
+  uint32 chunk_size = (end - start + chunk_count - 1) / chunk_count;
+  pool->ParallelFor(chunk_count, [&](uint32 chunk, uint32) {
+    uint32 chunk_start = min(start + chunk * chunk_size, end);
+    uint32 chunk_end = min(chunk_start + chunk_size, end);
+    task(chunk, chunk_start, chunk_end);
+  });
+}
+
+Bvh::Bvh()
+    : primitive_bounds_(NULL),
+      node_count_(0),
+      node_data_(NULL),
+      wide_node_count_(0),
+      primitive_data_(NULL),
+      primitive_count_(0) {}
+
+void Bvh::Clear() {
+  nodes_.clear();
+  primitives_.clear();
+  node_count_ = 0;
+  wide_nodes_.clear();
+  node_data_ = NULL;
+  wide_node_count_ = 0;
+  primitive_data_ = NULL;
+  primitive_count_ = 0;
+  mapped_file_.Close();
+}
+
+void Bvh::Build(const ::std::vector<bounds>& primitive_bounds,
+                ThreadPool* pool) {
+  Clear();
+
+  if (primitive_bounds.empty()) {
+    return;
+  }
+
+  uint32 count = primitive_bounds.size();
+  uint32 chunk_count = QueryChunkCount(pool, count);
+  primitive_bounds_ = &primitive_bounds;
+  centroids_.resize(count);
+  primitives_.resize(count);
+
+  ::std::vector<bounds> chunk_bounds(chunk_count);
+  RunParallelChunks(pool, 0, count, chunk_count,
+                    [&](uint32 chunk, uint32 chunk_start, uint32 chunk_end) {
+                      for (uint32 i = chunk_start; i < chunk_end; i++) {
+                        centroids_[i] = primitive_bounds[i].query_center();
+                        primitives_[i] = i;
+                        MergeBounds(&chunk_bounds[chunk], primitive_bounds[i]);
+                      }
+                    });
+
+  // A binary tree with one primitive per leaf has 2n - 1 nodes, so the nodes
+  // never move while subtrees are built concurrently.
+  nodes_.resize(2 * count - 1);
+  node_count_ = 1;
+  for (uint32 i = 1; i < chunk_count; i++) {
+    MergeBounds(&chunk_bounds[0], chunk_bounds[i]);
+  }
+  SetNodeBounds(&nodes_[0], chunk_bounds[0]);
+
+  // The top of the tree is split on this thread, with the pool sharing the
+  // passes over each large node. The small subtrees below it are then built
+  // one per task, largest first so that the last tasks to start are short.
+  pending_subtrees_.clear();
+  BuildSubtree(0, 0, count, 0, pool);
+  ::std::sort(pending_subtrees_.begin(), pending_subtrees_.end(),
+              [](const BvhSubtree& lhs, const BvhSubtree& rhs) {
+                return lhs.end - lhs.start > rhs.end - rhs.start;
+              });
+  pool->ParallelFor(pending_subtrees_.size(), [&](uint32 i, uint32) {
+    const BvhSubtree& subtree = pending_subtrees_[i];
+    BuildSubtree(subtree.node_index, subtree.start, subtree.end,
+                 subtree.depth, NULL);
+  });
+  pending_subtrees_.clear();
+
+  nodes_.resize(node_count_);
+  centroids_.clear();
+  primitive_bounds_ = NULL;
+
+  // A wide tree needs about a third as many nodes as the binary tree.
+  wide_nodes_.reserve(node_count_ / (BVH_NODE_WIDTH - 1) + 1);
+  CollapseSubtree(0);
+  ::std::vector<BvhNode>().swap(nodes_);
+  node_count_ = 0;
+
+  node_data_ = wide_nodes_.data();
+  wide_node_count_ = wide_nodes_.size();
+  primitive_data_ = primitives_.data();
+  primitive_count_ = count;
+}
+
+bool Bvh::SaveToFile(const ::std::string& filename,
+                     uint64 geometry_hash) const {
+  if (IsEmpty()) {
+    return false;
+  }
+
+  FILE* file_ptr = NULL;
+  fopen_s(&file_ptr, filename.c_str(), "wb");
+  if (!file_ptr) {
+    return false;
+  }
+
+  BvhFileHeader header = {BVH_FILE_MAGIC, BVH_FILE_VERSION, geometry_hash,
+                          QueryNodeCount(), primitive_count_};
+  bool success =
+      1 == fwrite(&header, sizeof(header), 1, file_ptr) &&
+      header.node_count ==
+          fwrite(node_data_, sizeof(BvhWideNode), header.node_count,
+                 file_ptr) &&
+      header.primitive_count == fwrite(primitive_data_, sizeof(uint32),
+                                       header.primitive_count, file_ptr);
+  fclose(file_ptr);
+
+  if (!success) {
+    remove(filename.c_str());
+  }
+
+  return success;
+}
+
+bool Bvh::MapFromFile(const ::std::string& filename, uint64 geometry_hash,
+                      uint32 primitive_count) {
+  Clear();
+
+  if (!mapped_file_.Open(filename) ||
+      mapped_file_.QuerySize() < sizeof(BvhFileHeader)) {
+    Clear();
+    return false;
+  }
+
+  const uint8* data = mapped_file_.QueryData();
+  const BvhFileHeader* header = (const BvhFileHeader*)data;
+  uint64 expected_size = sizeof(BvhFileHeader) +
+                         (uint64)header->node_count * sizeof(BvhWideNode) +
+                         (uint64)header->primitive_count * sizeof(uint32);
+
+  if (BVH_FILE_MAGIC != header->magic || BVH_FILE_VERSION != header->version ||
+      geometry_hash != header->geometry_hash ||
+      primitive_count != header->primitive_count || !header->node_count ||
+      expected_size != mapped_file_.QuerySize()) {
+    Clear();
+    return false;
+  }
+
+  node_data_ = (const BvhWideNode*)(data + sizeof(BvhFileHeader));
+  primitive_data_ = (const uint32*)(node_data_ + header->node_count);
+  wide_node_count_ = header->node_count;
+  primitive_count_ = header->primitive_count;
+  return true;
+}
+
+bool Bvh::IsEmpty() const { return 0 == wide_node_count_; }
+
+const BvhWideNode& Bvh::QueryNode(uint32 index) const {
+  return node_data_[index];
+}
+
+uint32 Bvh::QueryNodeCount() const { return wide_node_count_; }
+
+uint32 Bvh::QueryPrimitive(uint32 index) const {
+  return primitive_data_[index];
+}
+
+uint64 Bvh::QueryMemoryUsage() const {
+  return (uint64)wide_node_count_ * sizeof(BvhWideNode) +
+         (uint64)primitive_count_ * sizeof(uint32);
+}
+
+void Bvh::BuildSubtree(uint32 node_index, uint32 start, uint32 end,
+                       uint32 depth, ThreadPool* pool) {
+  uint32 count = end - start;
+  if (pool && count <= BVH_PARALLEL_THRESHOLD) {
+    BvhSubtree subtree = {node_index, start, end, depth};
+    pending_subtrees_.push_back(subtree);
+    return;
+  }
+
+  BvhNode& node = nodes_[node_index];
+  node.first_primitive = start;
+  node.primitive_count = count;
+  node.children[0] = -1;
+  node.children[1] = -1;
+
+  if (count <= 1 || depth + 1 >= BVH_MAX_DEPTH) {
+    return;
+  }
+
+  uint32 split_axis = 0;
+  uint32 split_bin = 0;
+  uint32 middle = start;
+  bounds centroid_bounds, left_bounds, right_bounds;
+
+  if (depth >= BVH_MEDIAN_DEPTH) {
+    if (count <= BVH_MAX_LEAF_SIZE) {
+      return;
+    }
+    for (uint32 i = start; i < end; i++) {
+      MergePoint(&centroid_bounds, centroids_[primitives_[i]]);
+    }
+  } else if (FindSplit(start, end, pool, &centroid_bounds, &split_axis,
+                       &split_bin, &left_bounds, &right_bounds)) {
+    middle = Partition(start, end, split_axis, split_bin, centroid_bounds,
+                       pool);
+  } else if (count <= BVH_MAX_LEAF_SIZE) {
+    return;
+  }
+
+  if (middle == start || middle == end) {
+    // There is no useful split (e.g. every centroid coincides), or we are deep
+    // enough to split at the median of the widest centroid axis instead.
+    vector3 extent = centroid_bounds.bounds_max - centroid_bounds.bounds_min;
+    split_axis = extent.x >= extent.y && extent.x >= extent.z
+                     ? 0
+                     : (extent.y >= extent.z ? 1 : 2);
+    middle = start + count / 2;
+    ::std::nth_element(primitives_.begin() + start,
+                       primitives_.begin() + middle,
+                       primitives_.begin() + end,
+                       [&](uint32 lhs, uint32 rhs) {
+                         return centroids_[lhs][split_axis] <
+                                centroids_[rhs][split_axis];
+                       });
+
+    left_bounds.clear();
+    right_bounds.clear();
+    for (uint32 i = start; i < end; i++) {
+      MergeBounds(i < middle ? &left_bounds : &right_bounds,
+                  (*primitive_bounds_)[primitives_[i]]);
+    }
+  }
+
+  uint32 first_child = node_count_.fetch_add(2);
+  node.first_primitive = 0;
+  node.primitive_count = 0;
+  node.children[0] = first_child;
+  node.children[1] = first_child + 1;
+  SetNodeBounds(&nodes_[first_child], left_bounds);
+  SetNodeBounds(&nodes_[first_child + 1], right_bounds);
+
+  BuildSubtree(first_child, start, middle, depth + 1, pool);
+  BuildSubtree(first_child + 1, middle, end, depth + 1, pool);
+}
+
+bool Bvh::FindSplit(uint32 start, uint32 end, ThreadPool* pool,
+                    bounds* centroid_bounds, uint32* split_axis,
+                    uint32* split_bin, bounds* left_bounds,
+                    bounds* right_bounds) {
+  uint32 count = end - start;
+  uint32 chunk_count = QueryChunkCount(pool, count);
+
+  ::std::vector<bounds> chunk_centroids(chunk_count);
+  RunParallelChunks(pool, start, end, chunk_count,
+                    [&](uint32 chunk, uint32 chunk_start, uint32 chunk_end) {
+                      for (uint32 i = chunk_start; i < chunk_end; i++) {
+                        MergePoint(&chunk_centroids[chunk],
+                                   centroids_[primitives_[i]]);
+                      }
+                    });
+
+  centroid_bounds->clear();
+  for (uint32 i = 0; i < chunk_count; i++) {
+    MergeBounds(centroid_bounds, chunk_centroids[i]);
+  }
+
+  vector3 extent = centroid_bounds->bounds_max - centroid_bounds->bounds_min;
+  if (extent.x <= BASE_EPSILON && extent.y <= BASE_EPSILON &&
+      extent.z <= BASE_EPSILON) {
+    return false;
+  }
+
+  // Bin every centroid along each axis. The first chunk bins straight into
+  // the final bins and any other chunks get their own set to merge afterwards.
+  // Each set holds the bins of every axis in turn.
+  BvhBin bins[3 * BVH_BIN_COUNT];
+  ::std::vector<BvhBin> chunk_bins((chunk_count - 1) * 3 * BVH_BIN_COUNT);
+  for (uint32 bin = 0; bin < 3 * BVH_BIN_COUNT; bin++) {
+    ClearBin(&bins[bin]);
+  }
+  for (auto& bin : chunk_bins) {
+    ClearBin(&bin);
+  }
+
+  float32 scale[3];
+  for (uint32 axis = 0; axis < 3; axis++) {
+    scale[axis] = extent[axis] > BASE_EPSILON ? BVH_BIN_COUNT / extent[axis]
+                                              : 0.0f;
+  }
+
+  RunParallelChunks(
+      pool, start, end, chunk_count,
+      [&](uint32 chunk, uint32 chunk_start, uint32 chunk_end) {
+        BvhBin* target_bins =
+            chunk ? &chunk_bins[(chunk - 1) * 3 * BVH_BIN_COUNT] : bins;
+        for (uint32 i = chunk_start; i < chunk_end; i++) {
+          uint32 primitive = primitives_[i];
+          const bounds& primitive_bounds = (*primitive_bounds_)[primitive];
+          for (uint32 axis = 0; axis < 3; axis++) {
+            if (scale[axis] == 0.0f) {
+              continue;
+            }
+            uint32 bin =
+                FindBin(centroids_[primitive].v[axis],
+                        centroid_bounds->bounds_min.v[axis], scale[axis]);
+            GrowBin(&target_bins[axis * BVH_BIN_COUNT + bin],
+                    primitive_bounds);
+          }
+        }
+      });
+
+  for (uint32 chunk = 1; chunk < chunk_count; chunk++) {
+    for (uint32 bin = 0; bin < 3 * BVH_BIN_COUNT; bin++) {
+      MergeBin(&bins[bin], chunk_bins[(chunk - 1) * 3 * BVH_BIN_COUNT + bin]);
+    }
+  }
+
+  // Sweep the bins from both ends to evaluate the surface area heuristic at
+  // each bin boundary.
+  float32 best_cost = BASE_INFINITY;
+  float32 node_area = 0.0f;
+
+  for (uint32 axis = 0; axis < 3; axis++) {
+    if (scale[axis] == 0.0f) {
+      continue;
+    }
+
+    float32 right_area[BVH_BIN_COUNT];
+    uint32 right_count[BVH_BIN_COUNT];
+    BvhBin accumulated;
+    ClearBin(&accumulated);
+    for (int32 bin = BVH_BIN_COUNT - 1; bin > 0; bin--) {
+      MergeBin(&accumulated, bins[axis * BVH_BIN_COUNT + bin]);
+      right_area[bin] = BinArea(accumulated);
+      right_count[bin] = accumulated.count;
+    }
+
+    if (node_area == 0.0f) {
+      // Every axis bins every primitive, so any axis gives the node bounds.
+      MergeBin(&accumulated, bins[axis * BVH_BIN_COUNT]);
+      node_area = max(BinArea(accumulated), BASE_EPSILON);
+    }
+
+    ClearBin(&accumulated);
+    for (uint32 bin = 0; bin < BVH_BIN_COUNT - 1; bin++) {
+      MergeBin(&accumulated, bins[axis * BVH_BIN_COUNT + bin]);
+      if (!accumulated.count || !right_count[bin + 1]) {
+        continue;
+      }
+
+      float32 cost = BVH_TRAVERSAL_COST +
+                     BVH_INTERSECTION_COST *
+                         (BinArea(accumulated) * accumulated.count +
+                          right_area[bin + 1] * right_count[bin + 1]) /
+                         node_area;
+      if (cost < best_cost) {
+        best_cost = cost;
+        *split_axis = axis;
+        *split_bin = bin;
+      }
+    }
+  }
+
+  if (best_cost == BASE_INFINITY ||
+      (best_cost >= BVH_INTERSECTION_COST * count &&
+       count <= BVH_MAX_LEAF_SIZE)) {
+    return false;
+  }
+
+  BvhBin left, right;
+  ClearBin(&left);
+  ClearBin(&right);
+  for (uint32 bin = 0; bin < BVH_BIN_COUNT; bin++) {
+    MergeBin(bin <= *split_bin ? &left : &right,
+             bins[*split_axis * BVH_BIN_COUNT + bin]);
+  }
+
+  *left_bounds = BinBounds(left);
+  *right_bounds = BinBounds(right);
+
+  return true;
+}
+
+uint32 Bvh::Partition(uint32 start, uint32 end, uint32 split_axis,
+                      uint32 split_bin, const bounds& centroid_bounds,
+                      ThreadPool* pool) {
+  uint32 count = end - start;
+  uint32 chunk_count = QueryChunkCount(pool, count);
+  float32 minimum = centroid_bounds.bounds_min[split_axis];
+  float32 scale =
+      BVH_BIN_COUNT / (centroid_bounds.bounds_max[split_axis] - minimum);
+
+  if (chunk_count == 1) {
+    return ::std::partition(primitives_.begin() + start,
+                            primitives_.begin() + end,
+                            [&](uint32 primitive) {
+                              return FindBin(centroids_[primitive][split_axis],
+                                             minimum, scale) <= split_bin;
+                            }) -
+           primitives_.begin();
+  }
+
+  // Count each chunk's left primitives, then scatter every chunk into its
+  // slice of a scratch buffer in parallel.
+  ::std::vector<uint32> left_counts(chunk_count, 0);
+  RunParallelChunks(pool, start, end, chunk_count,
+                    [&](uint32 chunk, uint32 chunk_start, uint32 chunk_end) {
+                      for (uint32 i = chunk_start; i < chunk_end; i++) {
+                        left_counts[chunk] +=
+                            FindBin(centroids_[primitives_[i]][split_axis],
+                                    minimum, scale) <= split_bin;
+                      }
+                    });
+
+  uint32 chunk_size = (count + chunk_count - 1) / chunk_count;
+  ::std::vector<uint32> left_offsets(chunk_count);
+  ::std::vector<uint32> right_offsets(chunk_count);
+  uint32 left_total = 0;
+  for (uint32 chunk = 0; chunk < chunk_count; chunk++) {
+    left_offsets[chunk] = left_total;
+    left_total += left_counts[chunk];
+  }
+
+  uint32 right_total = left_total;
+  for (uint32 chunk = 0; chunk < chunk_count; chunk++) {
+    right_offsets[chunk] = right_total;
+    uint32 chunk_start = min(start + chunk * chunk_size, end);
+    uint32 chunk_end = min(chunk_start + chunk_size, end);
+    right_total += (chunk_end - chunk_start) - left_counts[chunk];
+  }
+
+  ::std::vector<uint32> scratch(count);
+  RunParallelChunks(pool, start, end, chunk_count,
+                    [&](uint32 chunk, uint32 chunk_start, uint32 chunk_end) {
+                      uint32 left = left_offsets[chunk];
+                      uint32 right = right_offsets[chunk];
+                      for (uint32 i = chunk_start; i < chunk_end; i++) {
+                        uint32 primitive = primitives_[i];
+                        if (FindBin(centroids_[primitive][split_axis], minimum,
+                                    scale) <= split_bin) {
+                          scratch[left++] = primitive;
+                        } else {
+                          scratch[right++] = primitive;
+                        }
+                      }
+                    });
+
+  ::std::copy(scratch.begin(), scratch.end(), primitives_.begin() + start);
+  return start + left_total;
+}
+
+uint32 Bvh::CollapseSubtree(uint32 node_index) {
+  uint32 wide_index = wide_nodes_.size();
+  wide_nodes_.emplace_back();
+
+  // Gather children by repeatedly opening the inner child with the largest
+  // surface area, which is the child most likely to be visited.
+  const BvhNode& node = nodes_[node_index];
+  uint32 children[BVH_NODE_WIDTH];
+  uint32 child_count = 0;
+
+  if (node.children[0] < 0) {
+    children[child_count++] = node_index;
+  } else {
+    children[child_count++] = node.children[0];
+    children[child_count++] = node.children[1];
+  }
+
+  while (child_count < BVH_NODE_WIDTH) {
+    int32 largest = -1;
+    float32 largest_area = -1.0f;
+    for (uint32 i = 0; i < child_count; i++) {
+      const BvhNode& child = nodes_[children[i]];
+      if (child.children[0] >= 0 && NodeArea(child) > largest_area) {
+        largest = i;
+        largest_area = NodeArea(child);
+      }
+    }
+
+    if (largest < 0) {
+      break;
+    }
+
+    const BvhNode& opened = nodes_[children[largest]];
+    children[largest] = opened.children[0];
+    children[child_count++] = opened.children[1];
+  }
+
+  BvhWideNode wide;
+  memset(&wide, 0, sizeof(wide));
+  wide.child_count = child_count;
+
+  for (uint32 axis = 0; axis < 3; axis++) {
+    // Pick the smallest power of two scale that spans the node in
+    // BVH_QUANTIZED_MAX - 1 steps.
+    float32 origin = node.bounds_min[axis];
+    float32 extent = node.bounds_max[axis] - origin;
+    int32 exponent = 0;
+    frexp(extent / (BVH_QUANTIZED_MAX - 1), &exponent);
+    exponent = max(-126, min(exponent, 127));
+    float32 scale = DecodeBvhScale(exponent);
+    wide.origin[axis] = origin;
+    wide.scale_exponent[axis] = exponent;
+
+    for (uint32 i = 0; i < child_count; i++) {
+      // Round outwards, then step further out if the decoded value (computed
+      // exactly as traversal does) still falls inside the exact bounds.
+      const BvhNode& child = nodes_[children[i]];
+      int32 lower = (int32)floor((child.bounds_min[axis] - origin) / scale);
+      int32 upper = (int32)ceil((child.bounds_max[axis] - origin) / scale);
+      lower = max(0, min(lower, BVH_QUANTIZED_MAX));
+      upper = max(0, min(upper, BVH_QUANTIZED_MAX));
+      while (lower > 0 &&
+             origin + (uint8)lower * scale > child.bounds_min[axis]) {
+        lower--;
+      }
+      while (upper < BVH_QUANTIZED_MAX &&
+             origin + (uint8)upper * scale < child.bounds_max[axis]) {
+        upper++;
+      }
+      wide.child_min[axis][i] = lower;
+      wide.child_max[axis][i] = upper;
+    }
+  }
+
+  for (uint32 i = 0; i < child_count; i++) {
+    const BvhNode& child = nodes_[children[i]];
+    if (child.children[0] < 0) {
+      wide.children[i] = child.first_primitive;
+      wide.leaf_counts[i] = child.primitive_count;
+    } else {
+      wide.children[i] = CollapseSubtree(children[i]);
+    }
+  }
+
+  wide_nodes_[wide_index] = wide;
+  return wide_index;
+}
@@ -0,0 +1,200 @@
+/*
+//
+// Copyright (c) 1998-2014 Joe Bertolami. All Right Reserved.
+//
+//   Redistribution and use in source and binary forms, with or without
+//   modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, CLUDG, BUT NOT LIMITED TO, THE
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//   ARE DISCLAIMED.  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//   LIABLE FOR ANY DIRECT, DIRECT, CIDENTAL, SPECIAL, EXEMPLARY, OR
+//   CONSEQUENTIAL DAMAGES (CLUDG, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+//   GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSESS TERRUPTION)
+//   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER  CONTRACT, STRICT
+//   LIABILITY, OR TORT (CLUDG NEGLIGENCE OR OTHERWISE) ARISG  ANY WAY  OF THE
+//   USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Additional Information:
+//
+//   For more information, visit http://www.bertolami.com.
+//
+*/
+
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "jmath/base.h"
+#include "jmath/vector3.h"
+#include "jmath/volume.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
+
+// The deepest a hierarchy may grow, which bounds the stack needed to traverse
+// it. Nodes at this depth become leaves regardless of their size.
+#define BVH_MAX_DEPTH (64)
+// The number of children in each node of the traversal hierarchy.
+#define BVH_NODE_WIDTH (4)
+// Each visit pops one node and pushes at most BVH_NODE_WIDTH children.
+#define BVH_STACK_SIZE ((BVH_NODE_WIDTH - 1) * BVH_MAX_DEPTH + 1)
+
+using ::base::float32;
+using ::base::int32;
+using ::base::int8;
+using ::base::uint16;
+using ::base::uint32;
+using ::base::uint64;
+using ::base::uint8;
+using ::base::vector3;
+
+// A binary node, used only while building the hierarchy.
+typedef struct BvhNode {
+  // The bounds of every primitive beneath the node.
+  float32 bounds_min[3];
+  float32 bounds_max[3];
+  // For leaf nodes, the range of QueryPrimitive indices held by the leaf.
+  uint32 first_primitive;
+  uint32 primitive_count;
+  // Child node indices, or -1 for leaf nodes.
+  int32 children[2];
+} BvhNode;
+
+// A binary node whose subtree is left to be built by a single pool task.
+typedef struct BvhSubtree {
+  uint32 node_index;
+  // The node's range of primitives.
+  uint32 start;
+  uint32 end;
+  uint32 depth;
+} BvhSubtree;
+
+// A traversal node holding up to BVH_NODE_WIDTH children in one cache line.
+// Child bounds are stored as 8 bit offsets from the node origin in units of a
+// power of two scale, rounded outwards so that they always contain the exact
+// bounds. Nodes hold no pointers so that a hierarchy can be written to disk
+// and traversed directly from a mapped view of the file.
+typedef struct alignas(64) BvhWideNode {
+  // The minimum corner of the node's bounds.
+  float32 origin[3];
+  // The base 2 exponent of the quantization scale along each axis.
+  int8 scale_exponent[3];
+  uint8 child_count;
+  // Quantized child bounds, indexed by [axis][child].
+  uint8 child_min[3][BVH_NODE_WIDTH];
+  uint8 child_max[3][BVH_NODE_WIDTH];
+  // For inner children the index of the child node, and for leaf children the
+  // first QueryPrimitive index of the leaf.
+  uint32 children[BVH_NODE_WIDTH];
+  // The number of primitives in each leaf child, or zero for inner children.
+  uint16 leaf_counts[BVH_NODE_WIDTH];
+} BvhWideNode;
+
+// Returns 2^exponent, for exponents within the normal float range.
+inline float32 DecodeBvhScale(int8 exponent) {
+  uint32 bits = (uint32)(exponent + 127) << 23;
+  float32 scale;
+  memcpy(&scale, &bits, sizeof(scale));
+  return scale;
+}
+
+// Decodes the bounds of a child of node.
+inline void DecodeBvhChildBounds(const BvhWideNode& node, uint32 child,
+                                 float32* bounds_min, float32* bounds_max) {
+  for (uint32 axis = 0; axis < 3; axis++) {
+    float32 scale = DecodeBvhScale(node.scale_exponent[axis]);
+    bounds_min[axis] = node.origin[axis] + node.child_min[axis][child] * scale;
+    bounds_max[axis] = node.origin[axis] + node.child_max[axis][child] * scale;
+  }
+}
+
+// A bounding volume hierarchy over a set of primitive bounds. The hierarchy is
+// split as a binary tree with a binned surface area heuristic and then
+// collapsed into quantized BVH_NODE_WIDTH-way nodes for traversal. Node 0 is
+// the root.
+class Bvh {
+ public:
+  Bvh();
+  // Builds the hierarchy over the supplied primitive bounds on pool,
+  // discarding any prior state.
+  void Build(const ::std::vector<::base::bounds>& primitive_bounds,
+             ThreadPool* pool);
+  // Writes the hierarchy to filename, tagged with geometry_hash so that a later
+  // MapFromFile can tell whether it still matches the geometry.
+  bool SaveToFile(const ::std::string& filename, uint64 geometry_hash) const;
+  // Replaces the hierarchy with a mapped view of a file written by SaveToFile.
+  // Returns false, leaving the hierarchy empty, if the file is missing or was
+  // written for different geometry or a different primitive count.
+  bool MapFromFile(const ::std::string& filename, uint64 geometry_hash,
+                   uint32 primitive_count);
+  // Returns true if the hierarchy contains no primitives.
+  bool IsEmpty() const;
+  // Returns the node at the specified index.
+  const BvhWideNode& QueryNode(uint32 index) const;
+  // Returns the number of nodes in the hierarchy.
+  uint32 QueryNodeCount() const;
+  // Returns the primitive (an index into the build bounds) at the specified
+  // position of the leaf ordering.
+  uint32 QueryPrimitive(uint32 index) const;
+  // Returns the size of the nodes and primitive ordering in bytes.
+  uint64 QueryMemoryUsage() const;
+
+ private:
+  // Splits node_index, which holds primitives [start, end) at the given depth,
+  // and recursively builds its subtrees. If pool is non-null, large nodes are
+  // split with the pool's help and every subtree below
+  // BVH_PARALLEL_THRESHOLD primitives is added to pending_subtrees_ instead.
+  // Otherwise the whole subtree is built on the calling thread.
+  void BuildSubtree(uint32 node_index, uint32 start, uint32 end, uint32 depth,
+                    ThreadPool* pool);
+  // Bins the centroids of primitives [start, end) and finds the lowest cost
+  // split, along with the bounds of each side. Returns false if there is no
+  // split or the node is better off as a leaf. centroid_bounds is always set.
+  // The binning runs on pool for large ranges if pool is non-null.
+  bool FindSplit(uint32 start, uint32 end, ThreadPool* pool,
+                 ::base::bounds* centroid_bounds, uint32* split_axis,
+                 uint32* split_bin, ::base::bounds* left_bounds,
+                 ::base::bounds* right_bounds);
+  // Reorders primitives [start, end) so that those left of the split come
+  // first, and returns the index of the first primitive on the right. Large
+  // ranges are scattered on pool if it is non-null.
+  uint32 Partition(uint32 start, uint32 end, uint32 split_axis,
+                   uint32 split_bin, const ::base::bounds& centroid_bounds,
+                   ThreadPool* pool);
+  // Appends a wide node for the binary subtree at node_index, followed by the
+  // wide nodes of its descendants, and returns its index.
+  uint32 CollapseSubtree(uint32 node_index);
+
+  // Discards any built or mapped hierarchy.
+  void Clear();
+
+  const ::std::vector<::base::bounds>* primitive_bounds_;
+  ::std::vector<vector3> centroids_;
+  ::std::vector<uint32> primitives_;
+  ::std::vector<BvhNode> nodes_;
+  ::std::atomic<uint32> node_count_;
+  // The subtrees that the current build hands out to the pool.
+  ::std::vector<BvhSubtree> pending_subtrees_;
+  ::std::vector<BvhWideNode> wide_nodes_;
+  // Traversal reads through these, which point either at the vectors above or
+  // into mapped_file_.
+  const BvhWideNode* node_data_;
+  uint32 wide_node_count_;
+  const uint32* primitive_data_;
+  uint32 primitive_count_;
+  MappedFile mapped_file_;
+};
+
+#endif  // __BVH_H__
@@ -0,0 +1,90 @@
+#include "alias.h"
+
+namespace base {
+
+alias_table::alias_table() {}
+
+bool alias_table::initialize(const std::vector<float32>& weights) {
+  probability_list.clear();
+  threshold_list.clear();
+  alias_list.clear();
+
+  float64 total_weight = 0.0;
+  for (uint32 i = 0; i < weights.size(); i++) {
+    total_weight += weights[i];
+  }
+
+  if (total_weight <= 0.0) {
+    return false;
+  }
+
+  uint32 count = weights.size();
+  probability_list.resize(count);
+  threshold_list.resize(count);
+  alias_list.resize(count);
+
+  // Vose's variant: scale each weight so the average is one, then pair every
+  // under-full bucket with an over-full one that donates the remainder.
+  std::vector<float64> scaled(count);
+  std::vector<uint32> small_list;
+  std::vector<uint32> large_list;
+
+  for (uint32 i = 0; i < count; i++) {
+    probability_list[i] = weights[i] / total_weight;
+    scaled[i] = probability_list[i] * count;
+    if (scaled[i] < 1.0) {
+      small_list.push_back(i);
+    } else {
+      large_list.push_back(i);
+    }
+  }
+
+  while (!small_list.empty() && !large_list.empty()) {
+    uint32 small_index = small_list.back();
+    uint32 large_index = large_list.back();
+    small_list.pop_back();
+    large_list.pop_back();
+
+    threshold_list[small_index] = scaled[small_index];
+    alias_list[small_index] = large_index;
+    scaled[large_index] = (scaled[large_index] + scaled[small_index]) - 1.0;
+
+    if (scaled[large_index] < 1.0) {
+      small_list.push_back(large_index);
+    } else {
+      large_list.push_back(large_index);
+    }
+  }
+
+  // Whatever remains is full up to rounding error.
+  for (uint32 i = 0; i < large_list.size(); i++) {
+    threshold_list[large_list[i]] = 1.0f;
+    alias_list[large_list[i]] = large_list[i];
+  }
+
+  for (uint32 i = 0; i < small_list.size(); i++) {
+    threshold_list[small_list[i]] = 1.0f;
+    alias_list[small_list[i]] = small_list[i];
+  }
+
+  return true;
+}
+
+bool alias_table::is_empty() const { return probability_list.empty(); }
+
+uint32 alias_table::sample(float32 u1, float32 u2) const {
+  uint32 count = threshold_list.size();
+  uint32 bucket = u1 * count;
+
+  if (bucket >= count) {
+    bucket = count - 1;
+  }
+
+  return (u2 < threshold_list[bucket]) ? bucket : alias_list[bucket];
+}
+
+float32 alias_table::query_probability(uint32 index) const {
+  return probability_list[index];
+}
+
+}  // namespace base
@@ -0,0 +1,63 @@
+/*
+//
+// Copyright (c) 1998-2014 Joe Bertolami. All Right Reserved.
+//
+//   Redistribution and use in source and binary forms, with or without
+//   modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, CLUDG, BUT NOT LIMITED TO, THE
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//   ARE DISCLAIMED.  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//   LIABLE FOR ANY DIRECT, DIRECT, CIDENTAL, SPECIAL, EXEMPLARY, OR
+//   CONSEQUENTIAL DAMAGES (CLUDG, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+//   GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSESS TERRUPTION)
+//   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER  CONTRACT, STRICT
+//   LIABILITY, OR TORT (CLUDG NEGLIGENCE OR OTHERWISE) ARISG  ANY WAY  OF THE
+//   USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Additional Information:
+//
+//   For more information, visit http://www.bertolami.com.
+//
+*/
+
+#ifndef __ALIAS_H__
+#define __ALIAS_H__
+
+#include <vector>
+#include "base.h"
+
+namespace base {
+
+// Walker's alias method for drawing from a discrete distribution in constant
+// time, regardless of the number of outcomes.
+class alias_table {
+ public:
+  alias_table();
+  // Builds the table from non-negative (unnormalized) weights. Returns false
+  // if the weights sum to zero, in which case the table is left empty.
+  bool initialize(const std::vector<float32>& weights);
+  // Returns true if the table has no outcomes to draw from.
+  bool is_empty() const;
+  // Draws an outcome from two independent uniform variates in [0, 1).
+  uint32 sample(float32 u1, float32 u2) const;
+  // Returns the probability with which sample() selects the outcome.
+  float32 query_probability(uint32 index) const;
+
+ private:
+  std::vector<float32> probability_list;
+  std::vector<float32> threshold_list;
+  std::vector<uint32> alias_list;
+};
+
+}  // namespace base
+
+#endif  // __ALIAS_H__
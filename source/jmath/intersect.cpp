@@ -42,6 +42,25 @@ bool bounds_intersect_bounds(const bounds &p_bounds,
          fabs(abDelta.z) <= (aExtents.z + bExtents.z);
 }
 
+bool sphere_intersect_bounds(const vector3 &center, float32 radius,
+                             const bounds &p_bounds) {
+  // Arvo's method: accumulate the squared distance from the sphere center to
+  // the closest point on the bounds, one axis at a time.
+  float32 distance_squared = 0.0f;
+
+  for (uint8 i = 0; i < 3; i++) {
+    if (center[i] < p_bounds.bounds_min[i]) {
+      float32 delta = p_bounds.bounds_min[i] - center[i];
+      distance_squared += delta * delta;
+    } else if (center[i] > p_bounds.bounds_max[i]) {
+      float32 delta = center[i] - p_bounds.bounds_max[i];
+      distance_squared += delta * delta;
+    }
+  }
+
+  return distance_squared <= radius * radius;
+}
+
 bool point_in_plane(const plane &input, const vector3 &pt) {
   return compare_epsilon(input.dot(pt) + input.w, 0.0);
 }
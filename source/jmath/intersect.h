@@ -88,6 +88,8 @@ bool plane_intersect_plane(const plane& p1, const plane& p2, ray* out_ray);
 bool bounds_intersect_plane(const bounds& pBounds, const plane& pPlane);
 bool bounds_intersect_bounds(const bounds& pBounds,
                              const bounds& within_bounds);
+bool sphere_intersect_bounds(const vector3& center, float32 radius,
+                             const bounds& pBounds);
 // World space coordinate -> screen coordinate.
 const vector3 unproject_vector(const vector3& src, const matrix4& transform);
 // Screen coordinate -> world space coordinate.
@@ -36,6 +36,13 @@ vector3 normal_sphere::random_normal() {
 vector3 normal_sphere::random_reflection(const vector3& incident,
                                          const vector3& normal,
                                          float32 solid_angle) {
+  return random_reflection(incident, normal, solid_angle, random_integer());
+}
+
+vector3 normal_sphere::random_reflection(const vector3& incident,
+                                         const vector3& normal,
+                                         float32 solid_angle,
+                                         uint64 random_value) {
   // Two methods:
   // 1. Pick a random diffuse vector and the perfect reflection vector.
   //    Then interpolate between the two according to the solid angle.
@@ -43,8 +50,12 @@ vector3 normal_sphere::random_reflection(const vector3& incident,
   //    Rotate the reflection vector about the diffuse vector,
   //    according to the solid angle.
 
+  if (normal_list.empty()) {
+    initialize(32 * 1024);
+  }
+
   vector3 reflect_dir = incident.reflect(normal);
-  vector3 diffuse_dir = random_normal();
+  vector3 diffuse_dir = normal_list[random_value % normal_list.size()];
 
   if (diffuse_dir.dot(normal) < 0.0) {
     diffuse_dir = diffuse_dir * -1.0f;
@@ -48,6 +48,10 @@ class normal_sphere {
   // Returns a random reflection normal within the solid angle envelope.
   vector3 random_reflection(const vector3& incident, const vector3& normal,
                             float32 solidangle);
+  // As above, but picks the random diffuse vector with random_value instead
+  // of the shared generator, so that callers can supply their own streams.
+  vector3 random_reflection(const vector3& incident, const vector3& normal,
+                            float32 solidangle, uint64 random_value);
   // Returns a random refraction normal within the solid angle envelope.
   vector3 random_refraction(const vector3& incident, const vector3& normal,
                             float32 solidangle, float32 index);
@@ -48,4 +48,65 @@ float32 random_float_range(float32 imin, float32 imax) {
   return imin + random_float() * (imax - imin);
 }
 
+// The SplitMix64 finalizer, which scrambles every input bit into every output
+// bit. See http://xoshiro.di.unimi.it/splitmix64.c.
+inline uint64 mix_random_bits(uint64 x) {
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ull;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBull;
+  x ^= x >> 31;
+  return x;
+}
+
+const uint64 random_golden_gamma = 0x9E3779B97F4A7C15ull;
+
+uint64 random_key(uint64 a, uint64 b, uint64 c) {
+  uint64 key = mix_random_bits(a + random_golden_gamma);
+  key = mix_random_bits(key ^ (b + random_golden_gamma));
+  return mix_random_bits(key ^ (c + random_golden_gamma));
+}
+
+random_stream::random_stream(uint64 key) : key_(key), counter_(0) {}
+
+uint64 random_stream::random_integer() {
+  counter_++;
+  return mix_random_bits(key_ + counter_ * random_golden_gamma);
+}
+
+float32 random_stream::random_float() {
+  // The top 24 bits fill the float's mantissa exactly.
+  return (float32)(random_integer() >> 40) / 16777216.0f;
+}
+
+int64 random_stream::random_integer_range(int32 imin, int32 imax) {
+  if (BASE_PARAM_CHECK) {
+    if (imax < imin) {
+      return 0;
+    }
+  }
+
+  if (imin == imax) return imin;
+  uint32 span = (imax - imin) + 1;
+  return ((int32)imin + (random_integer() % span));
+}
+
+float32 random_stream::random_float_range(float32 imin, float32 imax) {
+  if (BASE_PARAM_CHECK) {
+    if (imax < imin) {
+      return 0.0f;
+    }
+  }
+
+  return imin + random_float() * (imax - imin);
+}
+
+void random_stream::random_integers(uint64* output, uint32 count) {
+  for (uint32 i = 0; i < count; i++) {
+    uint64 counter = counter_ + i + 1;
+    output[i] = mix_random_bits(key_ + counter * random_golden_gamma);
+  }
+  counter_ += count;
+}
+
 }  // namespace base
\ No newline at end of file
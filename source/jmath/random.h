@@ -44,6 +44,32 @@ float32 random_float();   // returns a range of 0...1
 int64 random_integer_range(int32 imin, int32 imax);
 float32 random_float_range(float32 imin, float32 imax);
 
+// Combines three values (e.g. a pass, a surface and a lumel) into a key for a
+// random_stream.
+uint64 random_key(uint64 a, uint64 b, uint64 c);
+
+// A counter-based random number stream. Each value is a pure function of the
+// key and of the number of values drawn before it, so a stream produces the
+// same sequence on any thread and in any order relative to other streams.
+class random_stream {
+ public:
+  explicit random_stream(uint64 key);
+
+  uint64 random_integer();  // returns a range of 0...BASE_MAX_UINT64
+  float32 random_float();   // returns a range of 0...1
+
+  int64 random_integer_range(int32 imin, int32 imax);
+  float32 random_float_range(float32 imin, float32 imax);
+
+  // Writes the next count values of the stream to output. The values do not
+  // depend on one another, so the loop vectorizes.
+  void random_integers(uint64* output, uint32 count);
+
+ private:
+  uint64 key_;
+  uint64 counter_;
+};
+
 }  // namespace base
 
 #endif  // __VN_RANDOM_H__
\ No newline at end of file
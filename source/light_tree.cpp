@@ -0,0 +1,105 @@
+#include "light_tree.h"
+
+#include <algorithm>
+
+#include "assets.h"
+#include "jmath/random.h"
+
+LightTree::LightTree() {}
+
+void LightTree::Build(const ::std::vector<Light>& lights) {
+  nodes_.clear();
+
+  if (lights.empty()) {
+    return;
+  }
+
+  ::std::vector<uint32> indices(lights.size());
+  for (uint32 i = 0; i < lights.size(); i++) {
+    indices[i] = i;
+  }
+
+  // A binary tree with n leaves always has 2n - 1 nodes.
+  nodes_.reserve(2 * lights.size() - 1);
+  BuildSubtree(lights, &indices, 0, lights.size());
+}
+
+bool LightTree::IsEmpty() const { return nodes_.empty(); }
+
+const LightTreeNode& LightTree::QueryNode(uint32 index) const {
+  return nodes_[index];
+}
+
+uint32 LightTree::QueryNodeCount() const { return nodes_.size(); }
+
+int32 LightTree::BuildSubtree(const ::std::vector<Light>& lights,
+                              ::std::vector<uint32>* indices, uint32 start,
+                              uint32 end) {
+  int32 node_index = nodes_.size();
+  nodes_.emplace_back();
+
+  if (end - start == 1) {
+    const Light& light = lights[indices->at(start)];
+    LightTreeNode& leaf = nodes_[node_index];
+    leaf.bounds += light.position_;
+    leaf.intensity = vector3(light.color_.x, light.color_.y, light.color_.z) *
+                     light.intensity_;
+    leaf.influence_radius = light.influence_radius_;
+    leaf.light_count = 1;
+    leaf.representative = indices->at(start);
+    leaf.children[0] = -1;
+    leaf.children[1] = -1;
+    return node_index;
+  }
+
+  // Split the cluster at the median of its longest axis.
+  ::base::bounds cluster_bounds;
+  for (uint32 i = start; i < end; i++) {
+    cluster_bounds += lights[indices->at(i)].position_;
+  }
+
+  vector3 extents = cluster_bounds.bounds_max - cluster_bounds.bounds_min;
+  uint32 axis = 0;
+  if (extents.y > extents.v[axis]) axis = 1;
+  if (extents.z > extents.v[axis]) axis = 2;
+
+  uint32 middle = start + (end - start) / 2;
+  ::std::nth_element(indices->begin() + start, indices->begin() + middle,
+                     indices->begin() + end, [&](uint32 a, uint32 b) {
+                       return lights[a].position_.v[axis] <
+                              lights[b].position_.v[axis];
+                     });
+
+  int32 left = BuildSubtree(lights, indices, start, middle);
+  int32 right = BuildSubtree(lights, indices, middle, end);
+
+  // Children are fetched only after both recursive calls have grown nodes_.
+  const LightTreeNode& left_node = nodes_[left];
+  const LightTreeNode& right_node = nodes_[right];
+  LightTreeNode& node = nodes_[node_index];
+
+  node.bounds = left_node.bounds + right_node.bounds;
+  node.intensity = left_node.intensity + right_node.intensity;
+  node.influence_radius =
+      max(left_node.influence_radius, right_node.influence_radius);
+  node.light_count = left_node.light_count + right_node.light_count;
+  node.children[0] = left;
+  node.children[1] = right;
+
+  // Pick one of the child representatives in proportion to its intensity, so
+  // that the cluster estimate remains unbiased.
+  float32 left_weight = left_node.intensity.x + left_node.intensity.y +
+                        left_node.intensity.z;
+  float32 right_weight = right_node.intensity.x + right_node.intensity.y +
+                         right_node.intensity.z;
+  float32 total_weight = left_weight + right_weight;
+
+  if (total_weight <= 0.0f ||
+      ::base::random_float() * total_weight < left_weight) {
+    node.representative = left_node.representative;
+  } else {
+    node.representative = right_node.representative;
+  }
+
+  return node_index;
+}
@@ -0,0 +1,87 @@
+/*
+//
+// Copyright (c) 1998-2014 Joe Bertolami. All Right Reserved.
+//
+//   Redistribution and use in source and binary forms, with or without
+//   modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, CLUDG, BUT NOT LIMITED TO, THE
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//   ARE DISCLAIMED.  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//   LIABLE FOR ANY DIRECT, DIRECT, CIDENTAL, SPECIAL, EXEMPLARY, OR
+//   CONSEQUENTIAL DAMAGES (CLUDG, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+//   GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSESS TERRUPTION)
+//   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER  CONTRACT, STRICT
+//   LIABILITY, OR TORT (CLUDG NEGLIGENCE OR OTHERWISE) ARISG  ANY WAY  OF THE
+//   USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Additional Information:
+//
+//   For more information, visit http://www.bertolami.com.
+//
+*/
+
+#ifndef __LIGHT_TREE_H__
+#define __LIGHT_TREE_H__
+
+#include <vector>
+
+#include "jmath/base.h"
+#include "jmath/vector3.h"
+#include "jmath/volume.h"
+
+using ::base::float32;
+using ::base::int32;
+using ::base::uint32;
+using ::base::vector3;
+
+class Light;
+
+typedef struct LightTreeNode {
+  // The bounds of every light position within the cluster.
+  ::base::bounds bounds;
+  // The summed color * intensity of every light within the cluster.
+  vector3 intensity;
+  // The largest influence radius of any light within the cluster.
+  float32 influence_radius;
+  // The number of lights within the cluster.
+  uint32 light_count;
+  // The light that stands in for the whole cluster when it is evaluated.
+  uint32 representative;
+  // Child node indices, or -1 for leaf nodes.
+  int32 children[2];
+} LightTreeNode;
+
+// A binary hierarchy of light clusters used to select a lightcut (a set of
+// clusters that together cover every light) for each lumel. Node 0 is the
+// root.
+class LightTree {
+ public:
+  LightTree();
+  // Builds the hierarchy over the supplied lights, discarding any prior state.
+  void Build(const ::std::vector<Light>& lights);
+  // Returns true if the tree contains no lights.
+  bool IsEmpty() const;
+  // Returns the node at the specified index.
+  const LightTreeNode& QueryNode(uint32 index) const;
+  // Returns the number of nodes in the tree.
+  uint32 QueryNodeCount() const;
+
+ private:
+  // Recursively builds the subtree over indices [start, end) and returns the
+  // index of its root node.
+  int32 BuildSubtree(const ::std::vector<Light>& lights,
+                     ::std::vector<uint32>* indices, uint32 start, uint32 end);
+
+  ::std::vector<LightTreeNode> nodes_;
+};
+
+#endif  // __LIGHT_TREE_H__
@@ -0,0 +1,74 @@
+#include "lightmap_arena.h"
+
+#if !defined(BASE_PLATFORM_WINDOWS)
+#include <sys/mman.h>
+#endif
+
+LightmapArena::LightmapArena() : data_(NULL), size_(0), huge_pages_(false) {}
+
+LightmapArena::~LightmapArena() { Release(); }
+
+bool LightmapArena::Allocate(uint64 size) {
+  Release();
+
+  if (!size) {
+    return true;
+  }
+
+#if defined(BASE_PLATFORM_WINDOWS)
+  // Large pages need the lock pages privilege and a size that is a multiple
+  // of the large page size, so we fall back to normal pages without them.
+  uint64 large_page_size = GetLargePageMinimum();
+  if (large_page_size && size >= large_page_size) {
+    uint64 large_size =
+        (size + large_page_size - 1) / large_page_size * large_page_size;
+    data_ = (uint8*)VirtualAlloc(NULL, large_size,
+                                 MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                                 PAGE_READWRITE);
+    huge_pages_ = (NULL != data_);
+  }
+
+  if (!data_) {
+    data_ = (uint8*)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT,
+                                 PAGE_READWRITE);
+  }
+#else
+  void* block = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  data_ = (MAP_FAILED == block) ? NULL : (uint8*)block;
+
+#if defined(MADV_HUGEPAGE)
+  // Transparent huge pages are only a hint, and the block stays usable if the
+  // kernel declines it.
+  huge_pages_ = data_ && 0 == madvise(data_, size, MADV_HUGEPAGE);
+#endif
+#endif
+
+  if (!data_) {
+    huge_pages_ = false;
+    return false;
+  }
+
+  size_ = size;
+  return true;
+}
+
+void LightmapArena::Release() {
+  if (data_) {
+#if defined(BASE_PLATFORM_WINDOWS)
+    VirtualFree(data_, 0, MEM_RELEASE);
+#else
+    munmap(data_, size_);
+#endif
+  }
+
+  data_ = NULL;
+  size_ = 0;
+  huge_pages_ = false;
+}
+
+uint8* LightmapArena::QueryData() const { return data_; }
+
+uint64 LightmapArena::QuerySize() const { return size_; }
+
+bool LightmapArena::IsUsingHugePages() const { return huge_pages_; }
@@ -0,0 +1,69 @@
+/*
+//
+// Copyright (c) 1998-2014 Joe Bertolami. All Right Reserved.
+//
+//   Redistribution and use in source and binary forms, with or without
+//   modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, CLUDG, BUT NOT LIMITED TO, THE
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//   ARE DISCLAIMED.  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//   LIABLE FOR ANY DIRECT, DIRECT, CIDENTAL, SPECIAL, EXEMPLARY, OR
+//   CONSEQUENTIAL DAMAGES (CLUDG, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+//   GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSESS TERRUPTION)
+//   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER  CONTRACT, STRICT
+//   LIABILITY, OR TORT (CLUDG NEGLIGENCE OR OTHERWISE) ARISG  ANY WAY  OF THE
+//   USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Additional Information:
+//
+//   For more information, visit http://www.bertolami.com.
+//
+*/
+
+#ifndef __LIGHTMAP_ARENA_H__
+#define __LIGHTMAP_ARENA_H__
+
+#include "jmath/base.h"
+
+using ::base::uint64;
+using ::base::uint8;
+
+// A single zeroed block of memory that holds the pixels of every lightmap, so
+// that the bake, the lightmap file and texture uploads all work on one
+// contiguous buffer. Large blocks are backed by huge pages where the system
+// allows it.
+class LightmapArena {
+ public:
+  LightmapArena();
+  ~LightmapArena();
+  // Allocates size zeroed bytes, discarding any prior block. Returns false if
+  // the memory could not be allocated.
+  bool Allocate(uint64 size);
+  // Frees the block, if any.
+  void Release();
+  // Returns the first byte of the block.
+  uint8* QueryData() const;
+  // Returns the size of the block in bytes.
+  uint64 QuerySize() const;
+  // Returns true if the block is backed by huge pages.
+  bool IsUsingHugePages() const;
+
+ private:
+  LightmapArena(const LightmapArena&) = delete;
+  LightmapArena& operator=(const LightmapArena&) = delete;
+
+  uint8* data_;
+  uint64 size_;
+  bool huge_pages_;
+};
+
+#endif  // __LIGHTMAP_ARENA_H__
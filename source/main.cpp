@@ -29,7 +29,11 @@
 //
 */
 
+#include <atomic>
+#include <cctype>
 #include <chrono>
+#include <csignal>
+#include <cstdlib>
 #include <iostream>
 #include <memory>
 #include <vector>
@@ -42,14 +46,22 @@
 
 #define WINDOW_WIDTH (1024.0)
 #define WINDOW_HEIGHT (768.0)
+#define MAX_THREAD_COUNT (1024)
+#define MAX_SHARD_COUNT (65536)
 
 using namespace base;
 using ::std::cout;
 using ::std::endl;
 using ::std::make_unique;
+using ::std::string;
 using ::std::unique_ptr;
 using ::std::vector;
 
+/* Set by Ctrl+C while the lightmaps bake. */
+::std::atomic<bool> bake_cancelled(false);
+
+void CancelBake(int) { bake_cancelled = true; }
+
 float32 GetFrameTimeElapsed() {
   static ::std::chrono::steady_clock::time_point last_time =
       ::std::chrono::high_resolution_clock::now();
@@ -89,28 +101,147 @@ void RenderFrame(const World& world, bool textures_enabled,
   glMatrixMode(GL_PROJECTION);
   glLoadMatrixf(projection.m);
 
-  world.Draw(textures_enabled, lighting_enabled, gi_enabled);
+  world.Draw(eye, textures_enabled, lighting_enabled, gi_enabled);
+}
+
+// Parses the decimal number at the start of text into value. Returns false
+// unless the number is followed by terminator and is at most max_value.
+bool ParseCount(const char* text, char terminator, uint32 max_value,
+                uint32* value) {
+  // strtoul would accept leading spaces and wrap negative numbers around.
+  if (!isdigit((unsigned char)text[0])) {
+    return false;
+  }
+
+  char* end = NULL;
+  unsigned long parsed = strtoul(text, &end, 10);
+  if (*end != terminator || parsed > max_value) {
+    return false;
+  }
+
+  *value = parsed;
+  return true;
+}
+
+// Parses the options that follow the world filename. Returns false if any
+// option is not recognized.
+bool ParseWorldOptions(int argc, char** argv, WorldOptions* options) {
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--accel=auto") {
+      options->acceleration_structure = kAccelerationAuto;
+    } else if (option == "--accel=bvh") {
+      options->acceleration_structure = kAccelerationBvh;
+    } else if (option == "--accel=grid") {
+      options->acceleration_structure = kAccelerationGrid;
+    } else if (option.compare(0, 10, "--threads=") == 0) {
+      if (!ParseCount(option.c_str() + 10, '\0', MAX_THREAD_COUNT,
+                      &options->thread_count)) {
+        cout << "Expected --threads=<count>, with at most " << MAX_THREAD_COUNT
+             << " threads." << endl;
+        return false;
+      }
+    } else if (option == "--direct-barrier") {
+      options->direct_barrier = true;
+    } else if (option == "--estimate") {
+      options->estimate_only = true;
+    } else if (option == "--resume") {
+      options->resume = true;
+    } else if (option.compare(0, 8, "--shard=") == 0) {
+      // The shard is given as <index>/<count>.
+      size_t slash = option.find('/');
+      if (slash == string::npos ||
+          !ParseCount(option.c_str() + 8, '/', MAX_SHARD_COUNT,
+                      &options->shard_index) ||
+          !ParseCount(option.c_str() + slash + 1, '\0', MAX_SHARD_COUNT,
+                      &options->shard_count)) {
+        cout << "Expected --shard=<index>/<count>, with at most "
+             << MAX_SHARD_COUNT << " shards." << endl;
+        return false;
+      }
+
+      if (options->shard_index >= options->shard_count) {
+        cout << "Shard " << options->shard_index << " is not one of "
+             << options->shard_count << " shards." << endl;
+        return false;
+      }
+    } else if (option == "--shard-by-cost") {
+      options->shard_by_cost = true;
+    } else if (option.compare(0, 8, "--merge=") == 0) {
+      if (!ParseCount(option.c_str() + 8, '\0', MAX_SHARD_COUNT,
+                      &options->merge_shard_count) ||
+          !options->merge_shard_count) {
+        cout << "Expected --merge=<count>, with 1 to " << MAX_SHARD_COUNT
+             << " shards." << endl;
+        return false;
+      }
+    } else {
+      cout << "Unrecognized option " << option << "." << endl;
+      return false;
+    }
+  }
+
+  // A merge or an estimate does not bake, so the bake options would be
+  // silently ignored.
+  if (options->shard_by_cost && !options->shard_count) {
+    cout << "--shard-by-cost only applies with --shard." << endl;
+    return false;
+  }
+
+  if (options->merge_shard_count &&
+      (options->shard_count || options->estimate_only || options->resume)) {
+    cout << "--merge cannot be combined with --shard, --estimate or --resume."
+         << endl;
+    return false;
+  }
+
+  if (options->estimate_only && (options->shard_count || options->resume)) {
+    cout << "--estimate cannot be combined with --shard or --resume." << endl;
+    return false;
+  }
+
+  return true;
 }
 
 int main(int argc, char** argv) {
-  if (argc < 2) {
-    cout << "Usage: x.exe <world filename>" << endl;
+  WorldOptions options;
+  if (argc < 2 || !ParseWorldOptions(argc, argv, &options)) {
+    cout << "Usage: x.exe <world filename> [--accel=auto|bvh|grid] "
+         << "[--threads=<count>] [--direct-barrier] [--estimate] [--resume] "
+         << "[--shard=<index>/<count> [--shard-by-cost]] [--merge=<count>]"
+         << endl;
     return 0;
   }
 
-  /* Create a queue for input events. */
+  /* Create a queue for input events, and a window unless the world will not
+     be drawn. */
   vector<InputEvent> window_events;
-  auto window = make_unique<GraphicsWindow>("Project X: Demo Zero", 100, 10,
-                                            WINDOW_WIDTH, WINDOW_HEIGHT, 32, 0);
+  unique_ptr<GraphicsWindow> window;
+  if (IsInteractive(options)) {
+    window = make_unique<GraphicsWindow>("Project X: Demo Zero", 100, 10,
+                                         WINDOW_WIDTH, WINDOW_HEIGHT, 32, 0);
+  }
+
+  /* Load our map and initialize our lightmaps. Ctrl+C cancels the bake, which
+     leaves any previous lightmap file in place. */
+  options.cancel_bake = &bake_cancelled;
+  signal(SIGINT, CancelBake);
+  World demo_world(argv[1], options);
+  signal(SIGINT, SIG_DFL);
 
-  /* Load our map and initialize our lightmaps. */
-  World demo_world(argv[1]);
+  if (bake_cancelled) {
+    return 0;
+  }
 
   if (!demo_world.IsValid()) {
     cout << "Failed to load world file " << argv[1] << "." << endl;
     return 0;
   }
 
+  if (!IsInteractive(options)) {
+    return 0;
+  }
+
   glEnable(GL_POLYGON_SMOOTH);
   glShadeModel(GL_SMOOTH);
   glClearDepth(1.0f);
@@ -0,0 +1,97 @@
+#include "mapped_file.h"
+
+#if !defined(BASE_PLATFORM_WINDOWS)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(BASE_PLATFORM_WINDOWS)
+MappedFile::MappedFile()
+    : file_(INVALID_HANDLE_VALUE), mapping_(NULL), data_(NULL), size_(0) {}
+#else
+MappedFile::MappedFile() : file_(-1), data_(NULL), size_(0) {}
+#endif
+
+MappedFile::~MappedFile() { Close(); }
+
+bool MappedFile::Open(const ::std::string& filename) {
+  Close();
+
+#if defined(BASE_PLATFORM_WINDOWS)
+  file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (INVALID_HANDLE_VALUE == file_) {
+    return false;
+  }
+
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file_, &file_size) || !file_size.QuadPart) {
+    Close();
+    return false;
+  }
+
+  mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!mapping_) {
+    Close();
+    return false;
+  }
+
+  data_ = (const uint8*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+  size_ = file_size.QuadPart;
+#else
+  file_ = open(filename.c_str(), O_RDONLY);
+  if (file_ < 0) {
+    return false;
+  }
+
+  struct stat file_status;
+  if (fstat(file_, &file_status) || !file_status.st_size) {
+    Close();
+    return false;
+  }
+
+  void* view = mmap(NULL, file_status.st_size, PROT_READ, MAP_SHARED, file_, 0);
+  data_ = (MAP_FAILED == view) ? NULL : (const uint8*)view;
+  size_ = file_status.st_size;
+#endif
+
+  if (!data_) {
+    Close();
+    return false;
+  }
+
+  return true;
+}
+
+void MappedFile::Close() {
+#if defined(BASE_PLATFORM_WINDOWS)
+  if (data_) {
+    UnmapViewOfFile(data_);
+  }
+  if (mapping_) {
+    CloseHandle(mapping_);
+  }
+  if (INVALID_HANDLE_VALUE != file_) {
+    CloseHandle(file_);
+  }
+  file_ = INVALID_HANDLE_VALUE;
+  mapping_ = NULL;
+#else
+  if (data_) {
+    munmap((void*)data_, size_);
+  }
+  if (file_ >= 0) {
+    close(file_);
+  }
+  file_ = -1;
+#endif
+  data_ = NULL;
+  size_ = 0;
+}
+
+bool MappedFile::IsOpen() const { return NULL != data_; }
+
+const uint8* MappedFile::QueryData() const { return data_; }
+
+uint64 MappedFile::QuerySize() const { return size_; }
@@ -0,0 +1,74 @@
+/*
+//
+// Copyright (c) 1998-2014 Joe Bertolami. All Right Reserved.
+//
+//   Redistribution and use in source and binary forms, with or without
+//   modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, CLUDG, BUT NOT LIMITED TO, THE
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//   ARE DISCLAIMED.  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//   LIABLE FOR ANY DIRECT, DIRECT, CIDENTAL, SPECIAL, EXEMPLARY, OR
+//   CONSEQUENTIAL DAMAGES (CLUDG, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+//   GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSESS TERRUPTION)
+//   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER  CONTRACT, STRICT
+//   LIABILITY, OR TORT (CLUDG NEGLIGENCE OR OTHERWISE) ARISG  ANY WAY  OF THE
+//   USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Additional Information:
+//
+//   For more information, visit http://www.bertolami.com.
+//
+*/
+
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+#include <string>
+
+#include "jmath/base.h"
+
+using ::base::uint64;
+using ::base::uint8;
+
+// A read-only view of an entire file mapped into memory. The view remains
+// valid until Close is called or the object is destroyed.
+class MappedFile {
+ public:
+  MappedFile();
+  ~MappedFile();
+  // Maps filename, discarding any prior mapping. Returns false if the file
+  // does not exist, is empty, or cannot be mapped.
+  bool Open(const ::std::string& filename);
+  // Unmaps the file, if any.
+  void Close();
+  // Returns true if a file is currently mapped.
+  bool IsOpen() const;
+  // Returns the first byte of the mapped file.
+  const uint8* QueryData() const;
+  // Returns the size of the mapped file in bytes.
+  uint64 QuerySize() const;
+
+ private:
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+#if defined(BASE_PLATFORM_WINDOWS)
+  HANDLE file_;
+  HANDLE mapping_;
+#else
+  int file_;
+#endif
+  const uint8* data_;
+  uint64 size_;
+};
+
+#endif  // __MAPPED_FILE_H__
@@ -0,0 +1,266 @@
+#include "shadow_cube.h"
+
+#include <cmath>
+
+#include "jmath/scalar.h"
+
+#define SHADOW_CUBE_NEAR_DEPTH (0.01f)
+#define SHADOW_CUBE_FILTER_RADIUS (1)
+#define SHADOW_CUBE_DEPTH_BIAS_RATIO (0.001f)
+#define SHADOW_CUBE_MIN_COSINE (0.1f)
+#define SHADOW_CUBE_DISCONTINUITY_RATIO (0.05f)
+
+using ::base::matrix4;
+using ::base::vector4;
+
+// The view axis and up vector of each cube face: +x, -x, +y, -y, +z, -z.
+static const vector3 cube_face_views[6] = {
+    vector3(1, 0, 0), vector3(-1, 0, 0), vector3(0, 1, 0),
+    vector3(0, -1, 0), vector3(0, 0, 1), vector3(0, 0, -1)};
+static const vector3 cube_face_ups[6] = {
+    vector3(0, 1, 0), vector3(0, 1, 0), vector3(0, 0, 1),
+    vector3(0, 0, 1), vector3(0, 1, 0), vector3(0, 1, 0)};
+
+// Returns the face whose view axis is most closely aligned with direction.
+inline uint32 SelectCubeFace(const vector3& direction) {
+  float32 ax = fabs(direction.x);
+  float32 ay = fabs(direction.y);
+  float32 az = fabs(direction.z);
+
+  if (ax >= ay && ax >= az) {
+    return direction.x >= 0 ? 0 : 1;
+  } else if (ay >= az) {
+    return direction.y >= 0 ? 2 : 3;
+  }
+
+  return direction.z >= 0 ? 4 : 5;
+}
+
+// Returns the point where the edge a->b crosses the near plane (w = near).
+inline vector4 ClipEdgeToNearPlane(const vector4& a, const vector4& b) {
+  float32 t = (SHADOW_CUBE_NEAR_DEPTH - a.w) / (b.w - a.w);
+  return vector4(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t,
+                 a.z + (b.z - a.z) * t, SHADOW_CUBE_NEAR_DEPTH);
+}
+
+ShadowCubeMap::ShadowCubeMap() : resolution_(0) {}
+
+void ShadowCubeMap::Initialize(const vector3& origin, uint32 resolution,
+                               float32 far_depth) {
+  origin_ = origin;
+  resolution_ = resolution;
+
+  matrix4 projection;
+  projection.perspective(BASE_PI / 2.0f, 1.0f, SHADOW_CUBE_NEAR_DEPTH,
+                         max(far_depth, 2.0f * SHADOW_CUBE_NEAR_DEPTH));
+
+  for (uint32 i = 0; i < 6; i++) {
+    matrix4 view;
+    view.look_at(origin, origin + cube_face_views[i], cube_face_ups[i]);
+
+    // The view rows are only approximately unit length (normalize uses a fast
+    // square root), so we invert them exactly to recover the direction that
+    // a clip space point at w = 1 maps back to.
+    vector3 right(view[0], view[4], view[8]);
+    vector3 up(view[1], view[5], view[9]);
+    vector3 forward(-view[2], -view[6], -view[10]);
+    face_rights_[i] = right / right.dot(right);
+    face_ups_[i] = up / up.dot(up);
+    face_views_[i] = forward / forward.dot(forward);
+    face_transforms_[i] = projection * view;
+    depths_[i].assign(resolution * resolution, BASE_INFINITY);
+  }
+}
+
+bool ShadowCubeMap::IsEmpty() const { return 0 == resolution_; }
+
+void ShadowCubeMap::RasterizeTriangle(const vector3& v0, const vector3& v1,
+                                      const vector3& v2) {
+  for (uint32 face = 0; face < 6; face++) {
+    const matrix4& transform = face_transforms_[face];
+    vector4 clip[3] = {transform * vector4(v0.x, v0.y, v0.z, 1.0f),
+                       transform * vector4(v1.x, v1.y, v1.z, 1.0f),
+                       transform * vector4(v2.x, v2.y, v2.z, 1.0f)};
+
+    // Trivially reject triangles that lie entirely outside one of the side
+    // planes or behind the near plane of this face.
+    bool outside = false;
+    for (uint32 plane = 0; plane < 5 && !outside; plane++) {
+      uint32 outside_count = 0;
+      for (uint32 i = 0; i < 3; i++) {
+        switch (plane) {
+          case 0: outside_count += clip[i].x > clip[i].w; break;
+          case 1: outside_count += clip[i].x < -clip[i].w; break;
+          case 2: outside_count += clip[i].y > clip[i].w; break;
+          case 3: outside_count += clip[i].y < -clip[i].w; break;
+          case 4: outside_count += clip[i].w < SHADOW_CUBE_NEAR_DEPTH; break;
+        }
+      }
+      outside = (3 == outside_count);
+    }
+
+    if (outside) {
+      continue;
+    }
+
+    // Clip against the near plane, which may split the triangle into a quad.
+    vector4 polygon[4];
+    uint32 vertex_count = 0;
+    for (uint32 i = 0; i < 3; i++) {
+      const vector4& a = clip[i];
+      const vector4& b = clip[(i + 1) % 3];
+      bool a_inside = a.w >= SHADOW_CUBE_NEAR_DEPTH;
+      bool b_inside = b.w >= SHADOW_CUBE_NEAR_DEPTH;
+
+      if (a_inside) {
+        polygon[vertex_count++] = a;
+      }
+      if (a_inside != b_inside) {
+        polygon[vertex_count++] = ClipEdgeToNearPlane(a, b);
+      }
+    }
+
+    for (uint32 i = 2; i < vertex_count; i++) {
+      RasterizeClippedTriangle(face, polygon[0], polygon[i - 1], polygon[i]);
+    }
+  }
+}
+
+void ShadowCubeMap::RasterizeClippedTriangle(uint32 face, const vector4& c0,
+                                             const vector4& c1,
+                                             const vector4& c2) {
+  // Project to texel space. Depth is stored as the view distance along the
+  // face axis (clip w), and 1/w interpolates linearly across the face.
+  float32 half_res = 0.5f * resolution_;
+  float32 sx[3] = {(c0.x / c0.w + 1.0f) * half_res,
+                   (c1.x / c1.w + 1.0f) * half_res,
+                   (c2.x / c2.w + 1.0f) * half_res};
+  float32 sy[3] = {(c0.y / c0.w + 1.0f) * half_res,
+                   (c1.y / c1.w + 1.0f) * half_res,
+                   (c2.y / c2.w + 1.0f) * half_res};
+  float32 inv_w[3] = {1.0f / c0.w, 1.0f / c1.w, 1.0f / c2.w};
+
+  float32 area = (sx[1] - sx[0]) * (sy[2] - sy[0]) -
+                 (sx[2] - sx[0]) * (sy[1] - sy[0]);
+  if (fabs(area) < BASE_EPSILON) {
+    return;
+  }
+
+  int32 x_start = max(0, (int32)floor(min(sx[0], min(sx[1], sx[2]))));
+  int32 y_start = max(0, (int32)floor(min(sy[0], min(sy[1], sy[2]))));
+  int32 x_stop =
+      min((int32)resolution_ - 1, (int32)ceil(max(sx[0], max(sx[1], sx[2]))));
+  int32 y_stop =
+      min((int32)resolution_ - 1, (int32)ceil(max(sy[0], max(sy[1], sy[2]))));
+
+  ::std::vector<float32>& depths = depths_[face];
+  float32 inv_area = 1.0f / area;
+
+  for (int32 y = y_start; y <= y_stop; y++) {
+    float32 py = y + 0.5f;
+    for (int32 x = x_start; x <= x_stop; x++) {
+      float32 px = x + 0.5f;
+
+      // Barycentric weights of the texel center via edge functions.
+      float32 b0 = ((sx[1] - px) * (sy[2] - py) - (sx[2] - px) * (sy[1] - py)) *
+                   inv_area;
+      float32 b1 = ((sx[2] - px) * (sy[0] - py) - (sx[0] - px) * (sy[2] - py)) *
+                   inv_area;
+      float32 b2 = 1.0f - b0 - b1;
+
+      if (b0 < 0 || b1 < 0 || b2 < 0) {
+        continue;
+      }
+
+      float32 depth = 1.0f / (b0 * inv_w[0] + b1 * inv_w[1] + b2 * inv_w[2]);
+      float32& stored = depths[y * resolution_ + x];
+      stored = min(stored, depth);
+    }
+  }
+}
+
+ShadowCubeVisibility ShadowCubeMap::QueryVisibility(
+    const vector3& point, const vector3& normal) const {
+  vector3 direction = point - origin_;
+  float32 distance = direction.length();
+
+  // Surfaces seen edge-on from the light need a bias larger than any depth
+  // difference the filter could resolve.
+  if (distance < BASE_EPSILON ||
+      fabs(normal.dot(direction)) < SHADOW_CUBE_MIN_COSINE * distance) {
+    return kShadowCubeUncertain;
+  }
+
+  uint32 face = SelectCubeFace(direction);
+  vector4 clip = face_transforms_[face] * vector4(point.x, point.y, point.z, 1);
+  if (clip.w < SHADOW_CUBE_NEAR_DEPTH) {
+    return kShadowCubeUncertain;
+  }
+
+  float32 half_res = 0.5f * resolution_;
+  int32 tx = (int32)floor((clip.x / clip.w + 1.0f) * half_res);
+  int32 ty = (int32)floor((clip.y / clip.w + 1.0f) * half_res);
+
+  // Filters that reach past the face edge would need the neighbouring face,
+  // so we leave those to an exact ray.
+  if (tx < SHADOW_CUBE_FILTER_RADIUS || ty < SHADOW_CUBE_FILTER_RADIUS ||
+      tx >= (int32)resolution_ - SHADOW_CUBE_FILTER_RADIUS ||
+      ty >= (int32)resolution_ - SHADOW_CUBE_FILTER_RADIUS) {
+    return kShadowCubeUncertain;
+  }
+
+  // Compare each texel against the depth at which its center ray meets the
+  // receiver's plane, so that the bias only needs to absorb rounding error.
+  const vector3& face_view = face_views_[face];
+  const vector3& face_right = face_rights_[face];
+  const vector3& face_up = face_ups_[face];
+  float32 plane_distance = normal.dot(direction);
+  float32 inv_half_res = 1.0f / half_res;
+
+  const ::std::vector<float32>& depths = depths_[face];
+  uint32 occluded_count = 0;
+  uint32 sample_count = 0;
+  float32 min_depth = BASE_INFINITY;
+  float32 max_depth = 0;
+
+  for (int32 y = ty - SHADOW_CUBE_FILTER_RADIUS;
+       y <= ty + SHADOW_CUBE_FILTER_RADIUS; y++) {
+    for (int32 x = tx - SHADOW_CUBE_FILTER_RADIUS;
+         x <= tx + SHADOW_CUBE_FILTER_RADIUS; x++) {
+      vector3 texel_ray = face_view +
+                          face_right * ((x + 0.5f) * inv_half_res - 1.0f) +
+                          face_up * ((y + 0.5f) * inv_half_res - 1.0f);
+      float32 facing = normal.dot(texel_ray);
+      if (fabs(facing) < BASE_EPSILON) {
+        return kShadowCubeUncertain;
+      }
+
+      float32 receiver_depth = plane_distance / facing;
+      if (receiver_depth <= 0) {
+        return kShadowCubeUncertain;
+      }
+      float32 depth = depths[y * resolution_ + x];
+      occluded_count +=
+          depth < receiver_depth * (1.0f - SHADOW_CUBE_DEPTH_BIAS_RATIO);
+      min_depth = min(min_depth, depth);
+      max_depth = max(max_depth, depth);
+      sample_count++;
+    }
+  }
+
+  // Mixed results mark a shadow edge, and a wide depth range marks a
+  // silhouette where thin geometry could fall between texel centers.
+  if (occluded_count != 0 && occluded_count != sample_count) {
+    return kShadowCubeUncertain;
+  }
+
+  if (max_depth - min_depth > SHADOW_CUBE_DISCONTINUITY_RATIO * clip.w) {
+    return kShadowCubeUncertain;
+  }
+
+  return occluded_count ? kShadowCubeOccluded : kShadowCubeVisible;
+}
+
+uint32 ShadowCubeMap::QueryMemoryUsage() const {
+  return 6 * resolution_ * resolution_ * sizeof(float32);
+}
@@ -0,0 +1,96 @@
+/*
+//
+// Copyright (c) 1998-2014 Joe Bertolami. All Right Reserved.
+//
+//   Redistribution and use in source and binary forms, with or without
+//   modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, CLUDG, BUT NOT LIMITED TO, THE
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//   ARE DISCLAIMED.  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//   LIABLE FOR ANY DIRECT, DIRECT, CIDENTAL, SPECIAL, EXEMPLARY, OR
+//   CONSEQUENTIAL DAMAGES (CLUDG, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+//   GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSESS TERRUPTION)
+//   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER  CONTRACT, STRICT
+//   LIABILITY, OR TORT (CLUDG NEGLIGENCE OR OTHERWISE) ARISG  ANY WAY  OF THE
+//   USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Additional Information:
+//
+//   For more information, visit http://www.bertolami.com.
+//
+*/
+
+#ifndef __SHADOW_CUBE_H__
+#define __SHADOW_CUBE_H__
+
+#include <vector>
+
+#include "jmath/base.h"
+#include "jmath/matrix4.h"
+#include "jmath/vector3.h"
+
+using ::base::float32;
+using ::base::int32;
+using ::base::uint32;
+using ::base::vector3;
+
+typedef enum ShadowCubeVisibility {
+  // Every filtered depth sample places the point in front of its occluders.
+  kShadowCubeVisible,
+  // Every filtered depth sample places the point behind an occluder.
+  kShadowCubeOccluded,
+  // The samples disagree or straddle a depth discontinuity, so the caller
+  // must resolve visibility with an exact ray.
+  kShadowCubeUncertain,
+} ShadowCubeVisibility;
+
+// A software rasterized depth cube map centered on a point light. Each face
+// stores the view depth of the nearest occluder per texel, which is used to
+// answer visibility queries with percentage-closer filtering.
+class ShadowCubeMap {
+ public:
+  ShadowCubeMap();
+  // Allocates resolution x resolution texels per face around origin and
+  // clears every face to the far depth, discarding any prior state.
+  void Initialize(const vector3& origin, uint32 resolution, float32 far_depth);
+  // Returns true if the cube map has not been initialized.
+  bool IsEmpty() const;
+  // Rasterizes an occluding triangle into every face that it overlaps.
+  void RasterizeTriangle(const vector3& v0, const vector3& v1,
+                         const vector3& v2);
+  // Classifies the visibility of the origin from a point on a surface with the
+  // given normal.
+  ShadowCubeVisibility QueryVisibility(const vector3& point,
+                                       const vector3& normal) const;
+  // Returns the number of bytes of depth storage held by the cube map.
+  uint32 QueryMemoryUsage() const;
+
+ private:
+  // Rasterizes a triangle whose vertices are already in a face's clip space.
+  void RasterizeClippedTriangle(uint32 face, const ::base::vector4& c0,
+                                const ::base::vector4& c1,
+                                const ::base::vector4& c2);
+
+  vector3 origin_;
+  uint32 resolution_;
+  // The view projection transform for each face.
+  ::base::matrix4 face_transforms_[6];
+  // The world space offsets that one unit of clip space x, y and w map back
+  // to on each face.
+  vector3 face_rights_[6];
+  vector3 face_ups_[6];
+  vector3 face_views_[6];
+  // The nearest occluder depth for each texel of each face.
+  ::std::vector<float32> depths_[6];
+};
+
+#endif  // __SHADOW_CUBE_H__
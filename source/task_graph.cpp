@@ -0,0 +1,81 @@
+#include "task_graph.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+
+TaskGraph::TaskGraph() {}
+
+uint32 TaskGraph::AddTask(const ::std::function<void(uint32)>& task,
+                          uint32 priority) {
+  tasks_.push_back(task);
+  priorities_.push_back(priority);
+  successors_.emplace_back();
+  prerequisite_counts_.push_back(0);
+  return tasks_.size() - 1;
+}
+
+void TaskGraph::AddDependency(uint32 prerequisite, uint32 task) {
+  successors_[prerequisite].push_back(task);
+  prerequisite_counts_[task]++;
+}
+
+void TaskGraph::Run(ThreadPool* pool) {
+  uint32 task_count = tasks_.size();
+  ::std::vector<uint32> waiting(prerequisite_counts_);
+
+  // Ready tasks are ordered by priority, then by id.
+  typedef ::std::pair<uint32, uint32> ReadyTask;
+  ::std::priority_queue<ReadyTask, ::std::vector<ReadyTask>,
+                        ::std::greater<ReadyTask>>
+      ready;
+  ::std::mutex mutex;
+  ::std::condition_variable ready_changed;
+  uint32 unfinished = task_count;
+
+  for (uint32 i = 0; i < task_count; i++) {
+    if (!waiting[i]) {
+      ready.push(ReadyTask(priorities_[i], i));
+    }
+  }
+
+  auto run_tasks = [&](uint32, uint32 thread_index) {
+    while (true) {
+      uint32 task = 0;
+      {
+        ::std::unique_lock<::std::mutex> lock(mutex);
+        ready_changed.wait(lock,
+                           [&]() { return !ready.empty() || !unfinished; });
+        if (ready.empty()) {
+          return;
+        }
+
+        task = ready.top().second;
+        ready.pop();
+      }
+
+      if (tasks_[task]) {
+        tasks_[task](thread_index);
+      }
+
+      ::std::lock_guard<::std::mutex> lock(mutex);
+      for (uint32 successor : successors_[task]) {
+        if (!--waiting[successor]) {
+          ready.push(ReadyTask(priorities_[successor], successor));
+        }
+      }
+
+      // Wake the other threads for new work, or to return once the graph is
+      // done.
+      if (!--unfinished || !ready.empty()) {
+        ready_changed.notify_all();
+      }
+    }
+  };
+
+  if (task_count) {
+    pool->ParallelFor(pool->QueryThreadCount(), run_tasks);
+  }
+}
+
+uint32 TaskGraph::QueryTaskCount() const { return tasks_.size(); }
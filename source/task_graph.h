@@ -0,0 +1,71 @@
+/*
+//
+// Copyright (c) 1998-2014 Joe Bertolami. All Right Reserved.
+//
+//   Redistribution and use in source and binary forms, with or without
+//   modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, CLUDG, BUT NOT LIMITED TO, THE
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//   ARE DISCLAIMED.  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//   LIABLE FOR ANY DIRECT, DIRECT, CIDENTAL, SPECIAL, EXEMPLARY, OR
+//   CONSEQUENTIAL DAMAGES (CLUDG, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+//   GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSESS TERRUPTION)
+//   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER  CONTRACT, STRICT
+//   LIABILITY, OR TORT (CLUDG NEGLIGENCE OR OTHERWISE) ARISG  ANY WAY  OF THE
+//   USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Additional Information:
+//
+//   For more information, visit http://www.bertolami.com.
+//
+*/
+
+#ifndef __TASK_GRAPH_H__
+#define __TASK_GRAPH_H__
+
+#include <functional>
+#include <vector>
+
+#include "jmath/base.h"
+#include "thread_pool.h"
+
+using ::base::uint32;
+
+// A set of tasks and the order constraints between them. Running the graph
+// starts each task as soon as every task it depends on has finished, so that
+// independent stages overlap instead of waiting on one another at barriers.
+class TaskGraph {
+ public:
+  TaskGraph();
+  // Adds a task and returns its id. The task is called with the index of the
+  // pool thread that runs it. Among the tasks that are ready, those with a
+  // lower priority run first. A task without a function is a join point,
+  // which finishes as soon as its prerequisites have.
+  uint32 AddTask(const ::std::function<void(uint32)>& task, uint32 priority);
+  // Makes task wait until prerequisite has finished. The dependencies must not
+  // form a cycle.
+  void AddDependency(uint32 prerequisite, uint32 task);
+  // Runs every task on pool, and returns once all of them have finished.
+  void Run(ThreadPool* pool);
+  // Returns the number of tasks in the graph.
+  uint32 QueryTaskCount() const;
+
+ private:
+  ::std::vector<::std::function<void(uint32)>> tasks_;
+  ::std::vector<uint32> priorities_;
+  // The tasks that wait on each task.
+  ::std::vector<::std::vector<uint32>> successors_;
+  // The number of tasks that each task waits on.
+  ::std::vector<uint32> prerequisite_counts_;
+};
+
+#endif  // __TASK_GRAPH_H__
@@ -0,0 +1,103 @@
+#include "thread_pool.h"
+
+// The pool thread index of the current thread while it runs a task, or -1.
+thread_local uint32 g_pool_thread_index = (uint32)-1;
+
+ThreadPool::ThreadPool(uint32 thread_count)
+    : task_(NULL),
+      task_count_(0),
+      next_index_(0),
+      busy_workers_(0),
+      generation_(0),
+      stopping_(false) {
+  if (!thread_count) {
+    thread_count = ::std::thread::hardware_concurrency();
+  }
+
+  for (uint32 i = 1; i < thread_count; i++) {
+    workers_.emplace_back(&ThreadPool::RunWorker, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    ::std::lock_guard<::std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+
+  work_ready_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+uint32 ThreadPool::QueryThreadCount() const { return workers_.size() + 1; }
+
+void ThreadPool::ParallelFor(
+    uint32 count, const ::std::function<void(uint32, uint32)>& task) {
+  if (!count) {
+    return;
+  }
+
+  // Nested calls would wait on workers that are busy running their caller,
+  // and single threaded pools have no workers, so both run in place.
+  if (g_pool_thread_index != (uint32)-1 || workers_.empty()) {
+    uint32 thread_index =
+        (g_pool_thread_index != (uint32)-1) ? g_pool_thread_index : 0;
+    for (uint32 i = 0; i < count; i++) {
+      task(i, thread_index);
+    }
+    return;
+  }
+
+  ::std::lock_guard<::std::mutex> dispatch_lock(dispatch_mutex_);
+
+  {
+    ::std::lock_guard<::std::mutex> lock(mutex_);
+    task_ = &task;
+    task_count_ = count;
+    next_index_ = 0;
+    busy_workers_ = workers_.size();
+    generation_++;
+  }
+
+  work_ready_.notify_all();
+  RunTasks(0);
+
+  ::std::unique_lock<::std::mutex> lock(mutex_);
+  work_done_.wait(lock, [this]() { return !busy_workers_; });
+  task_ = NULL;
+}
+
+void ThreadPool::RunWorker(uint32 thread_index) {
+  uint64 generation = 0;
+  while (true) {
+    {
+      ::std::unique_lock<::std::mutex> lock(mutex_);
+      work_ready_.wait(lock, [&]() {
+        return stopping_ || generation != generation_;
+      });
+
+      if (stopping_) {
+        return;
+      }
+
+      generation = generation_;
+    }
+
+    RunTasks(thread_index);
+
+    ::std::lock_guard<::std::mutex> lock(mutex_);
+    if (!--busy_workers_) {
+      work_done_.notify_one();
+    }
+  }
+}
+
+void ThreadPool::RunTasks(uint32 thread_index) {
+  g_pool_thread_index = thread_index;
+  for (uint32 i = next_index_++; i < task_count_; i = next_index_++) {
+    (*task_)(i, thread_index);
+  }
+  g_pool_thread_index = (uint32)-1;
+}
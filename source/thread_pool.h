@@ -0,0 +1,92 @@
+/*
+//
+// Copyright (c) 1998-2014 Joe Bertolami. All Right Reserved.
+//
+//   Redistribution and use in source and binary forms, with or without
+//   modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, CLUDG, BUT NOT LIMITED TO, THE
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//   ARE DISCLAIMED.  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//   LIABLE FOR ANY DIRECT, DIRECT, CIDENTAL, SPECIAL, EXEMPLARY, OR
+//   CONSEQUENTIAL DAMAGES (CLUDG, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+//   GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSESS TERRUPTION)
+//   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER  CONTRACT, STRICT
+//   LIABILITY, OR TORT (CLUDG NEGLIGENCE OR OTHERWISE) ARISG  ANY WAY  OF THE
+//   USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Additional Information:
+//
+//   For more information, visit http://www.bertolami.com.
+//
+*/
+
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "jmath/base.h"
+
+using ::base::uint32;
+using ::base::uint64;
+
+// A fixed set of worker threads that lives as long as its owner, so that every
+// stage of a bake reuses the same threads instead of starting its own.
+class ThreadPool {
+ public:
+  // Starts the pool with thread_count threads in total, counting the thread
+  // that calls ParallelFor. Zero selects one thread per hardware thread.
+  explicit ThreadPool(uint32 thread_count = 0);
+  // Stops and joins the workers.
+  ~ThreadPool();
+  // Returns the number of threads that run tasks, including the caller's.
+  uint32 QueryThreadCount() const;
+  // Calls task(index, thread_index) for every index in [0, count), spread
+  // over the pool, and returns once every call has finished. thread_index is
+  // below QueryThreadCount() and is never shared by two calls running at the
+  // same time, so it can select per-thread scratch state. A ParallelFor made
+  // from within a task runs serially on the thread that made it.
+  void ParallelFor(uint32 count,
+                   const ::std::function<void(uint32, uint32)>& task);
+
+ private:
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Waits for work and runs it until the pool stops.
+  void RunWorker(uint32 thread_index);
+  // Claims and runs indices of the current task until none are left.
+  void RunTasks(uint32 thread_index);
+
+  ::std::vector<::std::thread> workers_;
+  // Serializes ParallelFor calls from different threads.
+  ::std::mutex dispatch_mutex_;
+  // Guards everything below except next_index_.
+  ::std::mutex mutex_;
+  ::std::condition_variable work_ready_;
+  ::std::condition_variable work_done_;
+  const ::std::function<void(uint32, uint32)>* task_;
+  uint32 task_count_;
+  ::std::atomic<uint32> next_index_;
+  // The number of workers still running the current task.
+  uint32 busy_workers_;
+  // Incremented for every task, so that workers can tell new work apart.
+  uint64 generation_;
+  bool stopping_;
+};
+
+#endif  // __THREAD_POOL_H__
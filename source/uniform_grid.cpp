@@ -0,0 +1,254 @@
+#include "uniform_grid.h"
+
+#include <cmath>
+
+#include "jmath/intersect.h"
+
+#define UNIFORM_GRID_MAX_RESOLUTION (256)
+// Cells are grown by this fraction of their size when they are filled, so
+// that rounding in a walk can never step past a triangle the segment touches.
+#define UNIFORM_GRID_CELL_PADDING (0.01f)
+
+using ::base::bounds;
+
+UniformGrid::UniformGrid() : occupied_cells_(0) {
+  resolution_[0] = resolution_[1] = resolution_[2] = 0;
+}
+
+void UniformGrid::Clear() {
+  grid_bounds_.clear();
+  resolution_[0] = resolution_[1] = resolution_[2] = 0;
+  cell_offsets_.clear();
+  cell_triangles_.clear();
+  occupied_cells_ = 0;
+}
+
+bool UniformGrid::IsEmpty() const { return cell_triangles_.empty(); }
+
+void UniformGrid::Build(const ::std::vector<vector3>& positions,
+                        float32 density) {
+  Clear();
+
+  uint32 triangle_count = positions.size() / 3;
+  if (!triangle_count) {
+    return;
+  }
+
+  vector3 scene_min = positions[0];
+  vector3 scene_max = positions[0];
+  for (uint32 i = 1; i < triangle_count * 3; i++) {
+    for (uint32 axis = 0; axis < 3; axis++) {
+      scene_min[axis] = min(scene_min[axis], positions[i][axis]);
+      scene_max[axis] = max(scene_max[axis], positions[i][axis]);
+    }
+  }
+
+  // Pad the grid so that flat scenes have some depth and triangles on its
+  // faces lie strictly inside.
+  vector3 extent = scene_max - scene_min;
+  float32 padding =
+      max(1.0e-3f * max(extent.x, max(extent.y, extent.z)), BASE_EPSILON);
+  for (uint32 axis = 0; axis < 3; axis++) {
+    scene_min[axis] -= padding;
+    scene_max[axis] += padding;
+  }
+  extent = scene_max - scene_min;
+  grid_bounds_.bounds_min = scene_min;
+  grid_bounds_.bounds_max = scene_max;
+  grid_bounds_.vector_count = 2;
+
+  // Choose cubic cells such that there are about density cells per triangle.
+  float32 cells_per_unit =
+      pow(density * triangle_count / (extent.x * extent.y * extent.z),
+          1.0f / 3.0f);
+  uint32 cell_count = 1;
+  for (uint32 axis = 0; axis < 3; axis++) {
+    resolution_[axis] = (uint32)::base::clip_range(
+        extent[axis] * cells_per_unit, 1.0f,
+        (float32)UNIFORM_GRID_MAX_RESOLUTION);
+    cell_size_[axis] = extent[axis] / resolution_[axis];
+    inverse_cell_size_[axis] = resolution_[axis] / extent[axis];
+    cell_count *= resolution_[axis];
+  }
+
+  // Gather (cell, triangle) pairs in triangle order, then sort them into cell
+  // lists with a counting sort so that each list stays in triangle order.
+  ::std::vector<uint32> pair_cells;
+  ::std::vector<uint32> pair_triangles;
+  pair_cells.reserve(triangle_count * 2);
+  pair_triangles.reserve(triangle_count * 2);
+
+  for (uint32 i = 0; i < triangle_count; i++) {
+    const vector3& v0 = positions[i * 3 + 0];
+    const vector3& v1 = positions[i * 3 + 1];
+    const vector3& v2 = positions[i * 3 + 2];
+    int32 first_cell[3], last_cell[3];
+
+    for (uint32 axis = 0; axis < 3; axis++) {
+      float32 lower = min(v0[axis], min(v1[axis], v2[axis]));
+      float32 upper = max(v0[axis], max(v1[axis], v2[axis]));
+      float32 cell_padding = UNIFORM_GRID_CELL_PADDING * cell_size_[axis];
+      first_cell[axis] = (int32)floor((lower - cell_padding - scene_min[axis]) *
+                                      inverse_cell_size_[axis]);
+      last_cell[axis] = (int32)floor((upper + cell_padding - scene_min[axis]) *
+                                     inverse_cell_size_[axis]);
+      first_cell[axis] =
+          max(0, min(first_cell[axis], (int32)resolution_[axis] - 1));
+      last_cell[axis] =
+          max(0, min(last_cell[axis], (int32)resolution_[axis] - 1));
+    }
+
+    bool single_cell = first_cell[0] == last_cell[0] &&
+                       first_cell[1] == last_cell[1] &&
+                       first_cell[2] == last_cell[2];
+
+    for (int32 z = first_cell[2]; z <= last_cell[2]; z++) {
+      for (int32 y = first_cell[1]; y <= last_cell[1]; y++) {
+        for (int32 x = first_cell[0]; x <= last_cell[0]; x++) {
+          if (!single_cell) {
+            int32 cell[3] = {x, y, z};
+            bounds cell_bounds;
+            for (uint32 axis = 0; axis < 3; axis++) {
+              float32 cell_padding =
+                  UNIFORM_GRID_CELL_PADDING * cell_size_[axis];
+              cell_bounds.bounds_min[axis] = scene_min[axis] +
+                                             cell[axis] * cell_size_[axis] -
+                                             cell_padding;
+              cell_bounds.bounds_max[axis] =
+                  scene_min[axis] + (cell[axis] + 1) * cell_size_[axis] +
+                  cell_padding;
+            }
+            cell_bounds.vector_count = 2;
+
+            if (!::base::triangle_intersect_bounds(v0, v1, v2, cell_bounds)) {
+              continue;
+            }
+          }
+
+          pair_cells.push_back((z * resolution_[1] + y) * resolution_[0] + x);
+          pair_triangles.push_back(i);
+        }
+      }
+    }
+  }
+
+  cell_offsets_.assign(cell_count + 1, 0);
+  for (uint32 cell : pair_cells) {
+    cell_offsets_[cell + 1]++;
+  }
+
+  for (uint32 i = 0; i < cell_count; i++) {
+    occupied_cells_ += cell_offsets_[i + 1] != 0;
+    cell_offsets_[i + 1] += cell_offsets_[i];
+  }
+
+  ::std::vector<uint32> cursors(cell_offsets_.begin(), cell_offsets_.end() - 1);
+  cell_triangles_.resize(pair_triangles.size());
+  for (uint32 i = 0; i < pair_cells.size(); i++) {
+    cell_triangles_[cursors[pair_cells[i]]++] = pair_triangles[i];
+  }
+}
+
+bool UniformGrid::BeginWalk(const vector3& start, const vector3& dir,
+                            float32 t_max, UniformGridWalk* walk) const {
+  walk->finished = true;
+  if (IsEmpty()) {
+    return false;
+  }
+
+  // Clip the segment against the grid bounds.
+  float32 t_enter = 0.0f;
+  float32 t_exit = t_max;
+  for (uint32 axis = 0; axis < 3; axis++) {
+    if (dir[axis] == 0.0f) {
+      if (start[axis] < grid_bounds_.bounds_min[axis] ||
+          start[axis] > grid_bounds_.bounds_max[axis]) {
+        return false;
+      }
+      continue;
+    }
+
+    float32 inverse_dir = 1.0f / dir[axis];
+    float32 t0 = (grid_bounds_.bounds_min[axis] - start[axis]) * inverse_dir;
+    float32 t1 = (grid_bounds_.bounds_max[axis] - start[axis]) * inverse_dir;
+    t_enter = max(t_enter, min(t0, t1));
+    t_exit = min(t_exit, max(t0, t1));
+  }
+
+  if (t_enter > t_exit) {
+    return false;
+  }
+
+  for (uint32 axis = 0; axis < 3; axis++) {
+    float32 entry = start[axis] + dir[axis] * t_enter;
+    int32 cell = (int32)floor((entry - grid_bounds_.bounds_min[axis]) *
+                              inverse_cell_size_[axis]);
+    cell = max(0, min(cell, (int32)resolution_[axis] - 1));
+    walk->cell[axis] = cell;
+
+    if (dir[axis] > 0.0f) {
+      walk->step[axis] = 1;
+      walk->t_next[axis] = (grid_bounds_.bounds_min[axis] +
+                            (cell + 1) * cell_size_[axis] - start[axis]) /
+                           dir[axis];
+      walk->t_delta[axis] = cell_size_[axis] / dir[axis];
+    } else if (dir[axis] < 0.0f) {
+      walk->step[axis] = -1;
+      walk->t_next[axis] = (grid_bounds_.bounds_min[axis] +
+                            cell * cell_size_[axis] - start[axis]) /
+                           dir[axis];
+      walk->t_delta[axis] = -cell_size_[axis] / dir[axis];
+    } else {
+      walk->step[axis] = 0;
+      walk->t_next[axis] = BASE_INFINITY;
+      walk->t_delta[axis] = BASE_INFINITY;
+    }
+  }
+
+  walk->t_exit = t_exit;
+  walk->finished = false;
+  return true;
+}
+
+bool UniformGrid::StepWalk(UniformGridWalk* walk, const uint32** triangles,
+                           uint32* triangle_count,
+                           float32* t_cell_exit) const {
+  if (walk->finished) {
+    return false;
+  }
+
+  uint32 cell =
+      (walk->cell[2] * resolution_[1] + walk->cell[1]) * resolution_[0] +
+      walk->cell[0];
+  *triangles = &cell_triangles_[0] + cell_offsets_[cell];
+  *triangle_count = cell_offsets_[cell + 1] - cell_offsets_[cell];
+
+  // Advance across the nearest cell boundary.
+  uint32 axis = walk->t_next[0] < walk->t_next[1]
+                    ? (walk->t_next[0] < walk->t_next[2] ? 0 : 2)
+                    : (walk->t_next[1] < walk->t_next[2] ? 1 : 2);
+  *t_cell_exit = min(walk->t_next[axis], walk->t_exit);
+
+  if (walk->t_next[axis] > walk->t_exit) {
+    walk->finished = true;
+  } else {
+    walk->cell[axis] += walk->step[axis];
+    walk->t_next[axis] += walk->t_delta[axis];
+    walk->finished = walk->cell[axis] < 0 ||
+                     walk->cell[axis] >= (int32)resolution_[axis];
+  }
+
+  return true;
+}
+
+const uint32* UniformGrid::QueryResolution() const { return resolution_; }
+
+float32 UniformGrid::QueryOccupancy() const {
+  uint32 cell_count = resolution_[0] * resolution_[1] * resolution_[2];
+  return cell_count ? (float32)occupied_cells_ / cell_count : 0.0f;
+}
+
+uint64 UniformGrid::QueryMemoryUsage() const {
+  return (uint64)(cell_offsets_.size() + cell_triangles_.size()) *
+         sizeof(uint32);
+}
@@ -0,0 +1,103 @@
+/*
+//
+// Copyright (c) 1998-2014 Joe Bertolami. All Right Reserved.
+//
+//   Redistribution and use in source and binary forms, with or without
+//   modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//   AND ANY EXPRESS OR IMPLIED WARRANTIES, CLUDG, BUT NOT LIMITED TO, THE
+//   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//   ARE DISCLAIMED.  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//   LIABLE FOR ANY DIRECT, DIRECT, CIDENTAL, SPECIAL, EXEMPLARY, OR
+//   CONSEQUENTIAL DAMAGES (CLUDG, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+//   GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSESS TERRUPTION)
+//   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER  CONTRACT, STRICT
+//   LIABILITY, OR TORT (CLUDG NEGLIGENCE OR OTHERWISE) ARISG  ANY WAY  OF THE
+//   USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Additional Information:
+//
+//   For more information, visit http://www.bertolami.com.
+//
+*/
+
+#ifndef __UNIFORM_GRID_H__
+#define __UNIFORM_GRID_H__
+
+#include <vector>
+
+#include "jmath/base.h"
+#include "jmath/vector3.h"
+#include "jmath/volume.h"
+
+using ::base::float32;
+using ::base::int32;
+using ::base::uint32;
+using ::base::uint64;
+using ::base::vector3;
+
+// The state of a 3D-DDA walk along a segment start + t * dir through the
+// cells of a UniformGrid.
+typedef struct UniformGridWalk {
+  // The current cell and the direction of travel along each axis.
+  int32 cell[3];
+  int32 step[3];
+  // The parametric distance at which the segment next crosses a cell boundary
+  // along each axis, and the distance between crossings.
+  float32 t_next[3];
+  float32 t_delta[3];
+  // The parametric distance at which the segment leaves the grid.
+  float32 t_exit;
+  bool finished;
+} UniformGridWalk;
+
+// A uniform grid of cells over a set of triangles. Each cell lists every
+// triangle that overlaps it, so a walk along a segment visits every triangle
+// the segment could hit, in roughly front to back order.
+class UniformGrid {
+ public:
+  UniformGrid();
+  // Builds the grid over triangles whose vertices are stored consecutively
+  // in positions, with about density cells per triangle.
+  void Build(const ::std::vector<vector3>& positions, float32 density);
+  // Discards the grid.
+  void Clear();
+  // Returns true if the grid contains no triangles.
+  bool IsEmpty() const;
+  // Begins a walk along start + t * dir for t in [0, t_max]. Returns false if
+  // the segment misses the grid entirely.
+  bool BeginWalk(const vector3& start, const vector3& dir, float32 t_max,
+                 UniformGridWalk* walk) const;
+  // Returns the triangles of the walk's current cell and the parametric
+  // distance at which the segment leaves that cell, then advances the walk.
+  // Returns false once the walk has left the grid or passed t_max.
+  bool StepWalk(UniformGridWalk* walk, const uint32** triangles,
+                uint32* triangle_count, float32* t_cell_exit) const;
+  // Returns the number of cells along each axis.
+  const uint32* QueryResolution() const;
+  // Returns the fraction of cells that hold at least one triangle.
+  float32 QueryOccupancy() const;
+  // Returns the size of the cell lists in bytes.
+  uint64 QueryMemoryUsage() const;
+
+ private:
+  ::base::bounds grid_bounds_;
+  uint32 resolution_[3];
+  float32 cell_size_[3];
+  float32 inverse_cell_size_[3];
+  // cell_triangles_[cell_offsets_[i], cell_offsets_[i + 1]) are the triangles
+  // of cell i, where i = (z * resolution_[1] + y) * resolution_[0] + x.
+  ::std::vector<uint32> cell_offsets_;
+  ::std::vector<uint32> cell_triangles_;
+  uint32 occupied_cells_;
+};
+
+#endif  // __UNIFORM_GRID_H__